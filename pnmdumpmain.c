@@ -1,7 +1,30 @@
+// Required for sysconf, pread/pwrite, mmap, clock_gettime and POSIX threads
+// under -std=c99, and for 64 bit file offsets on 32 bit systems
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+// Required for copy_file_range and sendfile, which copy data between files
+// without passing it through user space
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -12,14 +35,73 @@
  * @brief      An enum listing the supported types of Pgm file.
  *
  * @field      UNKNOWN  The type is unknown.
+ * @field      P1       The type is a plain (ASCII) bitmap, read as max 1 grey.
  * @field      P2       The type is of P2 format.
+ * @field      P3       The type is a plain (ASCII) colour pixmap.
+ * @field      P4       The type is a raw bitmap, eight pixels to a byte.
  * @field      P5       The type is of P5 format.
+ * @field      P6       The type is a raw colour pixmap.
+ * @field      P7       The type is a pam, with its channels named in the header.
+ * @field      PF       The type is a little or big endian pfm, holding float
+ *                      samples in rows stored from the bottom up.
+ * @field      PNG      The type is a png image, only supported for output.
  */
 enum PgmType
 {
     UNKNOWN,
+    P1,
     P2,
-    P5
+    P3,
+    P4,
+    P5,
+    P6,
+    P7,
+    PF,
+    PNG
+};
+
+
+/**
+ * @brief      An enum listing the orientation changes which can be applied to
+ *             an image, i.e. the rotations and reflections of a rectangle.
+ *
+ * @field      ORIENT_IDENTITY        The orientation is unchanged.
+ * @field      ORIENT_TRANSPOSE       Reflection in the line y=-x.
+ * @field      ORIENT_ROTATE90        Rotation by 90 degrees clockwise.
+ * @field      ORIENT_ROTATE180       Rotation by 180 degrees.
+ * @field      ORIENT_ROTATE270       Rotation by 270 degrees clockwise.
+ * @field      ORIENT_FLIP_H          Reflection left to right.
+ * @field      ORIENT_FLIP_V          Reflection top to bottom.
+ * @field      ORIENT_ANTI_TRANSPOSE  Reflection in the line y=x.
+ */
+enum Orientation
+{
+    ORIENT_IDENTITY,
+    ORIENT_TRANSPOSE,
+    ORIENT_ROTATE90,
+    ORIENT_ROTATE180,
+    ORIENT_ROTATE270,
+    ORIENT_FLIP_H,
+    ORIENT_FLIP_V,
+    ORIENT_ANTI_TRANSPOSE
+};
+
+
+/**
+ * @brief      An enum listing the ways samples can be stored in a Raster.
+ *
+ * @field      SAMPLE_U8   One unsigned byte per sample, for max values <= 255.
+ * @field      SAMPLE_U16  Two unsigned bytes per sample, for max values <= 65535.
+ * @field      SAMPLE_F32  A 32 bit float per sample, used for pfm input.
+ * @field      SAMPLE_F64  A 64 bit double per sample, used for intermediate
+ *                         results of chained operations.
+ */
+enum SampleType
+{
+    SAMPLE_U8,
+    SAMPLE_U16,
+    SAMPLE_F32,
+    SAMPLE_F64
 };
 
 
@@ -36,16 +118,94 @@ enum ScaleType
 };
 
 
+/**
+ * @brief      An enum listing the supported methods of dithering.
+ *
+ * @field      DITHER_FS     Floyd-Steinberg error diffusion.
+ * @field      DITHER_BAYER  Ordered dithering by an 8x8 Bayer matrix.
+ */
+enum DitherType
+{
+    DITHER_FS,
+    DITHER_BAYER
+};
+
+
+/**
+ * @brief      An enum listing the kinds of node in an operation chain.
+ *
+ * @field      OP_READ       Reads rows from the input file.
+ * @field      OP_ORIENT     Rotates or reflects the image.
+ * @field      OP_SCALE      Scales the image by nearest neighbour or bilinear.
+ * @field      OP_INVERT     Inverts each sample, i.e. max - value.
+ * @field      OP_THRESHOLD  Sets each sample to max or 0 about a threshold.
+ * @field      OP_BLUR       Averages each sample with its 3x3 neighbourhood.
+ * @field      OP_REMAP      Moves each sample to a position given by a map.
+ * @field      OP_WARP       Applies a perspective transform (homography).
+ */
+enum OpType
+{
+    OP_READ,
+    OP_ORIENT,
+    OP_SCALE,
+    OP_INVERT,
+    OP_THRESHOLD,
+    OP_BLUR,
+    OP_REMAP,
+    OP_WARP
+};
+
+
+/**
+ * @brief      An enum listing the ways a stack of frames can be combined.
+ *
+ * @field      STACK_MEAN    Each sample is the mean of the frames' samples.
+ * @field      STACK_MEDIAN  Each sample is the median of the frames' samples.
+ * @field      STACK_MAX     Each sample is the largest of the frames' samples.
+ * @field      STACK_MIN     Each sample is the smallest of the frames' samples.
+ */
+enum StackType
+{
+    STACK_MEAN,
+    STACK_MEDIAN,
+    STACK_MAX,
+    STACK_MIN
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //                                  Structs                                   //
 ////////////////////////////////////////////////////////////////////////////////
 
+// The most operations which can be chained by --chain
+#define MAX_OPS 32
+
 // These declarations are required for compilation. ConversionArgs references
 // PgmConverter which references ConversionArgs...
 typedef struct PgmFile PgmFile;
+typedef struct Raster Raster;
 typedef struct PgmConverter PgmConverter;
 typedef struct ScaleArgs ScaleArgs;
 typedef struct ConversionArgs ConversionArgs;
+typedef struct ByteBuffer ByteBuffer;
+typedef struct PngBand PngBand;
+typedef struct OpNode OpNode;
+typedef struct OpGraph OpGraph;
+typedef struct Tile Tile;
+typedef struct ScaleAxis ScaleAxis;
+typedef struct ScalePlan ScalePlan;
+typedef struct Remap Remap;
+typedef struct FrameStack FrameStack;
+typedef struct StackBand StackBand;
+typedef struct TemplateMatch TemplateMatch;
+typedef struct MatchCandidate MatchCandidate;
+typedef struct LabelRun LabelRun;
+typedef struct LabelStripe LabelStripe;
+typedef struct DistanceMap DistanceMap;
+typedef struct Ditherer Ditherer;
+typedef struct Pyramid Pyramid;
+typedef struct FrameSpans FrameSpans;
+typedef struct LinearTables LinearTables;
 
 
 /**
@@ -57,6 +217,14 @@ typedef struct ConversionArgs ConversionArgs;
  * @field      height        The number of rows in the image.
  * @field      maxDataValue  The maximum value of the data.
  * @field      type          The pgm type, e.g. P2 or P5.
+ * @field      isLittleEndian  True if a pfm file's samples are little endian.
+ * @field      linear        The tables converting samples to and from linear
+ *                           light, or NULL to use the samples as they are.
+ * @field      depth         The number of channels per pixel in the file, e.g.
+ *                           3 for P6. Colour is read as its grey level.
+ * @field      isInterleaved  True if rows are read and written with every
+ *                           channel of each pixel, for pam output, rather than
+ *                           as grey levels.
  */
 struct PgmFile
 {
@@ -66,6 +234,27 @@ struct PgmFile
     int height;
     int maxDataValue;
     enum PgmType type;
+    bool isLittleEndian;
+    const LinearTables *linear;
+    int depth;
+    bool isInterleaved;
+};
+
+
+/**
+ * @brief      An image held in memory, one sample per pixel.
+ *
+ * @field      width       The number of columns in the image.
+ * @field      height      The number of rows in the image.
+ * @field      sampleType  How each sample is stored.
+ * @field      pixels      The samples, row by row from the top.
+ */
+struct Raster
+{
+    int width;
+    int height;
+    enum SampleType sampleType;
+    void *pixels;
 };
 
 
@@ -78,6 +267,7 @@ struct PgmFile
  * @field      isEnlarge  True if the output image is larger than the input.
  * @field      hScale     The height (row) scale factor.
  * @field      wScale     The width (column) scale factor.
+ * @field      plan       The source positions of the scaled rows and columns.
  */
 struct ScaleArgs
 {
@@ -86,6 +276,58 @@ struct ScaleArgs
     bool isEnlarge;
     double hScale;
     double wScale;
+    const ScalePlan *plan;
+};
+
+
+/**
+ * @brief      The source positions of the rows, or columns, of a scaled image,
+ *             tabulated once so that scaling does no per sample division.
+ *
+ * @field      index          The source sample each output sample lies in.
+ * @field      fraction       How far each output sample lies past its source
+ *                            sample, for interpolation.
+ * @field      innerIndex     As index, for bilinear interpolation away from
+ *                            the edges, which is offset by half a sample.
+ * @field      innerFraction  As fraction, for innerIndex.
+ * @field      coverage       The number of source samples each output sample
+ *                            averages when box scaling.
+ */
+struct ScaleAxis
+{
+    int *index;
+    double *fraction;
+    int *innerIndex;
+    double *innerFraction;
+    int coverage;
+};
+
+
+/**
+ * @brief      A plan for scaling images of one size by one factor. Plans are
+ *             built once and cached, keyed by every field but rows and cols.
+ *
+ * @field      getData    The data retrieval function the plan is for.
+ * @field      inWidth    The width of the input image.
+ * @field      inHeight   The height of the input image.
+ * @field      outWidth   The width of the scaled image.
+ * @field      outHeight  The height of the scaled image.
+ * @field      hScale     The height (row) scale factor.
+ * @field      wScale     The width (column) scale factor.
+ * @field      rows       The source positions of the scaled rows.
+ * @field      cols       The source positions of the scaled columns.
+ */
+struct ScalePlan
+{
+    double (*getData)(PgmConverter *c, int row, int col);
+    int inWidth;
+    int inHeight;
+    int outWidth;
+    int outHeight;
+    double hScale;
+    double wScale;
+    ScaleAxis rows;
+    ScaleAxis cols;
 };
 
 
@@ -96,12 +338,25 @@ struct ScaleArgs
  * @field      isSwapWidthHeight  True if a transformation swaps rows and
  *                                columns.
  * @field      isScale            True if the image is being resized.
+ * @field      orientation        The orientation change applied in place to
+ *                                the input data once it is read.
+ * @field      memLimit           The most memory, in bytes, the input raster
+ *                                may use before rotations run out of core, or 0
+ *                                for no limit.
+ * @field      isLinear           True if samples are processed in linear
+ *                                light rather than as encoded (sRGB).
+ * @field      isSerial           True if the output is encoded on the calling
+ *                                thread alone, as it is already a parallel job.
  */
 struct ConversionArgs
 {
-    int (*getData)(PgmConverter *c, int row, int col);
+    double (*getData)(PgmConverter *c, int row, int col);
     bool isSwapWidthHeight;
     bool isScale;
+    enum Orientation orientation;
+    size_t memLimit;
+    bool isLinear;
+    bool isSerial;
 };
 
 
@@ -112,7 +367,12 @@ struct ConversionArgs
  * @field      oF     The output pgm file information.
  * @field      cArgs  The conversion information.
  * @field      sArgs  The scaling information.
- * @field      data   The input data, parsed from iF.
+ * @field      data   The input data, parsed from iF. Data is only truncated to
+ *                an integer when written to an integer output type.
+ * @field      source  The chain node whose upstream rows supply the input data
+ *                in place of data, or NULL.
+ * @field      tile   A region of the input which supplies the input data in
+ *                place of data, or NULL.
  */
 struct PgmConverter
 {
@@ -120,7 +380,478 @@ struct PgmConverter
     PgmFile *oF;
     ConversionArgs *cArgs;
     ScaleArgs *sArgs;
-    int data[512][512];
+    Raster data;
+    OpNode *source;
+    const Tile *tile;
+};
+
+
+/**
+ * @brief      A growable byte buffer which encoded output is built up in. Bits
+ *             are packed least significant bit first, as deflate requires.
+ *
+ * @field      bytes     The buffer contents.
+ * @field      length    The number of bytes written to the buffer.
+ * @field      capacity  The number of bytes allocated for the buffer.
+ * @field      bitBuf    Bits waiting to be flushed into the buffer.
+ * @field      bitCount  The number of bits held in bitBuf.
+ * @field      isFailed  True if an allocation failed while writing.
+ */
+struct ByteBuffer
+{
+    unsigned char *bytes;
+    size_t length;
+    size_t capacity;
+    uint32_t bitBuf;
+    int bitCount;
+    bool isFailed;
+};
+
+
+/**
+ * @brief      A horizontal band of rows of a png image. Each band is filtered
+ *             and compressed independently so that bands can be encoded in
+ *             parallel and their deflate blocks concatenated.
+ *
+ * @field      c         The converter supplying the image data.
+ * @field      row       The first image row in the band.
+ * @field      rowCount  The number of image rows in the band.
+ * @field      bitDepth  The png sample bit depth, 8 or 16.
+ * @field      isLast    True if this is the final band of the image.
+ * @field      adler     The adler32 checksum of the band's filtered bytes.
+ * @field      length    The number of filtered bytes in the band.
+ * @field      out       The compressed deflate blocks for the band.
+ */
+struct PngBand
+{
+    PgmConverter *c;
+    int row;
+    int rowCount;
+    int bitDepth;
+    bool isLast;
+    uint32_t adler;
+    size_t length;
+    ByteBuffer out;
+};
+
+
+/**
+ * @brief      A map giving the source position of every output sample, as
+ *             fixed point coordinates with REMAP_FRACTION_BITS fraction bits.
+ *
+ * @field      width   The width of the output image.
+ * @field      height  The height of the output image.
+ * @field      x       The source column of each output sample, row by row.
+ * @field      y       The source row of each output sample, row by row.
+ */
+struct Remap
+{
+    int width;
+    int height;
+    int32_t *x;
+    int32_t *y;
+};
+
+
+/**
+ * @brief      A node of an operation chain. Each node produces its output rows
+ *             on demand, pulling only the upstream rows it needs into a small
+ *             ring of cached rows, so that a chain holds a few rows per stage
+ *             rather than an image per stage.
+ *
+ * @field      type             The operation the node performs.
+ * @field      graph            The graph the node belongs to.
+ * @field      upstream         The node supplying input rows, NULL for a reader.
+ * @field      width            The number of columns the node outputs.
+ * @field      height           The number of rows the node outputs.
+ * @field      maxDataValue     The maximum value of the node's output.
+ * @field      row              The most recently produced output row.
+ * @field      cache            Ring of cached upstream rows.
+ * @field      cacheRows        The number of slots in the cache.
+ * @field      nextUpstreamRow  The next row to pull from upstream.
+ * @field      orientation      The orientation change of an OP_ORIENT node.
+ * @field      raster           The whole upstream image, held by OP_ORIENT,
+ *                              OP_REMAP and OP_WARP nodes which cannot work a
+ *                              row at a time.
+ * @field      isHeld           True once raster holds the current image.
+ * @field      threshold        The threshold of an OP_THRESHOLD node.
+ * @field      remap            The map of an OP_REMAP node.
+ * @field      warp             The inverse homography of an OP_WARP node,
+ *                              mapping output to source positions.
+ * @field      viewIn           Upstream dimensions as seen by view.
+ * @field      viewOut          Output dimensions as seen by view.
+ * @field      sArgs            Scaling information of an OP_SCALE node.
+ * @field      cArgs            Conversion information of an OP_SCALE node.
+ * @field      view             A converter which reads upstream rows, so that
+ *                              OP_SCALE nodes use the data retrieval functions.
+ */
+struct OpNode
+{
+    enum OpType type;
+    OpGraph *graph;
+    OpNode *upstream;
+    int width;
+    int height;
+    int maxDataValue;
+    double *row;
+    double *cache;
+    int cacheRows;
+    int nextUpstreamRow;
+    enum Orientation orientation;
+    Raster raster;
+    bool isHeld;
+    double threshold;
+    Remap remap;
+    double warp[9];
+    PgmFile viewIn;
+    PgmFile viewOut;
+    ScaleArgs sArgs;
+    ConversionArgs cArgs;
+    PgmConverter view;
+};
+
+
+/**
+ * @brief      A chain of operations, pulled from the last node to the reader.
+ *
+ * @field      nodes         The nodes, the reader first.
+ * @field      count         The number of nodes.
+ * @field      iF            The input file information.
+ * @field      dataStart     The file offset of the first input sample.
+ * @field      isFailed      True once reading the input has failed.
+ * @field      isStream      True if the input holds further frames after the
+ *                           image, so none of its trailing data is read.
+ * @field      input         The whole input image when the output is computed
+ *                           in tiles, otherwise no pixels.
+ * @field      band          Output rows computed from tiles.
+ * @field      bandRow       The first output row held in band.
+ * @field      bandRows      The number of rows band holds.
+ * @field      isTileFailed  True for each tile of band which could not be
+ *                           computed, set only by that tile's job.
+ */
+struct OpGraph
+{
+    OpNode nodes[MAX_OPS + 1];
+    int count;
+    PgmFile *iF;
+    off_t dataStart;
+    bool isFailed;
+    bool isStream;
+    Raster input;
+    double *band;
+    int bandRow;
+    int bandRows;
+    bool *isTileFailed;
+};
+
+
+/**
+ * @brief      A rectangular region of an image, used to run a chain of
+ *             operations one tile at a time.
+ *
+ * @field      row     The first image row in the region.
+ * @field      col     The first image column in the region.
+ * @field      width   The number of columns in the region.
+ * @field      height  The number of rows in the region.
+ * @field      pixels  The region's samples, row by row from the top.
+ */
+struct Tile
+{
+    int row;
+    int col;
+    int width;
+    int height;
+    double *pixels;
+};
+
+
+/**
+ * @brief      A stack of frames of one size, drawn from one or more files,
+ *             whose rows are read directly from the files when needed. Frames
+ *             other than P5 are first decoded to a spool file laid out as P5.
+ *
+ * @field      type          How the frames are combined.
+ * @field      width         The number of columns in each frame.
+ * @field      height        The number of rows in each frame.
+ * @field      maxDataValue  The maximum value of the data.
+ * @field      frameCount    The number of frames.
+ * @field      capacity      The number of frames fds and offsets can hold.
+ * @field      fds           The file descriptor of the file holding each frame.
+ * @field      offsets       The file offset of the first sample of each frame.
+ * @field      spool         The temporary file frames other than P5 are
+ *                           decoded to, or NULL.
+ */
+struct FrameStack
+{
+    enum StackType type;
+    int width;
+    int height;
+    int maxDataValue;
+    int frameCount;
+    int capacity;
+    int *fds;
+    off_t *offsets;
+    FILE *spool;
+};
+
+
+/**
+ * @brief      A horizontal band of rows of a combined frame stack. Bands are
+ *             combined in parallel, each reading only its own rows.
+ *
+ * @field      s          The frame stack.
+ * @field      row        The first output row in the band.
+ * @field      rowCount   The number of output rows in the band.
+ * @field      out        Output for the band's rows.
+ * @field      frameRows  One row of each frame for median stacking, otherwise
+ *                        one row of a single frame.
+ * @field      sums       The running total, or extreme, of each column.
+ * @field      values     The samples of one column of every frame.
+ * @field      isFailed   True if a frame could not be read.
+ */
+struct StackBand
+{
+    const FrameStack *s;
+    int row;
+    int rowCount;
+    double *out;
+    uint16_t *frameRows;
+    uint64_t *sums;
+    uint16_t *values;
+    bool isFailed;
+};
+
+
+/**
+ * @brief      The state shared by the tiles of a template match. Scores are
+ *             the normalized cross-correlation of the template with the window
+ *             of the image at each position.
+ *
+ * @field      width      The number of columns in the image.
+ * @field      height     The number of rows in the image.
+ * @field      image      The image samples, row by row.
+ * @field      tWidth     The number of columns in the template.
+ * @field      tHeight    The number of rows in the template.
+ * @field      tmpl       The template samples less their mean, row by row.
+ * @field      tNorm      The sum of the squares of tmpl.
+ * @field      sums       The integral image of the samples, with a leading
+ *                        row and column of zeros.
+ * @field      squares    The integral image of the squared samples, likewise.
+ * @field      outWidth   The number of columns of positions.
+ * @field      outHeight  The number of rows of positions.
+ * @field      tileCols   The number of tiles across the positions.
+ * @field      scores     The score of each position, row by row.
+ */
+struct TemplateMatch
+{
+    int width;
+    int height;
+    double *image;
+    int tWidth;
+    int tHeight;
+    double *tmpl;
+    double tNorm;
+    double *sums;
+    double *squares;
+    int outWidth;
+    int outHeight;
+    int tileCols;
+    float *scores;
+};
+
+
+/**
+ * @brief      A position at which the template may match.
+ *
+ * @field      row    The image row of the template's top left corner.
+ * @field      col    The image column of the template's top left corner.
+ * @field      score  The normalized cross-correlation at the position.
+ */
+struct MatchCandidate
+{
+    int row;
+    int col;
+    float score;
+};
+
+
+/**
+ * @brief      A horizontal run of foreground samples of a binary image.
+ *
+ * @field      row    The image row of the run.
+ * @field      start  The first column of the run.
+ * @field      end    The column after the last column of the run.
+ */
+struct LabelRun
+{
+    int row;
+    int start;
+    int end;
+};
+
+
+/**
+ * @brief      A horizontal stripe of rows of a binary image, whose runs are
+ *             found and joined into components independently of the other
+ *             stripes, so that stripes can be labelled in parallel.
+ *
+ * @field      image      The binary image; samples above 0 are foreground.
+ * @field      row        The first image row in the stripe.
+ * @field      rowCount   The number of image rows in the stripe.
+ * @field      runs       The stripe's runs, row by row from the left.
+ * @field      runCount   The number of runs.
+ * @field      capacity   The number of runs runs can hold.
+ * @field      rowStarts  The index of the first run of each row, and the
+ *                        run count after the last row.
+ * @field      parent     The union-find parent of each run, as an index
+ *                        into runs.
+ * @field      offset     The index of the stripe's first run in the image.
+ * @field      isFailed   True if an allocation failed.
+ */
+struct LabelStripe
+{
+    const Raster *image;
+    int row;
+    int rowCount;
+    LabelRun *runs;
+    int runCount;
+    int capacity;
+    int *rowStarts;
+    int *parent;
+    int offset;
+    bool isFailed;
+};
+
+
+/**
+ * @brief      The state shared by the bands of a distance transform.
+ *
+ * @field      image    The binary image; samples of 0 are background.
+ * @field      width    The number of columns in the image.
+ * @field      height   The number of rows in the image.
+ * @field      squares  The squared distance of each sample, row by row.
+ * @field      hull     For each band of rows, the columns of the parabolas in
+ *                      the lower envelope of a row.
+ * @field      bounds   For each band of rows, where each parabola of the
+ *                      envelope starts, and one past the last.
+ * @field      row      For each band of rows, the transformed row.
+ */
+struct DistanceMap
+{
+    const Raster *image;
+    int width;
+    int height;
+    double *squares;
+    int *hull;
+    double *bounds;
+    double *row;
+};
+
+
+/**
+ * @brief      The state shared by the rows of a dithered image. Floyd-Steinberg
+ *             rows run concurrently, each a few columns behind the row above,
+ *             whose diffused error it must wait for.
+ *
+ * @field      type      The method of dithering.
+ * @field      width     The number of columns in the image.
+ * @field      height    The number of rows in the image.
+ * @field      levels    The number of output levels.
+ * @field      values    The samples scaled to levels - 1, row by row, to which
+ *                       diffused error is added.
+ * @field      out       The dithered image.
+ * @field      progress  The number of columns of each row dithered so far.
+ * @field      lock      Guards progress.
+ * @field      advanced  Signalled when a row's progress advances.
+ */
+struct Ditherer
+{
+    enum DitherType type;
+    int width;
+    int height;
+    int levels;
+    double *values;
+    Raster out;
+    int *progress;
+    pthread_mutex_t lock;
+    pthread_cond_t advanced;
+};
+
+
+/**
+ * @brief      The levels of a tile pyramid being built. Each level halves the
+ *             one above it, and is cut into bands of one row of tiles. Bands
+ *             are built in order from the full size level down, each waiting
+ *             only for the two bands of the level above it covers.
+ *
+ * @field      dir           The directory the tiles are written to.
+ * @field      tileSize      The width and height of each tile.
+ * @field      levelCount    The number of levels, down to a single pixel.
+ * @field      maxDataValue  The max value of the samples.
+ * @field      levels        The image at each level, the full size first.
+ * @field      firstBand     The index of each level's first band, and the
+ *                           total number of bands after the last level.
+ * @field      isBandDone    True for each band which has been built.
+ * @field      isFailed      True if any tile could not be written.
+ * @field      lock          Guards isBandDone and isFailed.
+ * @field      advanced      Signalled when a band is done.
+ */
+struct Pyramid
+{
+    char *dir;
+    int tileSize;
+    int levelCount;
+    int maxDataValue;
+    Raster *levels;
+    int *firstBand;
+    bool *isBandDone;
+    bool isFailed;
+    pthread_mutex_t lock;
+    pthread_cond_t advanced;
+};
+
+
+/**
+ * @brief      The frames of one or more multi-frame raw pnm files, located
+ *             from their headers alone, to be copied whole to other files.
+ *
+ * @field      count       The number of frames.
+ * @field      capacity    The number of frames the arrays can hold.
+ * @field      fds         The file descriptor of the file holding each frame.
+ * @field      starts      The file offset of the start of each frame's header.
+ * @field      lengths     The number of bytes in each frame, header included.
+ * @field      outStarts   The offset of each frame in the output file.
+ * @field      isCopied    True for each frame which has been copied.
+ * @field      outName     The output file name, or, when split, the prefix of
+ *                         each frame's file name.
+ * @field      isSplit     True to copy each frame to its own file.
+ */
+struct FrameSpans
+{
+    int count;
+    int capacity;
+    int *fds;
+    off_t *starts;
+    off_t *lengths;
+    off_t *outStarts;
+    bool *isCopied;
+    char *outName;
+    bool isSplit;
+};
+
+
+/**
+ * @brief      Tables converting the samples of one max value between their
+ *             sRGB encoding and linear light, held as 16 bit fractions of full
+ *             scale so the encoding is a single lookup.
+ *
+ * @field      toLinear    The linear light of each sample value.
+ * @field      fromLinear  The sample value encoding each linear light level.
+ */
+struct LinearTables
+{
+    uint16_t toLinear[256];
+    uint8_t fromLinear[65536];
 };
 
 
@@ -137,50 +868,263 @@ void PrintHexDump(FILE *inputStream, FILE *outputStream);
 // Parsing commandline parameters
 
 bool TryParseScalar(PgmConverter *c);
+bool TryParseMemLimit(char *str, size_t *memLimit);
 
 // Pgm conversion
 
 bool TryConvertPgm(PgmConverter *c);
 
+// Out-of-core rotation
+
+bool TryRotateOutOfCore(PgmConverter *c);
+
+// Pass-through conversion
+
+bool IsPassThrough(PgmConverter *c);
+bool TryPassThroughPgm(PgmConverter *c);
+
+// Pam conversion
+
+bool TryConvertPam(PgmConverter *c);
+bool TryReadPamPlanes(PgmConverter *c, Raster *planes);
+bool TryWritePamData(PgmConverter *c, Raster *planes);
+int GetAlphaChannel(int depth);
+const char *GetTupleType(int depth);
+
+// Streaming transcoding
+
+bool TryTranscodePgm(PgmConverter *c);
+
+// Chained operations
+
+bool TryRunChain(char *ops, char *inName, char *outName, size_t memLimit,
+    bool isLinear);
+bool TryRunStream(char *ops, size_t memLimit, bool isLinear);
+bool TryBuildGraph(OpGraph *g, char *ops);
+bool TryAddOp(OpGraph *g, char *op);
+bool IsIdentityChain(const char *ops);
+bool TryWriteGraph(OpGraph *g, PgmFile *oF);
+const double *PullRow(OpNode *n, int row);
+const double *GetUpstreamRow(OpNode *n, int row);
+void ResetGraph(OpGraph *g);
+void FreeGraph(OpGraph *g);
+int CompareDoubles(const void *a, const void *b);
+
+// Tiled execution
+
+bool TryReadGraphInput(OpGraph *g);
+const double *GetOutputRow(OpGraph *g, int row);
+void RunTile(void *arg, int index);
+Tile MapRegion(OpNode *n, Tile out);
+double EvaluateNode(OpNode *n, const Tile *in, int row, int col);
+void OrientPoint(enum Orientation orientation, int width, int height,
+    int *row, int *col);
+double GetTileSample(const Tile *t, int row, int col);
+
+// Remapping
+
+bool TryLoadRemap(Remap *m, const char *fileName);
+void FreeRemap(Remap *m);
+double RemapSample(const Remap *m, const Tile *in, int imageWidth,
+    int imageHeight, int row, int col);
+Tile MapRemapRegion(const Remap *m, Tile out, int imageWidth, int imageHeight);
+
+// Warping
+
+bool TryParseWarp(char *str, double *inverse);
+void WarpRow(OpNode *n, const Tile *in, int row, int col, int count,
+    double *out);
+Tile MapWarpRegion(OpNode *n, Tile out);
+
+// Frame stacking
+
+bool TryRunStack(char *mode, int inCount, char **inNames, char *outName);
+bool TryIndexFrames(FrameStack *s, FILE *stream);
+bool TrySpoolFrame(FrameStack *s, PgmFile *iF, off_t *offset);
+bool TryReadFrameRow(const FrameStack *s, int frame, int row,
+    uint16_t *samples);
+void CombineFrameBand(void *arg, int index);
+bool TrySortFrameRows(uint16_t *rows, int count, int width);
+double GetMedian(uint16_t *values, int count);
+
+// Frame differencing
+
+bool TryRunFrameDiff(char *thresholdStr);
+bool TryReadSampleRow(PgmFile *iF, uint16_t *samples);
+bool TryReadGreyRow(PgmFile *iF, uint16_t *samples, double *data);
+void WidenSamples(uint16_t *samples, int width, int maxDataValue);
+long long DiffFrameRow(uint16_t *previous, const uint16_t *current, int width,
+    int threshold, int maxDataValue, double *out);
+
+// Template matching
+
+bool TryRunMatch(char *templateName, char *inName, char *countStr);
+bool TryLoadImage(PgmFile *f, double **samples);
+void MatchTile(void *arg, int index);
+int CompareCandidates(const void *a, const void *b);
+
+// Connected components
+
+bool TryLabelComponents(PgmConverter *c);
+void LabelStripeRuns(void *arg, int index);
+void JoinRuns(const LabelRun *runs, int *parent, int above, int below,
+    int belowEnd);
+int FindRoot(int *parent, int run);
+
+// Distance transform
+
+bool TryDistanceTransform(PgmConverter *c);
+void DistanceColumns(void *arg, int index);
+void DistanceRows(void *arg, int index);
+
+// Dithering
+
+bool TryDitherPgm(PgmConverter *c, char *mode, char *bitsStr);
+void DitherBayerRows(void *arg, int index);
+void DitherFsRow(void *arg, int row);
+
+// Tile pyramids
+
+bool TryWriteTiles(char *dir, char *sizeStr, char *inName);
+void BuildPyramidBand(void *arg, int index);
+bool TryWriteTile(const Pyramid *p, int level, int row, int col);
+
+// Header rewriting
+
+bool TryRewriteHeader(PgmConverter *c, char *comment, char *maxStr);
+bool TryCheckMaxValue(PgmFile *iF, int max);
+bool TryCopyBytes(int inFd, off_t inStart, int outFd, off_t outStart,
+    off_t length);
+
+// Frame splitting
+
+bool TrySplitFrames(char *inName, char *prefix);
+bool TryConcatFrames(int inCount, char **inNames, char *outName);
+bool TryFindFrames(FrameSpans *f, FILE *stream);
+bool TryCopyFrames(FrameSpans *f);
+void CopyFrame(void *arg, int index);
+void FreeFrameSpans(FrameSpans *f);
+
+// Linear light
+
+bool TrySetLinearTables(PgmConverter *c);
+const LinearTables *GetLinearTables(int maxDataValue);
+
 // Reading input pgm
 
 bool TryReadPgmInfo(PgmConverter *c);
+bool TryReadHeaderToken(FILE *stream, char *token, size_t size);
+bool TryReadPamHeader(PgmFile *iF);
+bool HasNextFrame(FILE *stream);
 bool TryReadPgmData(PgmConverter *c);
+bool TryReadPgmRow(PgmFile *iF, double *data);
+bool TryReadPlainRow(PgmFile *iF, double *data);
+bool TryReadRawRow(PgmFile *iF, double *data);
+bool TryReadBitmapRow(PgmFile *iF, double *data);
+void SetPixel(const PgmFile *iF, double *data, int column,
+    const int *channels);
+int ToGrey(const int *channels, int depth);
+bool TryReadFloat(PgmFile *iF, double *value);
 
 // Output Pgm initialization
 
 bool TrySetPgmInfo(PgmConverter *c);
+void SetOutputType(PgmFile *iF, PgmFile *oF);
 
 // Writing output pgm
 
+bool TryWriteImage(PgmConverter *c);
 void WritePgmInfo(PgmFile *oF);
-void WritePgmData(PgmConverter *c);
+bool TryWritePgmData(PgmConverter *c);
+void WritePgmRow(PgmFile *oF, const double *data);
+int EncodeSample(const PgmFile *oF, double value);
+void WriteFloat(FILE *stream, double value);
+
+// Writing output png
+
+bool TryWritePngData(PgmConverter *c);
+void EncodePngBand(void *arg, int index);
+void FilterPngRow(unsigned char *out, const unsigned char *row,
+    const unsigned char *prior, unsigned char *candidate, int rowBytes,
+    int bpp);
+void DeflateFixed(ByteBuffer *out, const unsigned char *in, int length,
+    bool isFinal);
+void WritePngChunk(FILE *stream, const char *type,
+    const unsigned char *data, size_t length);
+uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t length);
+uint32_t Adler32(uint32_t adler, const unsigned char *data, size_t length);
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2);
 
 // Data retrieval
 
-int GetData(PgmConverter *c, int row, int col);
-int GetReflectedData(PgmConverter *c, int row, int col);
-int GetRotated90Data(PgmConverter *c, int row, int col);
-int GetScaledNnData(PgmConverter *c, int row, int col);
-int GetScaledUpBlData(PgmConverter *c, int row, int col);
-int GetScaledDownBoxData(PgmConverter *c, int row, int col);
+double GetData(PgmConverter *c, int row, int col);
+double GetInputSample(PgmConverter *c, int row, int col);
+double GetScaledNnData(PgmConverter *c, int row, int col);
+double GetScaledUpBlData(PgmConverter *c, int row, int col);
+double GetScaledDownBoxData(PgmConverter *c, int row, int col);
+
+// Geometry plans
+
+const ScalePlan *GetScalePlan(double (*getData)(PgmConverter *c, int row, int col),
+    const PgmFile *iF, const PgmFile *oF, const ScaleArgs *sArgs);
+ScalePlan *TryBuildScalePlan(const ScalePlan *key);
+void FreeScalePlan(ScalePlan *plan);
+bool TryBuildScaleAxis(ScaleAxis *axis, int length, double scale);
+void FreeScaleAxis(ScaleAxis *axis);
 
 // Data processing
 
-int ExtrapolateLinear(int x1, int x2);
+double ExtrapolateLinear(double x1, double x2, double max);
 double LinearInterpolate(double x, double fx1, double fx2);
 double BilinearInterpolate(double x, double y, 
     double fxy11, double fxy12, double fxy21, double fxy22);
 
+// Raster management
+
+bool TryAllocateRaster(Raster *r, int width, int height,
+    enum SampleType sampleType);
+void FreeRaster(Raster *r);
+double GetSample(const Raster *r, int row, int col);
+void SetSample(Raster *r, int row, int col, double value);
+size_t GetSampleSize(enum SampleType sampleType);
+
+// Raster transforms
+
+bool TryOrientRaster(Raster *r, enum Orientation orientation);
+enum Orientation ComposeOrientations(enum Orientation first,
+    enum Orientation second);
+bool TryTransposeRaster(Raster *r);
+void FlipRasterHorizontal(Raster *r);
+void FlipRasterVertical(Raster *r);
+void RotateRaster180(Raster *r);
+void ReverseSamples(void *samples, size_t count, size_t size);
+uint64_t ReverseWordBytes(uint64_t word);
+void SwapBytes(unsigned char *a, unsigned char *b, size_t length);
+
 // Stream management
 
 bool TryOpenStreams(PgmConverter *c);
 void CloseStreams(PgmConverter *c);
 
+// Byte buffers
+
+void PutByte(ByteBuffer *b, unsigned char byte);
+void PutBits(ByteBuffer *b, uint32_t value, int count);
+void PutHuffman(ByteBuffer *b, uint32_t code, int length);
+void FlushBits(ByteBuffer *b);
+void PutUint32(ByteBuffer *b, uint32_t value);
+
+// Parallel execution
+
+int GetThreadCount(void);
+void RunParallel(int count, void (*job)(void *arg, int index), void *arg);
+
 // Enum functions
 
 char* PgmTypeToStr(enum PgmType type);
 enum PgmType StrToPgmType(char *str);
+bool IsPlainPnm(enum PgmType type);
+enum Orientation StrToOrientation(const char *str);
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -189,21 +1133,91 @@ enum PgmType StrToPgmType(char *str);
 
 #define VERSION "1.0"
 
+// The number of filtered bytes each png band aims to hold. Bands are the unit
+// of parallel work, and each restarts the deflate window, so this balances
+// thread utilisation against compression ratio.
+#define PNG_BAND_BYTES 262144
 
-////////////////////////////////////////////////////////////////////////////////
-//                                    Main                                    //
-////////////////////////////////////////////////////////////////////////////////
+// Deflate sliding window size and the number of hash chain links searched
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_SIZE 32768
+#define DEFLATE_MAX_CHAIN 64
+#define DEFLATE_MAX_MATCH 258
 
-/*-------------------------------------------------------------------------*//**
- * @brief      Main, program entry point.
- *
- * @param[in]  argc  The number of command line parameters.
- * @param      argv  An array of pointers to each command line parameter.
+// Block size, in samples, of the square in-place transpose
+#define TRANSPOSE_BLOCK 32
+
+// Size of the input and output buffers of the streaming transcoder
+#define TRANSCODE_BUFFER_SIZE 65536
+
+// The number of distinct scaling plans which can be cached, which must exceed
+// MAX_OPS so that the plans of one graph are never replaced while in use
+#define PLAN_CACHE_SIZE 64
+
+// Fraction bits of the fixed point source coordinates of a remap
+#define REMAP_FRACTION_BITS 16
+
+// Width and height of the output tiles chained operations are computed in. A
+// tile and the regions each stage computes for it fit in a typical L2 cache.
+#define TILE_SIZE 64
+
+// The number of output rows each band of a frame stack holds
+#define STACK_BAND_ROWS 16
+
+// The number of image rows in each stripe labelled by one thread
+#define LABEL_STRIPE_ROWS 64
+
+// The number of columns, or rows, in each band of a distance transform pass
+#define DISTANCE_BAND_SIZE 64
+
+// The squared distance of a sample with no background in range
+#define DISTANCE_INFINITY 1e20
+
+// The number of columns a Floyd-Steinberg row dithers between reporting its
+// progress to the row below
+#define DITHER_CHUNK 64
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                    Main                                    //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Main, program entry point.
+ *
+ * @param[in]  argc  The number of command line parameters.
+ * @param      argv  An array of pointers to each command line parameter.
  *
  * @return     Returns 0 to indicate successful termination, 1 otherwise.
  */
 int main(int argc, char *argv[])
 {
+    /* Parse any options given before the command, dropping each so that
+       the command is in argv[1] */
+
+    size_t memLimit = 0;
+    bool isLinear = false;
+    while (argc > 2)
+    {
+        // "--mem-limit [BYTES]" bounds the memory used to hold the input image
+        if (!strcmp(argv[1], "--mem-limit"))
+        {
+            if (!TryParseMemLimit(argv[2], &memLimit))
+                return 1;
+            argc -= 2;
+            argv += 2;
+        }
+        // "--linear" scales and filters in linear light
+        else if (!strcmp(argv[1], "--linear"))
+        {
+            isLinear = true;
+            argc--;
+            argv++;
+        }
+        else
+            break;
+    }
+
     /* Validate command line parameters */
 
     // Ensure there more than one command line parameter, otherwise print error
@@ -231,7 +1245,7 @@ int main(int argc, char *argv[])
     // Else if command is "--P2toP5 [INFILE] [OUTFILE]"
     else if (!strcmp(argv[1], "--P2toP5") && (argc == 4))
     {
-        PgmFile iF = { NULL, argv[2], 0, 0, 0, P2 };
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
         PgmFile oF = { NULL, argv[3], 0, 0, 0, P5 };
         ConversionArgs cArgs = { GetData, false, false };
         PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
@@ -241,7 +1255,7 @@ int main(int argc, char *argv[])
     // Else if command is "--P5toP2 [INFILE] [OUTFILE]"
     else if (!strcmp(argv[1], "--P5toP2") && (argc == 4))
     {
-        PgmFile iF = { NULL, argv[2], 0, 0, 0, P5 };
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
         PgmFile oF = { NULL, argv[3], 0, 0, 0, P2 };
         ConversionArgs cArgs = { GetData, false, false };
         PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
@@ -253,7 +1267,7 @@ int main(int argc, char *argv[])
     {
         PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
         PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
-        ConversionArgs cArgs = { GetReflectedData, true, false };
+        ConversionArgs cArgs = { GetData, true, false, ORIENT_TRANSPOSE, memLimit };
         PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
 
         return !TryConvertPgm(&c);
@@ -263,18 +1277,183 @@ int main(int argc, char *argv[])
     {
         PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
         PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
-        ConversionArgs cArgs = { GetRotated90Data, true, false };
+        ConversionArgs cArgs = { GetData, true, false, ORIENT_ROTATE90, memLimit };
         PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
 
         return !TryConvertPgm(&c);
     }
+    // Else if command is "--rotate180 [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--rotate180") && (argc == 4))
+    {
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false, ORIENT_ROTATE180 };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryConvertPgm(&c);
+    }
+    // Else if command is "--rotate270 [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--rotate270") && (argc == 4))
+    {
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, true, false, ORIENT_ROTATE270, memLimit };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryConvertPgm(&c);
+    }
+    // Else if command is "--flipH [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--flipH") && (argc == 4))
+    {
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false, ORIENT_FLIP_H };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryConvertPgm(&c);
+    }
+    // Else if command is "--flipV [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--flipV") && (argc == 4))
+    {
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false, ORIENT_FLIP_V };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryConvertPgm(&c);
+    }
+    // Else if command is "--chain [OPS] [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--chain") && (argc == 5))
+    {
+        return !TryRunChain(argv[2], argv[3], argv[4], memLimit,
+            isLinear);
+    }
+    // Else if command is "--remap [MAPFILE] [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--remap") && (argc == 5))
+    {
+        // Commas separate chained operations, so cannot be in the map's name
+        if (strchr(argv[2], ',') != NULL)
+        {
+            fprintf(stderr, "Error, a map file name cannot contain a comma\n");
+            return 1;
+        }
+
+        char ops[FILENAME_MAX + 7];
+        if (snprintf(ops, sizeof(ops), "remap:%s", argv[2]) >= (int)sizeof(ops))
+        {
+            fprintf(stderr, "Error, the map file name is too long\n");
+            return 1;
+        }
+        return !TryRunChain(ops, argv[3], argv[4], memLimit, isLinear);
+    }
+    // Else if command is "--warp [H] [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--warp") && (argc == 5))
+    {
+        // Commas separate chained operations, so use spaces in the matrix.
+        // A matrix too long for the buffer would be cut short.
+        char ops[1024];
+        if (snprintf(ops, sizeof(ops), "warp:%s", argv[2]) >= (int)sizeof(ops))
+        {
+            fprintf(stderr, "Error, bad warp matrix. Check README for usage:\n");
+            return 1;
+        }
+        for (char *ch = ops; *ch != '\0'; ch++)
+            *ch = *ch == ',' ? ' ' : *ch;
+        return !TryRunChain(ops, argv[3], argv[4], memLimit, isLinear);
+    }
+    // Else if command is "--stream [OPS]"
+    else if (!strcmp(argv[1], "--stream") && (argc == 3))
+    {
+        return !TryRunStream(argv[2], memLimit, isLinear);
+    }
+    // Else if command is "--stack [MODE] [INFILE]... [OUTFILE]"
+    else if (!strcmp(argv[1], "--stack") && (argc >= 5))
+    {
+        return !TryRunStack(argv[2], argc - 4, argv + 3, argv[argc - 1]);
+    }
+    // Else if command is "--framediff [THRESH]"
+    else if (!strcmp(argv[1], "--framediff") && (argc == 3))
+    {
+        return !TryRunFrameDiff(argv[2]);
+    }
+    // Else if command is "--match [TEMPLATE] [INFILE] [COUNT]"
+    else if (!strcmp(argv[1], "--match") && (argc == 4 || argc == 5))
+    {
+        return !TryRunMatch(argv[2], argv[3], argc == 5 ? argv[4] : "1");
+    }
+    // Else if command is "--label-components [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--label-components") && (argc == 4))
+    {
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryLabelComponents(&c);
+    }
+    // Else if command is "--distance [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--distance") && (argc == 4))
+    {
+        PgmFile iF = { NULL, argv[2], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryDistanceTransform(&c);
+    }
+    // Else if command is "--dither [MODE] [BITS] [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--dither") && (argc == 6))
+    {
+        PgmFile iF = { NULL, argv[4], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[5], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryDitherPgm(&c, argv[2], argv[3]);
+    }
+    // Else if command is "--tiles [DIR] [TILESIZE] [INFILE]"
+    else if (!strcmp(argv[1], "--tiles") && (argc == 5))
+    {
+        return !TryWriteTiles(argv[2], argv[3], argv[4]);
+    }
+    // Else if command is "--set-comment [COMMENT] [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--set-comment") && (argc == 5))
+    {
+        PgmFile iF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[4], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryRewriteHeader(&c, argv[2], NULL);
+    }
+    // Else if command is "--retag [MAXVAL] [INFILE] [OUTFILE]"
+    else if (!strcmp(argv[1], "--retag") && (argc == 5))
+    {
+        PgmFile iF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
+        PgmFile oF = { NULL, argv[4], 0, 0, 0, UNKNOWN };
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+
+        return !TryRewriteHeader(&c, NULL, argv[2]);
+    }
+    // Else if command is "--split [INFILE] [PREFIX]"
+    else if (!strcmp(argv[1], "--split") && (argc == 4))
+    {
+        return !TrySplitFrames(argv[2], argv[3]);
+    }
+    // Else if command is "--concat [INFILE]... [OUTFILE]"
+    else if (!strcmp(argv[1], "--concat") && (argc >= 4))
+    {
+        return !TryConcatFrames(argc - 3, argv + 2, argv[argc - 1]);
+    }
     // Else if command is "--scaleNn [SCALAR] [INFILE] [OUTFILE]"
     else if (!strcmp(argv[1], "--scaleNn") && (argc == 5))
     {
         PgmFile iF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
         PgmFile oF = { NULL, argv[4], 0, 0, 0, UNKNOWN };
         ScaleArgs sArgs = { argv[2], NEAREST_NEIGHBOR, false, 1, 1 };
-        ConversionArgs cArgs = { GetScaledNnData, false, true };
+        ConversionArgs cArgs = { GetScaledNnData, false, true, ORIENT_IDENTITY,
+            memLimit, isLinear };
         PgmConverter c = { &iF, &oF, &cArgs, &sArgs, {} };
 
         return !TryConvertPgm(&c);
@@ -285,7 +1464,8 @@ int main(int argc, char *argv[])
         PgmFile iF = { NULL, argv[3], 0, 0, 0, UNKNOWN };
         PgmFile oF = { NULL, argv[4], 0, 0, 0, UNKNOWN };
         ScaleArgs sArgs = { argv[2], BILINEAR, false, 1, 1 };
-        ConversionArgs cArgs = { NULL, false, true };
+        ConversionArgs cArgs = { NULL, false, true, ORIENT_IDENTITY, memLimit,
+            isLinear };
         PgmConverter c = { &iF, &oF, &cArgs, &sArgs, {} };
 
         return !TryConvertPgm(&c);
@@ -523,637 +1703,7195 @@ bool TryParseScalar(PgmConverter *c)
 }
 
 
-////////////////////////////////////////////////////////////////////////////////
-//                          Pgm conversion functions                          //
-////////////////////////////////////////////////////////////////////////////////
-
-/*-------------------------------------------------------------------------*//**
- * @brief      Converts a pgm file to another pgm format.
+/**
+ * @brief      Parses a memory limit in bytes, optionally suffixed by K, M or G
+ *             for kibibytes, mebibytes or gibibytes.
  *
- * @param      c     A PgmConverter detailing conversion state information.
+ * @param      str       The command-line parameter to parse.
+ * @param      memLimit  Output for the limit in bytes.
  *
  * @return     Returns true when sucessful, false otherwise.
  */
-bool TryConvertPgm(PgmConverter *c)
+bool TryParseMemLimit(char *str, size_t *memLimit)
 {
-    // Try and open the io files, parse the pgm data and info, reporting failure
-    if (!TryOpenStreams(c) || !TryReadPgmInfo(c)
-        || !TryReadPgmData(c) || !TrySetPgmInfo(c))
+    double bytes = 0;
+    char suffix = '\0';
+    int n = 0;
+
+    // Parse the number and an optional single character suffix
+    if (!((sscanf(str, "%lf%n", &bytes, &n) == 1 && str[n] == '\0')
+        || (sscanf(str, "%lf%c%n", &bytes, &suffix, &n) == 2 && str[n] == '\0'
+        && strchr("KkMmGg", suffix))) || bytes < 1)
     {
-        CloseStreams(c);
+        fprintf(stderr, "Error, bad --mem-limit format. Check README for usage:\n");
         return false;
     }
 
-    // Write the output data
-    WritePgmInfo(c->oF);
-    WritePgmData(c);
+    // Apply the suffix multiplier
+    if (suffix == 'K' || suffix == 'k')
+        bytes *= 1024;
+    else if (suffix == 'M' || suffix == 'm')
+        bytes *= 1024 * 1024;
+    else if (suffix == 'G' || suffix == 'g')
+        bytes *= 1024 * 1024 * 1024;
 
-    CloseStreams(c);
+    // The limit must fit a size_t, which also rules out inf and nan
+    if (!(bytes < (double)SIZE_MAX))
+    {
+        fprintf(stderr, "Error, --mem-limit is too large\n");
+        return false;
+    }
+
+    *memLimit = (size_t)bytes;
     return true;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
-//                             Reading input pgm                              //
+//                          Pgm conversion functions                          //
 ////////////////////////////////////////////////////////////////////////////////
 
-
 /*-------------------------------------------------------------------------*//**
- * @brief      Reads the first four lines of information from a pgm file.
+ * @brief      Converts a pgm file to another pgm format.
  *
  * @param      c     A PgmConverter detailing conversion state information.
  *
- * @return     Returns true when successful, false otherwise.
+ * @return     Returns true when sucessful, false otherwise.
  */
-bool TryReadPgmInfo(PgmConverter *c)
+bool TryConvertPgm(PgmConverter *c)
 {
-    /*Parse the input image type, width, and height from lines 1, 3 and 4*/
-
-    char typeStr[10];
-    if (4 != fscanf(c->iF->fStream,
-        "%s\n"       // Line 1 format: "P2\n"
-        "%*[^\n]\n"  // Line 2 format: "[single line comment]\n", * = skip
-        "%i %i\n"    // Line 3 format: "[width int] [height int]\n"    
-        "%i\n",      // Line 4 format: "[maxsize int]\n"
-        typeStr, &(c->iF->width), &(c->iF->height), &(c->iF->maxDataValue)))
+    // Try and open the io files and parse the pgm info, reporting failure
+    if (!TryOpenStreams(c) || !TryReadPgmInfo(c))
     {
-        // If the attempt was unsucessful report the error
-        fprintf(stderr, "Corrupted input file\n");
+        CloseStreams(c);
         return false;
     }
 
-    // Convert the parsed image type string to a PgmType enum
-    enum PgmType imageType = StrToPgmType(typeStr);
-
-    // If the input type is unknown, set it to the parsed input type (if valid)
-    if (c->iF->type == UNKNOWN && imageType != UNKNOWN)
-        c->iF->type = imageType;
-
-    // If parsed pgm type does not match the expected input type, report error
-    if(c->iF->type != imageType)
+    // If the input would exceed the memory limit, rotate it out of core
+    if (c->cArgs->memLimit != 0 && c->cArgs->isSwapWidthHeight
+        && (double)c->iF->width * c->iF->height > c->cArgs->memLimit)
     {
-        fprintf(stderr, "Input is not in %s format\n", PgmTypeToStr(c->iF->type));
-        return false;
+        bool isRotated = TrySetPgmInfo(c);
+        if (isRotated && (c->iF->type != P5 || c->oF->type != P5
+            || c->iF->maxDataValue > 255))
+        {
+            fprintf(stderr, "Error, input exceeds --mem-limit; only 8 bit P5 "
+                "images can be rotated out of core\n");
+            isRotated = false;
+        }
+
+        isRotated = isRotated && TryRotateOutOfCore(c);
+        CloseStreams(c);
+        return isRotated;
     }
 
-    return true;
-}
+    // Conversions whose output data equals the input's, such as P5 to P5 at
+    // scale 1, copy the data as it is rather than decoding and encoding it
+    if (c->iF->type == P5 && c->cArgs->orientation == ORIENT_IDENTITY)
+    {
+        if (!TrySetPgmInfo(c))
+        {
+            CloseStreams(c);
+            return false;
+        }
 
+        if (IsPassThrough(c))
+        {
+            bool isCopied = TryPassThroughPgm(c);
+            CloseStreams(c);
+            return isCopied;
+        }
+    }
 
-/*-------------------------------------------------------------------------*//**
- * @brief      Reads the data from a pgm file and stores it into a PgmConverter's
- *             data array.
- *
- * @param      c     A PgmConverter detailing conversion state information.
- *
- * @return     Returns true when successful, false otherwise.
- */
-bool TryReadPgmData(PgmConverter *c)
-{
-    int data = 0;
-    int dataCount = 0;
-    for (int row = 0; row < c->iF->height; row++)
+    // Pure format conversions of 8 bit data are streamed, unless the output
+    // file name asks for a png or pfm
+    if (c->cArgs->getData == GetData && !c->cArgs->isScale
+        && c->cArgs->orientation == ORIENT_IDENTITY
+        && (c->iF->type == P2 || c->iF->type == P5)
+        && c->iF->maxDataValue <= 255)
     {
-        for (int column = 0; column < c->iF->width; column++)
+        if (!TrySetPgmInfo(c))
         {
-            // If the input type is P2
-            if (c->iF->type == P2)
-            {
-                // Scan the file for the next integer, ignoring whitespace
-                if (!fscanf(c->iF->fStream, "%i", &data))
-                {
-                    // Error if fscanf failed to parse an integer (i.e. text)
-                    fprintf(stderr, "Corrupted input file\n");
-                    return false;
-                }
-            }
-            // Else if the input type is P5 read the file character by character
-            else if (c->iF->type == P5)
-            {
-                data = (int)fgetc(c->iF->fStream);
-            }
+            CloseStreams(c);
+            return false;
+        }
 
-            // If the end of the file has been reached, exit the loop
-            if (feof(c->iF->fStream))
-                break;
+        if (c->oF->type == P2 || c->oF->type == P5)
+        {
+            bool isTranscoded = TryTranscodePgm(c);
+            CloseStreams(c);
+            return isTranscoded;
+        }
+    }
 
-            // Increment the data count
-            dataCount ++;
+    // Pam output keeps the input's channels, which are converted one by one
+    SetOutputType(c->iF, c->oF);
+    if (c->oF->type == P7)
+    {
+        bool isConverted = TryConvertPam(c);
+        CloseStreams(c);
+        return isConverted;
+    }
 
-            // If the value of data exceeds limits, it is corrupted
-            if ((data > c->iF->maxDataValue) || (data < 0))
-            {
-                fprintf(stderr, "Corrupted input file\n");
-                return false;
-            }
-            else
-            {
-                c->data[row][column] = data;
-            }
-        }
+    // Parse the pgm data and set the output info
+    if (!TryReadPgmData(c) || !TrySetPgmInfo(c))
+    {
+        FreeRaster(&c->data);
+        CloseStreams(c);
+        return false;
     }
 
-    // Input is corrupted if the input type is P5 and there is still information
-    // to read, or if the datacount isn't equal to the image dimensions product.
-    if ((c->iF->type == P5 && fgetc(c->iF->fStream) != EOF)
-        || dataCount != (c->iF->width * c->iF->height))
+    // Change the orientation in place, so only one raster is held
+    if (!TryOrientRaster(&c->data, c->cArgs->orientation))
     {
-        fprintf(stderr, "Corrupted input file\n");
+        fprintf(stderr, "Error, out of memory\n");
+        FreeRaster(&c->data);
+        CloseStreams(c);
         return false;
     }
 
-    return true;
+    // Write the output data, encoding it as a png if required
+    bool isWritten = TryWriteImage(c);
+
+    FreeRaster(&c->data);
+    CloseStreams(c);
+    return isWritten;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
-//                         Output pgm initialization                          //
+//                            Out-of-core rotation                            //
 ////////////////////////////////////////////////////////////////////////////////
 
 /*-------------------------------------------------------------------------*//**
- * @brief      Sets any output pgm information which is context sensitive.
+ * @brief      Transposes or rotates a P5 image by 90 or 270 degrees without
+ *             holding it in memory. The input is read in horizontal strips of
+ *             rows, each strip is transposed in memory into one short segment
+ *             of every output row, and the segments are written straight to
+ *             their offsets in the preallocated output file. The output file
+ *             is memory mapped where possible, otherwise written with pwrite.
+ *             The strip and its transpose together fit within c->cArgs->memLimit.
  *
- * @param      c     A PgmConverter detailing conversion state information.
+ * @param      c     A PgmConverter detailing conversion state information, with
+ *                   the input and output information already set.
  *
  * @return     Returns true when successful, false otherwise.
  */
-bool TrySetPgmInfo(PgmConverter *c)
+bool TryRotateOutOfCore(PgmConverter *c)
 {
-    // If the output type is unknown, set it to the parsed input type
-    c->oF->type = (c->oF->type == UNKNOWN) ? c->iF->type : c->oF->type;
+    int width = c->iF->width;
+    int height = c->iF->height;
+    enum Orientation orientation = c->cArgs->orientation;
 
-    // Set the output's width and height, swapped if a transformation requires
-    if (c->cArgs->isSwapWidthHeight)
+    // The raster starts straight after the header in both files
+    WritePgmInfo(c->oF);
+    fflush(c->oF->fStream);
+    off_t inStart = ftello(c->iF->fStream);
+    off_t outStart = ftello(c->oF->fStream);
+    off_t rasterBytes = (off_t)width * height;
+    int inFd = fileno(c->iF->fStream);
+    int outFd = fileno(c->oF->fStream);
+
+    // The input must hold exactly one byte per pixel
+    struct stat inStat;
+    if (fstat(inFd, &inStat) || inStat.st_size != inStart + rasterBytes)
     {
-        c->oF->width = c->iF->height;
-        c->oF->height = c->iF->width;
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
     }
-    else
+
+    // Preallocate the output so that segments can be written at any offset
+    if (ftruncate(outFd, outStart + rasterBytes))
     {
-        c->oF->width = c->iF->width;
-        c->oF->height = c->iF->height;
+        fprintf(stderr, "Error, could not write output file\n");
+        return false;
     }
 
-    // Set the output's max data value equal to the input
-    c->oF->maxDataValue = c->iF->maxDataValue;
+    // Rows per strip, so that the strip and its transpose fit the limit
+    size_t stripRows = c->cArgs->memLimit / (2 * (size_t)width);
+    stripRows = stripRows < 1 ? 1 : stripRows > (size_t)height ? height : stripRows;
+    unsigned char *strip = malloc(stripRows * width);
+    unsigned char *segments = malloc(stripRows * width);
 
-    // Sets scale properties if the output is to be scaled.
-    if (c->cArgs->isScale)
+    // Map the output if possible, so segments are copied without system calls
+    unsigned char *map = mmap(NULL, outStart + rasterBytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED, outFd, 0);
+    map = (map == MAP_FAILED) ? NULL : map;
+
+    bool isSuccess = strip != NULL && segments != NULL;
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    for (int first = 0; isSuccess && first < height; first += stripRows)
     {
-        // Try and parse the scale factor from the command-line parameter
-        if (!TryParseScalar(c))
-            return false;
+        int rows = height - first < (int)stripRows ? height - first : (int)stripRows;
 
-        // Set the scaled output width and height 
-        c->oF->height *= c->sArgs->hScale;
-        c->oF->width *= c->sArgs->wScale;
+        if (pread(inFd, strip, (size_t)rows * width, inStart + (off_t)first * width)
+            != (ssize_t)rows * width)
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            isSuccess = false;
+            break;
+        }
 
-        // Max output size of the scaled output image is 1920x1080
-        if (c->oF->width > 1920 || c->oF->height > 1080)
+        // Input column x becomes output row x (transpose and 90 degrees) or
+        // width - 1 - x (270 degrees). The strip's rows become a contiguous
+        // run of output columns, reversed for 90 degrees.
+        for (int col = 0; col < width; col++)
         {
-            fprintf(stderr, "Error, output too large, max 1920x1080\n");
-            return false;
+            unsigned char *segment = segments + (size_t)col * rows;
+            for (int i = 0; i < rows; i++)
+            {
+                int row = orientation == ORIENT_ROTATE90 ? rows - 1 - i : i;
+                segment[i] = strip[(size_t)row * width + col];
+            }
         }
-    }
 
-    return true;
-}
+        // Write each segment to its output row
+        off_t outCol = orientation == ORIENT_ROTATE90 ? height - first - rows : first;
+        for (int col = 0; col < width && isSuccess; col++)
+        {
+            int outRow = orientation == ORIENT_ROTATE270 ? width - 1 - col : col;
+            off_t offset = outStart + (off_t)outRow * height + outCol;
+
+            if (map != NULL)
+                memcpy(map + offset, segments + (size_t)col * rows, rows);
+            else if (pwrite(outFd, segments + (size_t)col * rows, rows, offset) != rows)
+                isSuccess = false;
+        }
+
+        if (!isSuccess)
+            fprintf(stderr, "Error, could not write output file\n");
+    }
+
+    if (map != NULL)
+        munmap(map, outStart + rasterBytes);
+    free(strip);
+    free(segments);
+    return isSuccess;
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////
-//                             Writing output pgm                             //
+//                          Pass-through conversion                           //
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief      Checks whether a conversion's output data is exactly its input
+ *             data: P5 to P5 with no orientation change and no scaling, or
+ *             scaling by 1. Only max values for which every sample is valid
+ *             qualify, so corrupted samples are still reported otherwise.
+ *
+ * @param      c     A PgmConverter with the input and output information set.
+ *
+ * @return     Returns true if the data can be copied as it is.
+ */
+bool IsPassThrough(PgmConverter *c)
+{
+    bool isUnscaled = c->cArgs->isScale
+        ? c->sArgs->hScale == 1 && c->sArgs->wScale == 1
+        : c->cArgs->getData == GetData;
+
+    return c->iF->type == P5 && c->oF->type == P5 && isUnscaled
+        && c->cArgs->orientation == ORIENT_IDENTITY
+        && (c->iF->maxDataValue == 255 || c->iF->maxDataValue == 65535);
+}
+
+
 /*-------------------------------------------------------------------------*//**
- * @brief      Writes the first four lines of information to a pgm file.
+ * @brief      Writes a conversion whose output data is exactly its input data,
+ *             see IsPassThrough. A new header is written and the data copied
+ *             after it without being decoded, inside the kernel where possible.
  *
- * @param      oF    A PgmFile struct detailing the pgm files' information.
+ * @param      c     A PgmConverter with the input and output information set.
+ *
+ * @return     Returns true when successful, false otherwise.
  */
-void WritePgmInfo(PgmFile *oF)
+bool TryPassThroughPgm(PgmConverter *c)
 {
-    fprintf(oF->fStream,
-        "%s\n"                          // [pgm type]\n
-        "# Generated by pnmdump.exe\n"  // [comment]\n
-        "%i %i\n"                       // [width] [height]\n
-        "%i\n",                         // [max data value]\n
-        PgmTypeToStr(oF->type), oF->width, oF->height, oF->maxDataValue);
+    // The input must hold exactly the samples after its header
+    struct stat inStat;
+    off_t inStart = ftello(c->iF->fStream);
+    off_t rasterBytes = (off_t)c->iF->width * c->iF->height
+        * (c->iF->maxDataValue > 255 ? 2 : 1);
+    if (fstat(fileno(c->iF->fStream), &inStat)
+        || inStat.st_size - inStart != rasterBytes)
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    WritePgmInfo(c->oF);
+    fflush(c->oF->fStream);
+    if (ferror(c->oF->fStream) || !TryCopyBytes(fileno(c->iF->fStream), inStart,
+        fileno(c->oF->fStream), ftello(c->oF->fStream), rasterBytes))
+    {
+        fprintf(stderr, "Error, could not write output file\n");
+        return false;
+    }
+
+    return true;
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//                               Pam conversion                               //
+////////////////////////////////////////////////////////////////////////////////
+
 /*-------------------------------------------------------------------------*//**
- * @brief      Writes the data from a PgmConverter's data array to a file.
+ * @brief      Converts an image to a pam, keeping each of its channels. The
+ *             channels are read into planes of one sample per pixel, and each
+ *             plane is oriented and scaled as a grey image would be. Colour is
+ *             premultiplied by alpha as it is read and divided by it again as
+ *             it is written, so that scaling does not bleed the colour of
+ *             transparent pixels into their neighbours.
  *
- * @param      c     A PgmConverter detailing conversion state information.
+ * @param      c     A PgmConverter detailing conversion state information, with
+ *                   the input information read.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryConvertPam(PgmConverter *c)
+{
+    Raster planes[4] = { { 0 } };
+    Raster data = c->data;
+
+    // Pfm samples have no max value to premultiply by, and the linear light
+    // tables only apply to grey levels
+    if (c->iF->type == PF || c->iF->linear != NULL)
+    {
+        fprintf(stderr, "Error, pam output needs pnm input, without "
+            "--linear\n");
+        return false;
+    }
+
+    bool isConverted = TryReadPamPlanes(c, planes);
+
+    // Change the orientation of each plane in place
+    for (int k = 0; isConverted && k < c->iF->depth; k++)
+    {
+        if (!TryOrientRaster(&planes[k], c->cArgs->orientation))
+        {
+            fprintf(stderr, "Error, out of memory\n");
+            isConverted = false;
+        }
+    }
+
+    if (isConverted && TrySetPgmInfo(c))
+    {
+        c->oF->depth = c->iF->depth;
+        c->oF->isInterleaved = true;
+        isConverted = TryWritePamData(c, planes);
+    }
+    else
+    {
+        isConverted = false;
+    }
+
+    for (int k = 0; k < c->iF->depth; k++)
+        FreeRaster(&planes[k]);
+    c->data = data;
+    return isConverted;
+}
+
+
+/**
+ * @brief      Reads every channel of an image into its own plane, with colour
+ *             premultiplied by alpha as a fraction of the max value. Colour
+ *             planes of an image with alpha are held as doubles, since the
+ *             products are fractional; other planes keep the integer samples.
+ *
+ * @param      c       A PgmConverter detailing conversion state information.
+ * @param      planes  Output for the planes, iF->depth of them, which are
+ *                     freed by the caller, even on failure.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryReadPamPlanes(PgmConverter *c, Raster *planes)
+{
+    PgmFile *iF = c->iF;
+    int depth = iF->depth;
+    int alpha = GetAlphaChannel(depth);
+    double max = iF->maxDataValue;
+    enum SampleType sampleType = max > 255 ? SAMPLE_U16 : SAMPLE_U8;
+
+    double *data = malloc((size_t)iF->width * depth * sizeof(double));
+    bool isAllocated = data != NULL;
+    for (int k = 0; k < depth; k++)
+        isAllocated = isAllocated && TryAllocateRaster(&planes[k], iF->width,
+            iF->height, alpha >= 0 && k != alpha ? SAMPLE_F64 : sampleType);
+    if (!isAllocated)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        free(data);
+        return false;
+    }
+
+    // Read each row with all of its channels, and premultiply the colour in
+    // the same pass as it is split into planes
+    iF->isInterleaved = true;
+    for (int row = 0; row < iF->height; row++)
+    {
+        if (!TryReadPgmRow(iF, data))
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            free(data);
+            return false;
+        }
+
+        for (int col = 0; col < iF->width; col++)
+        {
+            const double *pixel = data + (size_t)col * depth;
+            double weight = alpha >= 0 ? pixel[alpha] / max : 1;
+            for (int k = 0; k < depth; k++)
+                SetSample(&planes[k], row, col,
+                    k == alpha ? pixel[k] : pixel[k] * weight);
+        }
+    }
+    free(data);
+
+    // Input is corrupted if the input type is binary and there is still
+    // information to read
+    if (!IsPlainPnm(iF->type) && fgetc(iF->fStream) != EOF)
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Writes the planes of a pam, each sampled through the conversion's
+ *             getData as a grey image's data would be, interleaved into rows.
+ *             Colour is divided by alpha again, then truncated like any other
+ *             sample, so that opaque pixels match a grey image's exactly; fully
+ *             transparent pixels have no colour.
+ *
+ * @param      c       A PgmConverter detailing conversion state information,
+ *                     with the output information set.
+ * @param      planes  The oriented planes, oF->depth of them.
+ *
+ * @return     Returns true when successful, false otherwise.
  */
-void WritePgmData(PgmConverter *c)
+bool TryWritePamData(PgmConverter *c, Raster *planes)
 {
-    // Write data[row][column] to the pgm [row][column]
+    int depth = c->oF->depth;
+    int alpha = GetAlphaChannel(depth);
+    double max = c->oF->maxDataValue;
+
+    double *data = malloc((size_t)c->oF->width * depth * sizeof(double));
+    if (data == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    WritePgmInfo(c->oF);
     for (int row = 0; row < c->oF->height; row++)
     {
-        for (int col = 0; col < c->oF->width; col++)
+        // Sample each plane in turn as the input data
+        for (int k = 0; k < depth; k++)
+        {
+            c->data = planes[k];
+            for (int col = 0; col < c->oF->width; col++)
+                data[(size_t)col * depth + k] = c->cArgs->getData(c, row, col);
+        }
+
+        // Unpremultiply in the same pass as the row is written. Opaque colour
+        // was not changed by premultiplying, and otherwise a result a rounding
+        // error short of a whole value is taken as whole, so that pixels which
+        // were only moved keep their colour.
+        for (int col = 0; alpha >= 0 && col < c->oF->width; col++)
         {
-            // If the output type is P2
-            if (c->oF->type == P2)
+            double *pixel = data + (size_t)col * depth;
+            if (pixel[alpha] >= max)
+                continue;
+            for (int k = 0; k < alpha; k++)
             {
-                // Pad with spaces unless we are on the first column of a row
-                if (col == 0)
-                    fprintf(c->oF->fStream, "%i", c->cArgs->getData(c, row, col));
-                // Add a new line for the final col of a row
-                else if (col == c->oF->width - 1)
-                    fprintf(c->oF->fStream, " %i\n", c->cArgs->getData(c, row, col));
-                else
-                    fprintf(c->oF->fStream, " %i", c->cArgs->getData(c, row, col));
+                double value = pixel[alpha] > 0
+                    ? pixel[k] * max / pixel[alpha] : 0;
+                double whole = floor(value + 0.5);
+                pixel[k] = fabs(value - whole) < 1e-9 * max ? whole : value;
+            }
+        }
+
+        WritePgmRow(c->oF, data);
+    }
+
+    free(data);
+    return true;
+}
+
+
+/**
+ * @brief      Finds the alpha channel of a pam's pixels from its depth, which
+ *             implies the tuple type: GRAYSCALE_ALPHA and RGB_ALPHA have alpha
+ *             as their last channel.
+ *
+ * @param[in]  depth  The number of channels per pixel.
+ *
+ * @return     The index of the alpha channel, or -1 if there is none.
+ */
+int GetAlphaChannel(int depth)
+{
+    return depth == 2 || depth == 4 ? depth - 1 : -1;
+}
+
+
+/**
+ * @brief      Names the tuple type of a pam's pixels from their depth.
+ *
+ * @param[in]  depth  The number of channels per pixel, 1 to 4.
+ *
+ * @return     The tuple type, e.g. "RGB" for a depth of 3.
+ */
+const char *GetTupleType(int depth)
+{
+    static const char *tupleTypes[] = { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB",
+        "RGB_ALPHA" };
+    return tupleTypes[depth - 1];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                           Streaming transcoding                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Converts 8 bit pgm data between P2 and P5 without holding the
+ *             image in memory. The input is parsed a chunk at a time and the
+ *             converted samples are emitted into a fixed size output buffer,
+ *             so memory use is constant and output starts straight away. P2
+ *             numbers split across two input chunks are carried over, and are
+ *             read as fscanf's %i reads them: signed, and in hex after 0x or
+ *             octal after a leading 0.
+ *
+ * @param      c     A PgmConverter detailing conversion state information, with
+ *                   the input and output information already set.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryTranscodePgm(PgmConverter *c)
+{
+    unsigned char in[TRANSCODE_BUFFER_SIZE];
+    unsigned char out[TRANSCODE_BUFFER_SIZE];
+    size_t outLength = 0;
+    long long count = (long long)c->iF->width * c->iF->height;
+    long long dataCount = 0;
+    int col = 0;
+
+    // The value of a P2 number being parsed, or -1 before its first digit,
+    // with its base, its sign and whether an 0x prefix may follow
+    int value = -1;
+    int base = 10;
+    int sign = 0;
+    bool isPrefix = false;
+
+    WritePgmInfo(c->oF);
+
+    for (;;)
+    {
+        size_t inLength = fread(in, 1, sizeof(in), c->iF->fStream);
+        bool isEnd = inLength < sizeof(in);
+
+        // A P2 number ending the file is terminated by the end of the file
+        size_t i = 0;
+        for (; i <= inLength && dataCount < count; i++)
+        {
+            int data = -1;
+
+            if (i == inLength)
+            {
+                if (!isEnd || c->iF->type != P2 || value < 0)
+                    break;
+                data = sign < 0 && value > 0 ? 65536 : value;
+            }
+            else if (c->iF->type == P5)
+            {
+                data = in[i];
+            }
+            else
+            {
+                int ch = in[i];
+                int digit = ch >= '0' && ch <= '9' ? ch - '0'
+                    : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                    : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : 16;
+
+                // Accumulate digits, capped so that overflow stays corrupt
+                if (value >= 0 && digit < base)
+                {
+                    value = value * base + digit;
+                    value = value > 65535 ? 65536 : value;
+                    isPrefix = false;
+                    continue;
+                }
+                if (isPrefix && (ch == 'x' || ch == 'X'))
+                {
+                    base = 16;
+                    isPrefix = false;
+                    continue;
+                }
+
+                // Any other character ends a number, and may start the next,
+                // as "08" reads as 0 then 8. Negative numbers are corrupt.
+                if (value >= 0)
+                {
+                    data = sign < 0 && value > 0 ? 65536 : value;
+                    value = -1;
+                    sign = 0;
+                    isPrefix = false;
+                }
+                if (digit < 10)
+                {
+                    value = digit;
+                    base = digit == 0 ? 8 : 10;
+                    isPrefix = digit == 0;
+                }
+                else if (sign == 0 && (ch == '+' || ch == '-'))
+                {
+                    sign = ch == '-' ? -1 : 1;
+                }
+                else if (sign != 0 || ch == '\0'
+                    || strchr(" \t\r\n\v\f", ch) == NULL)
+                {
+                    fprintf(stderr, "Corrupted input file\n");
+                    return false;
+                }
+
+                if (data < 0)
+                    continue;
             }
-            // Else if the input type is P5
-            else if (c->oF->type == P5)
+
+            // If the value of data exceeds limits, it is corrupted
+            if (data > c->iF->maxDataValue)
+            {
+                fprintf(stderr, "Corrupted input file\n");
+                return false;
+            }
+            dataCount++;
+
+            // Emit the sample; P2 rows are space separated and end in newlines
+            if (c->oF->type == P5)
+            {
+                out[outLength++] = data;
+            }
+            else
+            {
+                if (col > 0)
+                    out[outLength++] = ' ';
+                if (data >= 100)
+                    out[outLength++] = '0' + data / 100;
+                if (data >= 10)
+                    out[outLength++] = '0' + data / 10 % 10;
+                out[outLength++] = '0' + data % 10;
+                if (col == c->oF->width - 1)
+                    out[outLength++] = '\n';
+            }
+            col = col == c->oF->width - 1 ? 0 : col + 1;
+
+            // Flush the output once there is not room for another sample
+            if (outLength + 8 > sizeof(out))
             {
-                fprintf(c->oF->fStream, "%c", c->cArgs->getData(c, row, col));
+                fwrite(out, 1, outLength, c->oF->fStream);
+                outLength = 0;
             }
         }
+
+        // P5 input is corrupted if there is data after the last sample
+        if (c->iF->type == P5 && dataCount == count
+            && (i < inLength || (!isEnd && fgetc(c->iF->fStream) != EOF)))
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            return false;
+        }
+
+        if (isEnd || dataCount == count)
+            break;
+    }
+
+    fwrite(out, 1, outLength, c->oF->fStream);
+
+    // Input is corrupted if there were fewer samples than the image size
+    if (dataCount != count)
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
     }
+
+    return true;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
-//                               Data retrieval                               //
+//                             Chained operations                             //
 ////////////////////////////////////////////////////////////////////////////////
 
-/**
- * @brief      Returns the original pixel data for a given row and column.
+/*-------------------------------------------------------------------------*//**
+ * @brief      Applies a comma separated chain of operations to a pgm file. The
+ *             operations form a graph. If the input fits in the memory limit
+ *             it is read whole and the output computed in cache sized tiles,
+ *             otherwise the writer pulls rows through the graph so that no
+ *             stage holds more than a few rows, except orientation changes
+ *             other than flipH which need the whole image.
  *
- * @param      c     A PgmConverter detailing conversion state information.
- * @param[in]  row   The 0-indexed row where the pixel is being written to.
- * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ * @param      ops       The operations, e.g. "rotate90,scaleBl:2,invert".
+ * @param      inName    The input file name.
+ * @param      outName   The output file name.
+ * @param[in]  memLimit  The most memory, in bytes, the input may use, or 0 for
+ *                       no limit.
+ * @param[in]  isLinear  True to apply the operations in linear light.
  *
- * @return     The integer value of the pixel to be written at [row, col].
+ * @return     Returns true when successful, false otherwise.
  */
-int GetData(PgmConverter *c, int row, int col)
+bool TryRunChain(char *ops, char *inName, char *outName, size_t memLimit,
+    bool isLinear)
 {
-    return c->data[row][col];
+    PgmFile iF = { NULL, inName, 0, 0, 0, UNKNOWN };
+    PgmFile oF = { NULL, outName, 0, 0, 0, UNKNOWN };
+    ConversionArgs cArgs = { GetData, false, false, ORIENT_IDENTITY, memLimit,
+        isLinear };
+    PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+    OpGraph *g = calloc(1, sizeof(OpGraph));
+
+    // Try and open the io files and parse the pgm info, reporting failure
+    if (g == NULL || !TryOpenStreams(&c) || !TryReadPgmInfo(&c))
+    {
+        if (g == NULL)
+            fprintf(stderr, "Error, out of memory\n");
+        else if (iF.fStream != NULL)
+            CloseStreams(&c);
+        free(g);
+        return false;
+    }
+
+    // Orientation changes which cancel out, such as rotating by 180 degrees
+    // twice, leave the data as it is
+    if (IsIdentityChain(ops) && iF.type == P5)
+    {
+        SetOutputType(&iF, &oF);
+        oF.width = iF.width;
+        oF.height = iF.height;
+        oF.maxDataValue = iF.maxDataValue;
+        if (IsPassThrough(&c))
+        {
+            bool isCopied = TryPassThroughPgm(&c);
+            free(g);
+            CloseStreams(&c);
+            return isCopied;
+        }
+    }
+
+    // Build the graph, read the input whole if it fits, and write the output
+    g->iF = &iF;
+    bool isTiled = memLimit == 0 || (double)iF.width * iF.height <= memLimit;
+    bool isSuccess = TryBuildGraph(g, ops)
+        && (!isTiled || TryReadGraphInput(g)) && TryWriteGraph(g, &oF);
+
+    FreeGraph(g);
+    free(g);
+    CloseStreams(&c);
+    return isSuccess;
 }
 
 
-/**
- * @brief      Returns the pixel data for a given row and column. The data
- *             returned is for if the array were reflected in y=-x.
+/*-------------------------------------------------------------------------*//**
+ * @brief      Applies a chain of operations to a stream of pnm frames read
+ *             back to back from stdin, writing each result to stdout as soon
+ *             as it is complete. The graph, its buffers and its plans are
+ *             reused for every frame of the same size. The latency of each
+ *             frame is recorded and percentiles are reported on exit.
  *
- * @param      c     A PgmConverter detailing conversion state information.
- * @param[in]  row   The 0-indexed row where the pixel is being written to.
- * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ * @param      ops       The operations, as for --chain.
+ * @param[in]  memLimit  The most memory, in bytes, a frame may use, or 0 for
+ *                       no limit.
+ * @param[in]  isLinear  True to apply the operations in linear light.
  *
- * @return     The integer value of the pixel to be written at [row, col].
+ * @return     Returns true when every frame was converted, false otherwise.
  */
-int GetReflectedData(PgmConverter *c, int row, int col)
+bool TryRunStream(char *ops, size_t memLimit, bool isLinear)
 {
-    return c->data[col][row];
+    PgmFile iF = { stdin, "stdin", 0, 0, 0, UNKNOWN };
+    PgmFile oF = { stdout, "stdout", 0, 0, 0, UNKNOWN };
+    ConversionArgs cArgs = { GetData, false, false, ORIENT_IDENTITY, memLimit,
+        isLinear };
+    PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+    OpGraph *g = calloc(1, sizeof(OpGraph));
+    char *opsCopy = malloc(strlen(ops) + 1);
+    double *latencies = NULL;
+    size_t frames = 0;
+    size_t capacity = 0;
+    bool isTiled = false;
+    bool isSuccess = g != NULL && opsCopy != NULL;
+
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // Convert frames until the input ends
+    while (isSuccess && HasNextFrame(stdin))
+    {
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        // Parse the frame's header, which may differ from the last frame's
+        int width = iF.width;
+        int height = iF.height;
+        int maxDataValue = iF.maxDataValue;
+        iF.type = UNKNOWN;
+        oF.type = UNKNOWN;
+        if (!TryReadPgmInfo(&c))
+        {
+            isSuccess = false;
+            break;
+        }
+        if (iF.type == PF)
+        {
+            fprintf(stderr, "Error, streamed frames must not be pfm\n");
+            isSuccess = false;
+            break;
+        }
+
+        // Build the graph for the first frame and whenever the size changes
+        if (g->count == 0 || iF.width != width || iF.height != height
+            || iF.maxDataValue != maxDataValue)
+        {
+            FreeGraph(g);
+            memset(g, 0, sizeof(OpGraph));
+            g->iF = &iF;
+            g->isStream = true;
+            strcpy(opsCopy, ops);
+            isTiled = memLimit == 0
+                || (double)iF.width * iF.height <= memLimit;
+            if (!TryBuildGraph(g, opsCopy))
+            {
+                isSuccess = false;
+                break;
+            }
+        }
+
+        // Convert the frame and send it on at once
+        ResetGraph(g);
+        if ((isTiled && !TryReadGraphInput(g)) || !TryWriteGraph(g, &oF))
+        {
+            isSuccess = false;
+            break;
+        }
+        fflush(stdout);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        // Record the frame's latency in milliseconds
+        if (frames == capacity)
+        {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            double *grown = realloc(latencies, capacity * sizeof(double));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Error, out of memory\n");
+                isSuccess = false;
+                break;
+            }
+            latencies = grown;
+        }
+        latencies[frames++] = (end.tv_sec - start.tv_sec) * 1e3
+            + (end.tv_nsec - start.tv_nsec) / 1e6;
+    }
+
+    // Report the latency percentiles, nearest rank
+    if (frames > 0)
+    {
+        qsort(latencies, frames, sizeof(double), CompareDoubles);
+        fprintf(stderr, "%zu frames, latency ms: p50 %.3f, p90 %.3f, "
+            "p99 %.3f, max %.3f\n", frames,
+            latencies[(frames * 50 + 99) / 100 - 1],
+            latencies[(frames * 90 + 99) / 100 - 1],
+            latencies[(frames * 99 + 99) / 100 - 1],
+            latencies[frames - 1]);
+    }
+
+    if (g != NULL)
+        FreeGraph(g);
+    free(g);
+    free(opsCopy);
+    free(latencies);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Builds an operation graph, starting with a node which reads the
+ *             input file. A pfm input is scanned once to find its max value.
+ *
+ * @param      g     The graph, whose iF has been parsed up to its data.
+ * @param      ops   The comma separated operations.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryBuildGraph(OpGraph *g, char *ops)
+{
+    g->dataStart = ftello(g->iF->fStream);
+
+    // A pfm has no max value in its header, so find the max of its data
+    if (g->iF->type == PF)
+    {
+        double *data = malloc(g->iF->width * sizeof(double));
+        double max = 0;
+        bool isValid = data != NULL;
+        for (int row = 0; row < g->iF->height && isValid; row++)
+        {
+            isValid = TryReadPgmRow(g->iF, data);
+            for (int col = 0; col < g->iF->width && isValid; col++)
+                max = data[col] > max ? data[col] : max;
+        }
+        free(data);
+
+        if (!isValid || fgetc(g->iF->fStream) != EOF)
+        {
+            fprintf(stderr, data == NULL ? "Error, out of memory\n"
+                : "Corrupted input file\n");
+            return false;
+        }
+        g->iF->maxDataValue = max > 255 ? 65535 : 255;
+    }
+
+    // The reader node outputs the input image
+    OpNode *reader = &g->nodes[0];
+    reader->type = OP_READ;
+    reader->graph = g;
+    reader->width = g->iF->width;
+    reader->height = g->iF->height;
+    reader->maxDataValue = g->iF->maxDataValue;
+    reader->row = malloc(reader->width * sizeof(double));
+    g->count = 1;
+    if (reader->row == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    // Add a node for each operation in turn
+    for (char *op = strtok(ops, ","); op != NULL; op = strtok(NULL, ","))
+    {
+        if (!TryAddOp(g, op))
+            return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Adds a node to the end of an operation graph.
+ *
+ * @param      g     The graph.
+ * @param      op    The operation, its name and an optional ":ARG".
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryAddOp(OpGraph *g, char *op)
+{
+    if (g->count == MAX_OPS + 1)
+    {
+        fprintf(stderr, "Error, at most %i operations can be chained\n", MAX_OPS);
+        return false;
+    }
+
+    // Split the argument from the operation name
+    char *arg = strchr(op, ':');
+    if (arg != NULL)
+        *arg++ = '\0';
+
+    // The node starts with the dimensions of its upstream node
+    OpNode *up = &g->nodes[g->count - 1];
+    OpNode *n = &g->nodes[g->count];
+    n->graph = g;
+    n->upstream = up;
+    n->width = up->width;
+    n->height = up->height;
+    n->maxDataValue = up->maxDataValue;
+    n->cacheRows = 1;
+
+    // Find the orientation change named by the operation, if any
+    enum Orientation orientation = StrToOrientation(op);
+    int length = 0;
+
+    // Orientation changes, swapping dimensions for quarter turns
+    if (orientation != ORIENT_IDENTITY && arg == NULL)
+    {
+        n->type = OP_ORIENT;
+        n->orientation = orientation;
+        if (orientation == ORIENT_TRANSPOSE || orientation == ORIENT_ROTATE90
+            || orientation == ORIENT_ROTATE270)
+        {
+            n->width = up->height;
+            n->height = up->width;
+        }
+    }
+    // Scaling, which reads upstream rows through the node's view
+    else if ((!strcmp(op, "scaleNn") || !strcmp(op, "scaleBl")) && arg != NULL)
+    {
+        n->type = OP_SCALE;
+        PgmFile viewIn = { NULL, NULL, up->width, up->height, up->maxDataValue };
+        ScaleArgs sArgs = { arg, op[5] == 'N' ? NEAREST_NEIGHBOR : BILINEAR,
+            false, 1, 1 };
+        ConversionArgs cArgs = { op[5] == 'N' ? GetScaledNnData : NULL,
+            false, true };
+        n->viewIn = viewIn;
+        n->sArgs = sArgs;
+        n->cArgs = cArgs;
+        PgmConverter view = { &n->viewIn, &n->viewOut, &n->cArgs, &n->sArgs,
+            {}, n };
+        n->view = view;
+        if (!TryParseScalar(&n->view))
+            return false;
+
+        n->width = (int)(up->width * n->sArgs.wScale);
+        n->height = (int)(up->height * n->sArgs.hScale);
+        n->viewOut = n->viewIn;
+        n->viewOut.width = n->width;
+        n->viewOut.height = n->height;
+        if (n->width < 1 || n->height < 1)
+        {
+            fprintf(stderr, "Error, \"%s\" scales the image to nothing\n", arg);
+            return false;
+        }
+
+        // Find or build the plan of source rows and columns
+        n->sArgs.plan = GetScalePlan(n->cArgs.getData, &n->viewIn,
+            &n->viewOut, &n->sArgs);
+        if (n->sArgs.plan == NULL)
+            return false;
+
+        // Bilinear scaling reads the rows either side of the source row, and
+        // box scaling reads every source row covered by the output row
+        if (n->cArgs.getData == GetScaledUpBlData)
+            n->cacheRows = 4;
+        else if (n->cArgs.getData == GetScaledDownBoxData)
+            n->cacheRows = (int)ceil(1 / n->sArgs.hScale) + 2;
+    }
+    // Point operations
+    else if (!strcmp(op, "invert") && arg == NULL)
+    {
+        n->type = OP_INVERT;
+    }
+    else if (!strcmp(op, "threshold") && arg != NULL
+        && sscanf(arg, "%lf%n", &n->threshold, &length) == 1
+        && arg[length] == '\0')
+    {
+        n->type = OP_THRESHOLD;
+    }
+    // Filters, which read the rows either side of the output row
+    else if (!strcmp(op, "blur") && arg == NULL)
+    {
+        n->type = OP_BLUR;
+        n->cacheRows = 3;
+    }
+    // Remapping, whose output size is set by the map
+    else if (!strcmp(op, "remap") && arg != NULL)
+    {
+        n->type = OP_REMAP;
+        if (!TryLoadRemap(&n->remap, arg))
+            return false;
+
+        n->width = n->remap.width;
+        n->height = n->remap.height;
+    }
+    // Warping, which keeps the image size
+    else if (!strcmp(op, "warp") && arg != NULL)
+    {
+        n->type = OP_WARP;
+        if (!TryParseWarp(arg, n->warp))
+            return false;
+    }
+    else
+    {
+        fprintf(stderr, "Error, bad operation \"%s\". Check README for usage:\n",
+            op);
+        return false;
+    }
+
+    // Allocate the output row and the upstream row cache
+    n->row = malloc(n->width * sizeof(double));
+    n->cache = malloc((size_t)n->cacheRows * up->width * sizeof(double));
+    g->count++;
+    if (n->row == NULL || n->cache == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Checks whether a chain of operations consists only of
+ *             orientation changes which together leave the image as it is.
+ *
+ * @param[in]  ops   The comma separated operations.
+ *
+ * @return     Returns true if the chain changes nothing.
+ */
+bool IsIdentityChain(const char *ops)
+{
+    enum Orientation orientation = ORIENT_IDENTITY;
+    const char *op = ops;
+    while (op != NULL)
+    {
+        // Copy out the operation, which must be an orientation change
+        char name[16];
+        size_t length = strcspn(op, ",");
+        if (length >= sizeof(name))
+            return false;
+        memcpy(name, op, length);
+        name[length] = '\0';
+
+        enum Orientation next = StrToOrientation(name);
+        if (next == ORIENT_IDENTITY)
+            return false;
+        orientation = ComposeOrientations(orientation, next);
+
+        op = op[length] == ',' ? op + length + 1 : NULL;
+    }
+
+    return orientation == ORIENT_IDENTITY;
+}
+
+
+/**
+ * @brief      Writes the output of the last node of a graph, one row at a
+ *             time. A png is encoded in parallel bands, so its image is held
+ *             in memory.
+ *
+ * @param      g     The graph.
+ * @param      oF    The output file information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryWriteGraph(OpGraph *g, PgmFile *oF)
+{
+    OpNode *last = &g->nodes[g->count - 1];
+    SetOutputType(g->iF, oF);
+    oF->width = last->width;
+    oF->height = last->height;
+    oF->maxDataValue = last->maxDataValue;
+
+    // Pull the image into a raster and encode it as a png
+    if (oF->type == PNG)
+    {
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { g->iF, oF, &cArgs, NULL, {} };
+        if (!TryAllocateRaster(&c.data, oF->width, oF->height, SAMPLE_F64))
+        {
+            fprintf(stderr, "Error, out of memory\n");
+            return false;
+        }
+
+        for (int row = 0; row < oF->height && !g->isFailed; row++)
+        {
+            const double *data = GetOutputRow(g, row);
+            for (int col = 0; col < oF->width; col++)
+                SetSample(&c.data, row, col, data[col]);
+        }
+
+        bool isWritten = !g->isFailed && TryWritePngData(&c);
+        FreeRaster(&c.data);
+        return isWritten;
+    }
+
+    // Pull and write each row, placing pfm rows from the bottom up
+    WritePgmInfo(oF);
+    off_t outStart = ftello(oF->fStream);
+    for (int row = 0; row < oF->height; row++)
+    {
+        const double *data = GetOutputRow(g, row);
+        if (g->isFailed)
+            return false;
+
+        if (oF->type == PF)
+            fseeko(oF->fStream, outStart
+                + (off_t)(oF->height - 1 - row) * oF->width * 4, SEEK_SET);
+        WritePgmRow(oF, data);
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Produces an output row of a node. Rows must be pulled from each
+ *             node in increasing order.
+ *
+ * @param      n     The node.
+ * @param[in]  row   The 0-indexed output row.
+ *
+ * @return     The row, valid until the next row is pulled from the node.
+ */
+const double *PullRow(OpNode *n, int row)
+{
+    OpGraph *g = n->graph;
+
+    switch (n->type)
+    {
+        // Read the next row of the file, seeking to pfm rows as they are
+        // stored from the bottom up
+        case OP_READ:
+            if (g->iF->type == PF)
+                fseeko(g->iF->fStream, g->dataStart
+                    + (off_t)(n->height - 1 - row) * n->width * 4, SEEK_SET);
+
+            if (!g->isFailed && (!TryReadPgmRow(g->iF, n->row)
+                || (row == n->height - 1 && !IsPlainPnm(g->iF->type)
+                && g->iF->type != PF && !g->isStream && fgetc(g->iF->fStream) != EOF)))
+            {
+                fprintf(stderr, "Corrupted input file\n");
+                g->isFailed = true;
+            }
+            break;
+
+        // Reflect flipH rows as they pass, otherwise hold the whole upstream
+        // image and change its orientation in place or remap from it
+        case OP_ORIENT:
+        case OP_REMAP:
+        case OP_WARP:
+            if (n->type == OP_ORIENT && n->orientation == ORIENT_FLIP_H)
+            {
+                const double *data = GetUpstreamRow(n, row);
+                for (int col = 0; col < n->width; col++)
+                    n->row[col] = data[n->width - 1 - col];
+                break;
+            }
+
+            if (!n->isHeld)
+            {
+                OpNode *up = n->upstream;
+                if (n->raster.pixels == NULL && !TryAllocateRaster(&n->raster,
+                    up->width, up->height, SAMPLE_F64))
+                {
+                    fprintf(stderr, "Error, out of memory\n");
+                    g->isFailed = true;
+                    break;
+                }
+
+                // A raster reused from an earlier frame may be transposed
+                n->raster.width = up->width;
+                n->raster.height = up->height;
+                n->isHeld = true;
+
+                for (int r = 0; r < up->height; r++)
+                {
+                    const double *data = GetUpstreamRow(n, r);
+                    for (int col = 0; col < up->width; col++)
+                        SetSample(&n->raster, r, col, data[col]);
+                }
+
+                if (n->type == OP_ORIENT
+                    && !TryOrientRaster(&n->raster, n->orientation))
+                {
+                    fprintf(stderr, "Error, out of memory\n");
+                    g->isFailed = true;
+                    break;
+                }
+            }
+
+            if (n->type == OP_ORIENT)
+            {
+                for (int col = 0; col < n->width; col++)
+                    n->row[col] = GetSample(&n->raster, row, col);
+            }
+            else
+            {
+                Tile whole = { 0, 0, n->raster.width, n->raster.height,
+                    n->raster.pixels };
+                if (n->type == OP_WARP)
+                    WarpRow(n, &whole, row, 0, n->width, n->row);
+                else
+                    for (int col = 0; col < n->width; col++)
+                        n->row[col] = EvaluateNode(n, &whole, row, col);
+            }
+            break;
+
+        case OP_SCALE:
+            for (int col = 0; col < n->width; col++)
+                n->row[col] = n->cArgs.getData(&n->view, row, col);
+            break;
+
+        case OP_INVERT:
+        {
+            const double *data = GetUpstreamRow(n, row);
+            for (int col = 0; col < n->width; col++)
+                n->row[col] = n->maxDataValue - data[col];
+            break;
+        }
+
+        case OP_THRESHOLD:
+        {
+            const double *data = GetUpstreamRow(n, row);
+            for (int col = 0; col < n->width; col++)
+                n->row[col] = data[col] >= n->threshold ? n->maxDataValue : 0;
+            break;
+        }
+
+        // Average the 3x3 neighbourhood, clamping at the image edges
+        case OP_BLUR:
+        {
+            const double *rows[3] = { GetUpstreamRow(n, row - 1),
+                GetUpstreamRow(n, row), GetUpstreamRow(n, row + 1) };
+            for (int col = 0; col < n->width; col++)
+            {
+                int left = col == 0 ? 0 : col - 1;
+                int right = col == n->width - 1 ? col : col + 1;
+                double sum = 0;
+                for (int i = 0; i < 3; i++)
+                    sum += rows[i][left] + rows[i][col] + rows[i][right];
+                n->row[col] = sum / 9;
+            }
+            break;
+        }
+    }
+
+    return n->row;
+}
+
+
+/**
+ * @brief      Returns a row of a node's upstream image, pulling upstream rows
+ *             into the node's cache until it is reached. Rows outside the
+ *             image are clamped to the nearest edge.
+ *
+ * @param      n     The node.
+ * @param[in]  row   The 0-indexed upstream row.
+ *
+ * @return     The upstream row, valid until cacheRows further rows are pulled.
+ */
+const double *GetUpstreamRow(OpNode *n, int row)
+{
+    OpNode *up = n->upstream;
+    row = row < 0 ? 0 : row >= up->height ? up->height - 1 : row;
+
+    // Pull rows until the requested row is cached
+    while (n->nextUpstreamRow <= row)
+    {
+        int slot = n->nextUpstreamRow % n->cacheRows;
+        memcpy(n->cache + (size_t)slot * up->width,
+            PullRow(up, n->nextUpstreamRow), up->width * sizeof(double));
+        n->nextUpstreamRow++;
+    }
+
+    // The cache is sized so that rows a node reads are never evicted first
+    return n->cache + (size_t)(row % n->cacheRows) * up->width;
+}
+
+
+/**
+ * @brief      Prepares a graph to convert another image of the same size,
+ *             keeping its buffers.
+ *
+ * @param      g     The graph.
+ */
+void ResetGraph(OpGraph *g)
+{
+    g->isFailed = false;
+    for (int i = 0; i < g->count; i++)
+    {
+        g->nodes[i].nextUpstreamRow = 0;
+        g->nodes[i].isHeld = false;
+    }
+}
+
+
+/**
+ * @brief      Orders two doubles, for qsort.
+ *
+ * @param[in]  a     The first double.
+ * @param[in]  b     The second double.
+ *
+ * @return     A negative, zero or positive value as a is less than, equal to
+ *             or greater than b.
+ */
+int CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief      Frees the buffers held by the nodes of a graph.
+ *
+ * @param      g     The graph.
+ */
+void FreeGraph(OpGraph *g)
+{
+    for (int i = 0; i < g->count; i++)
+    {
+        free(g->nodes[i].row);
+        free(g->nodes[i].cache);
+        FreeRaster(&g->nodes[i].raster);
+        FreeRemap(&g->nodes[i].remap);
+    }
+
+    FreeRaster(&g->input);
+    free(g->band);
+    free(g->isTileFailed);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                               Tiled execution                              //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Reads the whole input of a graph into memory, so that the output
+ *             can be computed in tiles rather than pulled a row at a time.
+ *
+ * @param      g     The graph.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryReadGraphInput(OpGraph *g)
+{
+    OpNode *reader = &g->nodes[0];
+    OpNode *last = &g->nodes[g->count - 1];
+    enum SampleType sampleType = g->iF->type == PF || g->iF->linear != NULL
+        ? SAMPLE_F32 : g->iF->maxDataValue > 255 ? SAMPLE_U16 : SAMPLE_U8;
+
+    // Output is computed in bands of tile rows, enough to give each thread a
+    // couple of tiles at a time
+    int across = (last->width + TILE_SIZE - 1) / TILE_SIZE;
+    int tileRows = (GetThreadCount() * 2 + across - 1) / across;
+    g->bandRows = tileRows * TILE_SIZE;
+    if (g->band == NULL)
+        g->band = malloc((size_t)g->bandRows * last->width * sizeof(double));
+    if (g->isTileFailed == NULL)
+        g->isTileFailed = malloc((size_t)tileRows * across * sizeof(bool));
+
+    // The input raster is kept for the following frames of a stream
+    if (g->band == NULL || g->isTileFailed == NULL
+        || (g->input.pixels == NULL && !TryAllocateRaster(
+        &g->input, reader->width, reader->height, sampleType)))
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    for (int row = 0; row < reader->height && !g->isFailed; row++)
+    {
+        const double *data = PullRow(reader, row);
+        for (int col = 0; col < reader->width; col++)
+            SetSample(&g->input, row, col, data[col]);
+    }
+
+    return !g->isFailed;
+}
+
+
+/**
+ * @brief      Returns an output row of a graph, computing the band of tiles
+ *             holding it when rows are computed in tiles.
+ *
+ * @param      g     The graph.
+ * @param[in]  row   The 0-indexed output row. Rows must be requested in order.
+ *
+ * @return     The row, valid until the next row is requested.
+ */
+const double *GetOutputRow(OpGraph *g, int row)
+{
+    OpNode *last = &g->nodes[g->count - 1];
+    if (g->input.pixels == NULL)
+        return PullRow(last, row);
+
+    // Compute the next band of tiles in parallel once the last is written
+    if (row % g->bandRows == 0)
+    {
+        int height = last->height - row < g->bandRows
+            ? last->height - row : g->bandRows;
+        int across = (last->width + TILE_SIZE - 1) / TILE_SIZE;
+        int down = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+        // Tiles record their failures apart, as they run on many threads
+        g->bandRow = row;
+        memset(g->isTileFailed, 0, (size_t)across * down * sizeof(bool));
+        RunParallel(across * down, RunTile, g);
+        for (int i = 0; i < across * down && !g->isFailed; i++)
+        {
+            if (g->isTileFailed[i])
+            {
+                fprintf(stderr, "Error, out of memory\n");
+                g->isFailed = true;
+            }
+        }
+    }
+
+    return g->band + (size_t)(row - g->bandRow) * last->width;
+}
+
+
+/**
+ * @brief      Computes one output tile of the current band, running every
+ *             operation of the chain on the region of its input the tile needs
+ *             while that region is still in cache. This is run as a parallel
+ *             job, see RunParallel.
+ *
+ * @param      arg    The graph.
+ * @param[in]  index  The index of the tile within the band.
+ */
+void RunTile(void *arg, int index)
+{
+    OpGraph *g = arg;
+    OpNode *last = &g->nodes[g->count - 1];
+    int across = (last->width + TILE_SIZE - 1) / TILE_SIZE;
+
+    // The output tile, clipped to the image
+    Tile regions[MAX_OPS + 1];
+    Tile tile = { g->bandRow + index / across * TILE_SIZE,
+        index % across * TILE_SIZE, TILE_SIZE, TILE_SIZE, NULL };
+    tile.width = last->width - tile.col < tile.width
+        ? last->width - tile.col : tile.width;
+    tile.height = last->height - tile.row < tile.height
+        ? last->height - tile.row : tile.height;
+
+    // Work back through the chain to find the region each stage must compute.
+    // A stage which reads nothing of its source outputs only 0, so the
+    // stages before it are skipped.
+    int first = 0;
+    regions[g->count - 1] = tile;
+    for (int i = g->count - 1; i > 0; i--)
+    {
+        regions[i - 1] = regions[i].width == 0 ? regions[i]
+            : MapRegion(&g->nodes[i], regions[i]);
+        first = regions[i - 1].width == 0 && first == 0 ? i : first;
+    }
+
+    // Copy the input region, then compute each stage from the one before
+    for (int i = first; i < g->count; i++)
+    {
+        Tile *t = &regions[i];
+        t->pixels = calloc((size_t)t->width * t->height, sizeof(double));
+        if (t->pixels == NULL)
+        {
+            g->isTileFailed[index] = true;
+            free(i > first ? regions[i - 1].pixels : NULL);
+            return;
+        }
+
+        for (int row = 0; row < t->height && (i == 0 || i > first); row++)
+        {
+            double *pixel = t->pixels + (size_t)row * t->width;
+            if (i > 0 && g->nodes[i].type == OP_WARP)
+            {
+                WarpRow(&g->nodes[i], &regions[i - 1], t->row + row, t->col,
+                    t->width, pixel);
+                continue;
+            }
+
+            for (int col = 0; col < t->width; col++)
+                pixel[col] = i == 0
+                    ? GetSample(&g->input, t->row + row, t->col + col)
+                    : EvaluateNode(&g->nodes[i], &regions[i - 1],
+                        t->row + row, t->col + col);
+        }
+
+        if (i > first)
+            free(regions[i - 1].pixels);
+    }
+
+    // Place the finished tile in the band
+    Tile *out = &regions[g->count - 1];
+    for (int row = 0; row < out->height; row++)
+        memcpy(g->band + (size_t)(out->row - g->bandRow + row) * last->width
+            + out->col, out->pixels + (size_t)row * out->width,
+            out->width * sizeof(double));
+    free(out->pixels);
+}
+
+
+/**
+ * @brief      Finds the region of a node's upstream image needed to compute a
+ *             region of its output, clipped to the upstream image.
+ *
+ * @param      n     The node.
+ * @param[in]  out   The output region.
+ *
+ * @return     The upstream region, with no pixels.
+ */
+Tile MapRegion(OpNode *n, Tile out)
+{
+    OpNode *up = n->upstream;
+    int top = out.row;
+    int left = out.col;
+    int bottom = out.row + out.height - 1;
+    int right = out.col + out.width - 1;
+
+    switch (n->type)
+    {
+        // Orientation changes map the region's corners
+        case OP_ORIENT:
+        {
+            int row1 = top, col1 = left, row2 = bottom, col2 = right;
+            OrientPoint(n->orientation, n->width, n->height, &row1, &col1);
+            OrientPoint(n->orientation, n->width, n->height, &row2, &col2);
+            top = row1 < row2 ? row1 : row2;
+            bottom = row1 < row2 ? row2 : row1;
+            left = col1 < col2 ? col1 : col2;
+            right = col1 < col2 ? col2 : col1;
+            break;
+        }
+
+        // Scaling reads up to a sample beyond the scaled region on each side
+        case OP_SCALE:
+            top = (int)(top / n->sArgs.hScale) - 1;
+            bottom = (int)((bottom + 1) / n->sArgs.hScale) + 1;
+            left = (int)(left / n->sArgs.wScale) - 1;
+            right = (int)((right + 1) / n->sArgs.wScale) + 1;
+            break;
+
+        case OP_BLUR:
+            top--;
+            bottom++;
+            left--;
+            right++;
+            break;
+
+        case OP_REMAP:
+            return MapRemapRegion(&n->remap, out, up->width, up->height);
+
+        case OP_WARP:
+            return MapWarpRegion(n, out);
+
+        default:
+            break;
+    }
+
+    top = top < 0 ? 0 : top;
+    left = left < 0 ? 0 : left;
+    bottom = bottom >= up->height ? up->height - 1 : bottom;
+    right = right >= up->width ? up->width - 1 : right;
+
+    Tile in = { top, left, right - left + 1, bottom - top + 1, NULL };
+    return in;
+}
+
+
+/**
+ * @brief      Computes one output sample of a node from a region of its
+ *             upstream image.
+ *
+ * @param      n     The node.
+ * @param[in]  in    The upstream region, holding every sample needed.
+ * @param[in]  row   The 0-indexed output row.
+ * @param[in]  col   The 0-indexed output column.
+ *
+ * @return     The output sample.
+ */
+double EvaluateNode(OpNode *n, const Tile *in, int row, int col)
+{
+    switch (n->type)
+    {
+        case OP_ORIENT:
+            OrientPoint(n->orientation, n->width, n->height, &row, &col);
+            return GetTileSample(in, row, col);
+
+        // Scaling runs the data retrieval functions on a view of the region
+        case OP_SCALE:
+        {
+            PgmConverter view = n->view;
+            view.source = NULL;
+            view.tile = in;
+            return n->cArgs.getData(&view, row, col);
+        }
+
+        case OP_INVERT:
+            return n->maxDataValue - GetTileSample(in, row, col);
+
+        case OP_THRESHOLD:
+            return GetTileSample(in, row, col) >= n->threshold
+                ? n->maxDataValue : 0;
+
+        case OP_BLUR:
+        {
+            double sum = 0;
+            for (int r = row - 1; r <= row + 1; r++)
+                sum += GetTileSample(in, r, col - 1) + GetTileSample(in, r, col)
+                    + GetTileSample(in, r, col + 1);
+            return sum / 9;
+        }
+
+        case OP_REMAP:
+            return RemapSample(&n->remap, in, n->upstream->width,
+                n->upstream->height, row, col);
+
+        case OP_WARP:
+        {
+            double value = 0;
+            WarpRow(n, in, row, col, 1, &value);
+            return value;
+        }
+
+        default:
+            return GetTileSample(in, row, col);
+    }
+}
+
+
+/**
+ * @brief      Maps a position in a reoriented image to its position in the
+ *             original image.
+ *
+ * @param[in]  orientation  The orientation change.
+ * @param[in]  width        The width of the reoriented image.
+ * @param[in]  height       The height of the reoriented image.
+ * @param      row          The row, replaced by the original row.
+ * @param      col          The column, replaced by the original column.
+ */
+void OrientPoint(enum Orientation orientation, int width, int height,
+    int *row, int *col)
+{
+    int r = *row;
+    int c = *col;
+
+    switch (orientation)
+    {
+        case ORIENT_TRANSPOSE:
+            *row = c;
+            *col = r;
+            break;
+        case ORIENT_ROTATE90:
+            *row = width - 1 - c;
+            *col = r;
+            break;
+        case ORIENT_ROTATE180:
+            *row = height - 1 - r;
+            *col = width - 1 - c;
+            break;
+        case ORIENT_ROTATE270:
+            *row = c;
+            *col = height - 1 - r;
+            break;
+        case ORIENT_FLIP_H:
+            *col = width - 1 - c;
+            break;
+        case ORIENT_FLIP_V:
+            *row = height - 1 - r;
+            break;
+        case ORIENT_ANTI_TRANSPOSE:
+            *row = width - 1 - c;
+            *col = height - 1 - r;
+            break;
+        default:
+            break;
+    }
+}
+
+
+/**
+ * @brief      Returns a sample of a tile. Positions outside the tile are
+ *             clamped to its edge, which for a region clipped to its image
+ *             matches clamping to the image edge.
+ *
+ * @param[in]  t     The tile.
+ * @param[in]  row   The 0-indexed image row.
+ * @param[in]  col   The 0-indexed image column.
+ *
+ * @return     The sample.
+ */
+double GetTileSample(const Tile *t, int row, int col)
+{
+    row = row < t->row ? t->row : row >= t->row + t->height
+        ? t->row + t->height - 1 : row;
+    col = col < t->col ? t->col : col >= t->col + t->width
+        ? t->col + t->width - 1 : col;
+    return t->pixels[(size_t)(row - t->row) * t->width + (col - t->col)];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                 Remapping                                  //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Loads a remap file, expanding its coarse grid of source
+ *             coordinates into fixed point coordinates for every output sample,
+ *             so that applying the map needs no per frame setup.
+ *
+ * @param      m         Output for the map.
+ * @param[in]  fileName  The remap file name.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryLoadRemap(Remap *m, const char *fileName)
+{
+    FILE *stream = fopen(fileName, "rb");
+    if (stream == NULL)
+    {
+        fprintf(stderr, "No such file: \"%s\"\n", fileName);
+        return false;
+    }
+
+    // Parse the header: the magic number, output size and grid spacing
+    char token[64];
+    int step = 0;
+    int n = 0;
+    bool isValid = TryReadHeaderToken(stream, token, sizeof(token))
+        && !strcmp(token, "RM")
+        && TryReadHeaderToken(stream, token, sizeof(token))
+        && sscanf(token, "%i%n", &m->width, &n) == 1 && token[n] == '\0'
+        && TryReadHeaderToken(stream, token, sizeof(token))
+        && sscanf(token, "%i%n", &m->height, &n) == 1 && token[n] == '\0'
+        && TryReadHeaderToken(stream, token, sizeof(token))
+        && sscanf(token, "%i%n", &step, &n) == 1 && token[n] == '\0'
+        && m->width > 0 && m->height > 0 && step > 0;
+
+    // Read the grid of source x, y coordinates, one point every step samples
+    int gridWidth = (m->width - 2 + step) / step + 1;
+    int gridHeight = (m->height - 2 + step) / step + 1;
+    double *grid = isValid
+        ? malloc((size_t)gridWidth * gridHeight * 2 * sizeof(double)) : NULL;
+    for (size_t i = 0; isValid && grid != NULL
+        && i < (size_t)gridWidth * gridHeight * 2; i++)
+    {
+        isValid = TryReadHeaderToken(stream, token, sizeof(token))
+            && sscanf(token, "%lf%n", &grid[i], &n) == 1 && token[n] == '\0'
+            && fabs(grid[i]) < 32768;
+    }
+    isValid = isValid && !TryReadHeaderToken(stream, token, sizeof(token));
+    fclose(stream);
+
+    if (!isValid)
+    {
+        fprintf(stderr, "Corrupted remap file\n");
+        free(grid);
+        return false;
+    }
+
+    m->x = malloc((size_t)m->width * m->height * sizeof(int32_t));
+    m->y = malloc((size_t)m->width * m->height * sizeof(int32_t));
+    if (grid == NULL || m->x == NULL || m->y == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        free(grid);
+        FreeRemap(m);
+        return false;
+    }
+
+    // Interpolate the grid bilinearly at each output sample
+    for (int row = 0; row < m->height; row++)
+    {
+        int gridRow = row / step;
+        int below = gridRow + 1 < gridHeight ? gridRow + 1 : gridRow;
+        double fy = (double)(row % step) / step;
+
+        for (int col = 0; col < m->width; col++)
+        {
+            int gridCol = col / step;
+            int right = gridCol + 1 < gridWidth ? gridCol + 1 : gridCol;
+            double fx = (double)(col % step) / step;
+
+            for (int axis = 0; axis < 2; axis++)
+            {
+                double value = BilinearInterpolate(fx, fy,
+                    grid[((size_t)gridRow * gridWidth + gridCol) * 2 + axis],
+                    grid[((size_t)below * gridWidth + gridCol) * 2 + axis],
+                    grid[((size_t)gridRow * gridWidth + right) * 2 + axis],
+                    grid[((size_t)below * gridWidth + right) * 2 + axis]);
+                int32_t fixed = (int32_t)floor(value * (1 << REMAP_FRACTION_BITS)
+                    + 0.5);
+                if (axis == 0)
+                    m->x[(size_t)row * m->width + col] = fixed;
+                else
+                    m->y[(size_t)row * m->width + col] = fixed;
+            }
+        }
+    }
+
+    free(grid);
+    return true;
+}
+
+
+/**
+ * @brief      Frees the coordinates of a remap.
+ *
+ * @param      m     The map.
+ */
+void FreeRemap(Remap *m)
+{
+    free(m->x);
+    free(m->y);
+    m->x = NULL;
+    m->y = NULL;
+}
+
+
+/**
+ * @brief      Samples the source image at the remapped position of an output
+ *             sample, interpolating bilinearly between the four source samples
+ *             around it. Positions outside the source image give 0.
+ *
+ * @param[in]  m            The map.
+ * @param[in]  in           The source region, holding every sample needed.
+ * @param[in]  imageWidth   The width of the source image.
+ * @param[in]  imageHeight  The height of the source image.
+ * @param[in]  row          The 0-indexed output row.
+ * @param[in]  col          The 0-indexed output column.
+ *
+ * @return     The output sample.
+ */
+double RemapSample(const Remap *m, const Tile *in, int imageWidth,
+    int imageHeight, int row, int col)
+{
+    int32_t x = m->x[(size_t)row * m->width + col];
+    int32_t y = m->y[(size_t)row * m->width + col];
+    int32_t mask = (1 << REMAP_FRACTION_BITS) - 1;
+
+    // Split the fixed point coordinates into sample and fraction
+    int srcCol = x >> REMAP_FRACTION_BITS;
+    int srcRow = y >> REMAP_FRACTION_BITS;
+    if (x < 0 || y < 0 || srcCol >= imageWidth || srcRow >= imageHeight)
+        return 0;
+
+    double fx = (double)(x & mask) / (1 << REMAP_FRACTION_BITS);
+    double fy = (double)(y & mask) / (1 << REMAP_FRACTION_BITS);
+    return BilinearInterpolate(fx, fy,
+        GetTileSample(in, srcRow, srcCol),
+        GetTileSample(in, srcRow + 1, srcCol),
+        GetTileSample(in, srcRow, srcCol + 1),
+        GetTileSample(in, srcRow + 1, srcCol + 1));
+}
+
+
+/**
+ * @brief      Finds the region of the source image a remap reads to compute a
+ *             region of its output.
+ *
+ * @param[in]  m            The map.
+ * @param[in]  out          The output region.
+ * @param[in]  imageWidth   The width of the source image.
+ * @param[in]  imageHeight  The height of the source image.
+ *
+ * @return     The source region, with no pixels, and a width of 0 if the
+ *             output region lies wholly outside the source.
+ */
+Tile MapRemapRegion(const Remap *m, Tile out, int imageWidth, int imageHeight)
+{
+    int top = imageHeight;
+    int left = imageWidth;
+    int bottom = -1;
+    int right = -1;
+
+    for (int row = out.row; row < out.row + out.height; row++)
+    {
+        for (int col = out.col; col < out.col + out.width; col++)
+        {
+            int srcCol = m->x[(size_t)row * m->width + col] >> REMAP_FRACTION_BITS;
+            int srcRow = m->y[(size_t)row * m->width + col] >> REMAP_FRACTION_BITS;
+            top = srcRow < top ? srcRow : top;
+            left = srcCol < left ? srcCol : left;
+            bottom = srcRow + 1 > bottom ? srcRow + 1 : bottom;
+            right = srcCol + 1 > right ? srcCol + 1 : right;
+        }
+    }
+
+    // A region mapped wholly outside the source reads nothing
+    Tile in = { 0, 0, 0, 0, NULL };
+    if (bottom < 0 || right < 0 || top >= imageHeight || left >= imageWidth)
+        return in;
+
+    // Clip to the source
+    in.row = top < 0 ? 0 : top;
+    in.col = left < 0 ? 0 : left;
+    in.height = (bottom >= imageHeight ? imageHeight - 1 : bottom) - in.row + 1;
+    in.width = (right >= imageWidth ? imageWidth - 1 : right) - in.col + 1;
+    return in;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                  Warping                                   //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Parses a 3x3 homography, mapping input positions to output
+ *             positions, and inverts it so that each output sample can be
+ *             traced back to its source.
+ *
+ * @param      str      Nine numbers, row by row, separated by spaces, commas
+ *                      or semicolons.
+ * @param      inverse  Output for the inverse matrix, row by row.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryParseWarp(char *str, double *inverse)
+{
+    double h[9];
+    char *end = str;
+
+    // Read the nine numbers, allowing any mix of separators between them
+    for (int i = 0; i < 9; i++)
+    {
+        while (*end != '\0' && strchr(" ,;", *end))
+            end++;
+        char *start = end;
+        h[i] = strtod(start, &end);
+        if (end == start)
+        {
+            fprintf(stderr, "Error, bad warp matrix. Check README for usage:\n");
+            return false;
+        }
+    }
+    while (*end != '\0' && strchr(" ,;", *end))
+        end++;
+
+    // The inverse is the adjugate divided by the determinant
+    double det = h[0] * (h[4] * h[8] - h[5] * h[7])
+        - h[1] * (h[3] * h[8] - h[5] * h[6])
+        + h[2] * (h[3] * h[7] - h[4] * h[6]);
+    if (*end != '\0' || det == 0 || det != det)
+    {
+        fprintf(stderr, "Error, bad warp matrix. Check README for usage:\n");
+        return false;
+    }
+
+    inverse[0] = (h[4] * h[8] - h[5] * h[7]) / det;
+    inverse[1] = (h[2] * h[7] - h[1] * h[8]) / det;
+    inverse[2] = (h[1] * h[5] - h[2] * h[4]) / det;
+    inverse[3] = (h[5] * h[6] - h[3] * h[8]) / det;
+    inverse[4] = (h[0] * h[8] - h[2] * h[6]) / det;
+    inverse[5] = (h[2] * h[3] - h[0] * h[5]) / det;
+    inverse[6] = (h[3] * h[7] - h[4] * h[6]) / det;
+    inverse[7] = (h[1] * h[6] - h[0] * h[7]) / det;
+    inverse[8] = (h[0] * h[4] - h[1] * h[3]) / det;
+    return true;
+}
+
+
+/**
+ * @brief      Computes a run of output samples along a row of a warped image.
+ *             The row's contribution to the homogeneous source position is
+ *             computed once, so each sample costs three multiply-adds and one
+ *             reciprocal rather than a matrix product. Positions are not
+ *             accumulated, so a sample is the same whichever run computes it.
+ *
+ * @param      n      The warp node.
+ * @param[in]  in     The source region, holding every sample needed.
+ * @param[in]  row    The 0-indexed output row.
+ * @param[in]  col    The first 0-indexed output column.
+ * @param[in]  count  The number of samples to compute.
+ * @param      out    Output for the samples.
+ */
+void WarpRow(OpNode *n, const Tile *in, int row, int col, int count,
+    double *out)
+{
+    const double *h = n->warp;
+    double rowX = h[1] * row + h[2];
+    double rowY = h[4] * row + h[5];
+    double rowW = h[7] * row + h[8];
+    int width = n->upstream->width;
+    int height = n->upstream->height;
+
+    for (int i = 0; i < count; i++)
+    {
+        double x = rowX + h[0] * (col + i);
+        double y = rowY + h[3] * (col + i);
+        double reciprocal = 1 / (rowW + h[6] * (col + i));
+        double srcCol = x * reciprocal;
+        double srcRow = y * reciprocal;
+
+        // Positions outside the source, or at infinity, give 0
+        if (!(srcCol >= 0 && srcRow >= 0 && srcCol < width && srcRow < height))
+        {
+            out[i] = 0;
+        }
+        else
+        {
+            int r = (int)srcRow;
+            int c = (int)srcCol;
+            out[i] = BilinearInterpolate(srcCol - c, srcRow - r,
+                GetTileSample(in, r, c), GetTileSample(in, r + 1, c),
+                GetTileSample(in, r, c + 1), GetTileSample(in, r + 1, c + 1));
+        }
+    }
+}
+
+
+/**
+ * @brief      Finds the region of the source image a warp reads to compute a
+ *             region of its output. A homography maps the region to a convex
+ *             quadrilateral unless the region crosses the line at infinity, so
+ *             the bounding box of its mapped corners holds every source
+ *             position.
+ *
+ * @param      n     The warp node.
+ * @param[in]  out   The output region.
+ *
+ * @return     The source region, with no pixels, and a width of 0 if the
+ *             output region lies wholly outside the source.
+ */
+Tile MapWarpRegion(OpNode *n, Tile out)
+{
+    const double *h = n->warp;
+    int width = n->upstream->width;
+    int height = n->upstream->height;
+    double top = INFINITY;
+    double left = INFINITY;
+    double bottom = -INFINITY;
+    double right = -INFINITY;
+    int positive = 0;
+
+    // Map each corner, noting on which side of the line at infinity it lies
+    for (int i = 0; i < 4; i++)
+    {
+        int col = out.col + (i & 1 ? out.width - 1 : 0);
+        int row = out.row + (i & 2 ? out.height - 1 : 0);
+        double w = h[7] * row + h[8] + h[6] * col;
+        double x = (h[1] * row + h[2] + h[0] * col) * (1 / w);
+        double y = (h[4] * row + h[5] + h[3] * col) * (1 / w);
+
+        positive += w > 0;
+        top = y < top ? y : top;
+        left = x < left ? x : left;
+        bottom = y > bottom ? y : bottom;
+        right = x > right ? x : right;
+    }
+
+    // A region crossing the line at infinity may read the whole source
+    Tile in = { 0, 0, width, height, NULL };
+    if (positive != 0 && positive != 4)
+        return in;
+
+    // A region mapped wholly outside the source reads nothing
+    if (bottom < 0 || right < 0 || top >= height || left >= width)
+    {
+        in.width = 0;
+        in.height = 0;
+        return in;
+    }
+
+    in.row = top < 0 ? 0 : (int)top;
+    in.col = left < 0 ? 0 : (int)left;
+    in.height = (bottom + 1 >= height ? height - 1 : (int)bottom + 1) - in.row + 1;
+    in.width = (right + 1 >= width ? width - 1 : (int)right + 1) - in.col + 1;
+    return in;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                               Frame stacking                               //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Combines a stack of pnm frames into one image, e.g. to reduce
+ *             the noise of low light frames. Each input file holds one or more
+ *             frames back to back, and colour frames are stacked as grey. The
+ *             output is built in bands of rows which are combined in parallel,
+ *             each band reading one row of every frame at a time straight from
+ *             the files, so no frame is held in memory.
+ *
+ * @param      mode      How to combine the frames: mean, median, max or min.
+ * @param[in]  inCount   The number of input files.
+ * @param      inNames   The input file names.
+ * @param      outName   The output file name.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryRunStack(char *mode, int inCount, char **inNames, char *outName)
+{
+    FrameStack s = { STACK_MEAN };
+    if (!strcmp(mode, "median"))
+        s.type = STACK_MEDIAN;
+    else if (!strcmp(mode, "max"))
+        s.type = STACK_MAX;
+    else if (!strcmp(mode, "min"))
+        s.type = STACK_MIN;
+    else if (strcmp(mode, "mean"))
+    {
+        fprintf(stderr, "Error, bad stack mode \"%s\". Check README for usage:\n",
+            mode);
+        return false;
+    }
+
+    FILE **streams = calloc(inCount, sizeof(FILE *));
+    int batchSize = GetThreadCount() * 2;
+    StackBand *bands = calloc(batchSize, sizeof(StackBand));
+    double *out = NULL;
+    Raster image = { 0 };
+    PgmFile iF = { NULL, inNames[0], 0, 0, 0, P5 };
+    PgmFile oF = { NULL, outName, 0, 0, 0, UNKNOWN };
+    bool isSuccess = streams != NULL && bands != NULL;
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // Find every frame of every input file
+    for (int i = 0; i < inCount && isSuccess; i++)
+    {
+        streams[i] = fopen(inNames[i], "rb");
+        if (streams[i] == NULL)
+        {
+            fprintf(stderr, "No such file: \"%s\"\n", inNames[i]);
+            isSuccess = false;
+        }
+        else
+            isSuccess = TryIndexFrames(&s, streams[i]);
+    }
+    if (isSuccess && s.frameCount == 0)
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        isSuccess = false;
+    }
+
+    // Give each band of a batch its output rows and its frame row buffers
+    size_t frameRows = s.type == STACK_MEDIAN ? s.frameCount : 1;
+    size_t bandSamples = (size_t)STACK_BAND_ROWS * s.width;
+    if (isSuccess)
+    {
+        out = malloc(batchSize * bandSamples * sizeof(double));
+        isSuccess = out != NULL;
+        for (int i = 0; i < batchSize && isSuccess; i++)
+        {
+            bands[i].s = &s;
+            bands[i].out = out + i * bandSamples;
+            bands[i].frameRows = malloc(frameRows * s.width * sizeof(uint16_t));
+            bands[i].sums = malloc(s.width * sizeof(uint64_t));
+            bands[i].values = malloc(s.frameCount * sizeof(uint16_t));
+            isSuccess = bands[i].frameRows != NULL && bands[i].sums != NULL
+                && bands[i].values != NULL;
+        }
+        if (!isSuccess)
+            fprintf(stderr, "Error, out of memory\n");
+    }
+
+    // The output has the frames' size, and its type follows its extension
+    if (isSuccess)
+    {
+        iF.width = s.width;
+        iF.height = s.height;
+        iF.maxDataValue = s.maxDataValue;
+        SetOutputType(&iF, &oF);
+        oF.width = s.width;
+        oF.height = s.height;
+        oF.maxDataValue = s.maxDataValue;
+        oF.fStream = fopen(outName, "wb");
+
+        // A png is encoded in parallel bands, so its image is held in memory
+        if (oF.fStream == NULL)
+        {
+            fprintf(stderr, "Error, could not write output file\n");
+            isSuccess = false;
+        }
+        else if (oF.type == PNG
+            && !TryAllocateRaster(&image, s.width, s.height, SAMPLE_F64))
+        {
+            fprintf(stderr, "Error, out of memory\n");
+            isSuccess = false;
+        }
+        else if (oF.type != PNG)
+            WritePgmInfo(&oF);
+    }
+
+    // Combine a batch of bands in parallel, then write their rows in order
+    off_t outStart = isSuccess ? ftello(oF.fStream) : 0;
+    int bandCount = (s.height + STACK_BAND_ROWS - 1) / STACK_BAND_ROWS;
+    for (int first = 0; first < bandCount && isSuccess; first += batchSize)
+    {
+        int count = bandCount - first < batchSize ? bandCount - first : batchSize;
+        for (int i = 0; i < count; i++)
+        {
+            bands[i].row = (first + i) * STACK_BAND_ROWS;
+            bands[i].rowCount = s.height - bands[i].row < STACK_BAND_ROWS
+                ? s.height - bands[i].row : STACK_BAND_ROWS;
+        }
+        RunParallel(count, CombineFrameBand, bands);
+
+        for (int i = 0; i < count && isSuccess; i++)
+        {
+            if (bands[i].isFailed)
+            {
+                fprintf(stderr, "Corrupted input file\n");
+                isSuccess = false;
+                break;
+            }
+
+            // Place pfm rows from the bottom up
+            for (int j = 0; j < bands[i].rowCount; j++)
+            {
+                int row = bands[i].row + j;
+                const double *data = bands[i].out + (size_t)j * s.width;
+                if (oF.type == PNG)
+                {
+                    for (int col = 0; col < s.width; col++)
+                        SetSample(&image, row, col, data[col]);
+                    continue;
+                }
+
+                if (oF.type == PF)
+                    fseeko(oF.fStream, outStart
+                        + (off_t)(s.height - 1 - row) * s.width * 4, SEEK_SET);
+                WritePgmRow(&oF, data);
+            }
+        }
+    }
+
+    if (isSuccess && oF.type == PNG)
+    {
+        ConversionArgs cArgs = { GetData, false, false };
+        PgmConverter c = { &iF, &oF, &cArgs, NULL, image };
+        isSuccess = TryWritePngData(&c);
+    }
+
+    for (int i = 0; bands != NULL && i < batchSize; i++)
+    {
+        free(bands[i].frameRows);
+        free(bands[i].sums);
+        free(bands[i].values);
+    }
+    for (int i = 0; streams != NULL && i < inCount; i++)
+        if (streams[i] != NULL)
+            fclose(streams[i]);
+    if (s.spool != NULL)
+        fclose(s.spool);
+    if (oF.fStream != NULL)
+        fclose(oF.fStream);
+    FreeRaster(&image);
+    free(streams);
+    free(bands);
+    free(out);
+    free(s.fds);
+    free(s.offsets);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Adds each frame of a file to a frame stack, recording where its
+ *             samples start. Only the headers of P5 frames are read; their
+ *             samples are skipped over. Other pnm frames are decoded once to
+ *             the stack's spool file, so that their rows can then be read at
+ *             computed offsets like those of P5 frames.
+ *
+ * @param      s       The frame stack. Its size is set by the first frame.
+ * @param      stream  The file, holding one or more pnm frames back to back.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryIndexFrames(FrameStack *s, FILE *stream)
+{
+    PgmFile iF = { stream, NULL, 0, 0, 0, UNKNOWN };
+    PgmConverter c = { &iF, NULL, NULL, NULL, {} };
+    struct stat inStat;
+    if (fstat(fileno(stream), &inStat))
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    while (HasNextFrame(stream))
+    {
+        iF.type = UNKNOWN;
+        if (!TryReadPgmInfo(&c))
+            return false;
+
+        if (iF.type == PF)
+        {
+            fprintf(stderr, "Error, stacked frames must be pnm\n");
+            return false;
+        }
+
+        // Every frame must match the first
+        if (s->frameCount == 0)
+        {
+            s->width = iF.width;
+            s->height = iF.height;
+            s->maxDataValue = iF.maxDataValue;
+        }
+        else if (iF.width != s->width || iF.height != s->height
+            || iF.maxDataValue != s->maxDataValue)
+        {
+            fprintf(stderr, "Error, stacked frames must have the same size\n");
+            return false;
+        }
+
+        // The frame's samples must all be in the file
+        int fd = fileno(stream);
+        off_t offset = ftello(stream);
+        off_t end = offset + (off_t)iF.width * iF.height
+            * (iF.maxDataValue > 255 ? 2 : 1);
+        if (iF.type != P5)
+        {
+            if (!TrySpoolFrame(s, &iF, &offset))
+                return false;
+            fd = fileno(s->spool);
+        }
+        else if (end > inStat.st_size || fseeko(stream, end, SEEK_SET))
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            return false;
+        }
+
+        if (s->frameCount == s->capacity)
+        {
+            s->capacity = s->capacity == 0 ? 64 : s->capacity * 2;
+            int *fds = realloc(s->fds, s->capacity * sizeof(int));
+            s->fds = fds != NULL ? fds : s->fds;
+            off_t *offsets = realloc(s->offsets, s->capacity * sizeof(off_t));
+            s->offsets = offsets != NULL ? offsets : s->offsets;
+            if (fds == NULL || offsets == NULL)
+            {
+                fprintf(stderr, "Error, out of memory\n");
+                return false;
+            }
+        }
+        s->fds[s->frameCount] = fd;
+        s->offsets[s->frameCount] = offset;
+        s->frameCount++;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Decodes a pnm frame to the end of a frame stack's spool file,
+ *             which is created the first time round. Grey levels are written
+ *             as in a P5 file of the same max value.
+ *
+ * @param      s       The frame stack.
+ * @param      iF      The frame, whose header has been read.
+ * @param      offset  Output for the spool file offset of the first sample.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TrySpoolFrame(FrameStack *s, PgmFile *iF, off_t *offset)
+{
+    if (s->spool == NULL)
+        s->spool = tmpfile();
+    uint16_t *samples = malloc(iF->width * sizeof(uint16_t));
+    double *data = malloc(iF->width * sizeof(double));
+    if (s->spool == NULL || samples == NULL || data == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        free(samples);
+        free(data);
+        return false;
+    }
+
+    bool isSuccess = !fseeko(s->spool, 0, SEEK_END);
+    *offset = ftello(s->spool);
+    int sampleBytes = iF->maxDataValue > 255 ? 2 : 1;
+    for (int row = 0; row < iF->height && isSuccess; row++)
+    {
+        if (!TryReadGreyRow(iF, samples, data))
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            isSuccess = false;
+            break;
+        }
+
+        // Narrow the samples in place, front to back, as each byte written
+        // lies within a sample that has already been read
+        unsigned char *bytes = (unsigned char *)samples;
+        for (int col = 0; col < iF->width; col++)
+        {
+            uint16_t value = samples[col];
+            if (sampleBytes == 2)
+            {
+                bytes[2 * col] = value >> 8;
+                bytes[2 * col + 1] = value & 255;
+            }
+            else
+                bytes[col] = value;
+        }
+        if (fwrite(bytes, sampleBytes, iF->width, s->spool)
+            != (size_t)iF->width)
+        {
+            fprintf(stderr, "Error, could not write the spool file\n");
+            isSuccess = false;
+        }
+    }
+
+    // Rows are read back with pread, past the stream's buffer
+    if (isSuccess && fflush(s->spool))
+    {
+        fprintf(stderr, "Error, could not write the spool file\n");
+        isSuccess = false;
+    }
+    free(samples);
+    free(data);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Reads one row of a frame of a stack with pread, so that bands
+ *             share the files without seeking.
+ *
+ * @param[in]  s        The frame stack.
+ * @param[in]  frame    The index of the frame.
+ * @param[in]  row      The row to read.
+ * @param      samples  Output for the row, s->width samples.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadFrameRow(const FrameStack *s, int frame, int row,
+    uint16_t *samples)
+{
+    size_t length = (size_t)s->width * (s->maxDataValue > 255 ? 2 : 1);
+    if (pread(s->fds[frame], samples, length,
+        s->offsets[frame] + (off_t)row * length) != (ssize_t)length)
+        return false;
+    WidenSamples(samples, s->width, s->maxDataValue);
+
+    // If the value of data exceeds limits, it is corrupted
+    uint16_t high = 0;
+    for (int col = 0; col < s->width; col++)
+        high = samples[col] > high ? samples[col] : high;
+    return high <= s->maxDataValue;
+}
+
+
+/**
+ * @brief      Combines one band of rows of a frame stack. Each output row is
+ *             built from the same row of every frame, see TryReadFrameRow.
+ *             This is run as a parallel job, see RunParallel.
+ *
+ * @param      arg    The array of StackBands being combined.
+ * @param[in]  index  The index of the band to combine.
+ */
+void CombineFrameBand(void *arg, int index)
+{
+    StackBand *band = (StackBand *)arg + index;
+    const FrameStack *s = band->s;
+    int width = s->width;
+    uint64_t *sums = band->sums;
+
+    for (int j = 0; j < band->rowCount; j++)
+    {
+        double *out = band->out + (size_t)j * width;
+
+        // Start from the identity of the combination
+        uint64_t start = s->type == STACK_MIN ? s->maxDataValue : 0;
+        for (int col = 0; col < width; col++)
+            sums[col] = start;
+
+        for (int f = 0; f < s->frameCount; f++)
+        {
+            // A median needs every frame's row, the others fold each row in
+            uint16_t *data = band->frameRows
+                + (s->type == STACK_MEDIAN ? (size_t)f * width : 0);
+            if (!TryReadFrameRow(s, f, band->row + j, data))
+            {
+                band->isFailed = true;
+                return;
+            }
+
+            if (s->type == STACK_MEAN)
+                for (int col = 0; col < width; col++)
+                    sums[col] += data[col];
+            else if (s->type == STACK_MAX)
+                for (int col = 0; col < width; col++)
+                    sums[col] = data[col] > sums[col] ? data[col] : sums[col];
+            else if (s->type == STACK_MIN)
+                for (int col = 0; col < width; col++)
+                    sums[col] = data[col] < sums[col] ? data[col] : sums[col];
+        }
+
+        // A few frames are sorted a whole row at a time, leaving the median
+        // in the middle rows
+        const uint16_t *low = band->frameRows
+            + (size_t)(s->frameCount - 1) / 2 * width;
+        const uint16_t *high = band->frameRows
+            + (size_t)s->frameCount / 2 * width;
+        if (s->type == STACK_MEDIAN
+            && TrySortFrameRows(band->frameRows, s->frameCount, width))
+        {
+            for (int col = 0; col < width; col++)
+                out[col] = (low[col] + high[col]) / 2.0;
+        }
+        else if (s->type == STACK_MEDIAN)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                for (int f = 0; f < s->frameCount; f++)
+                    band->values[f] = band->frameRows[(size_t)f * width + col];
+                out[col] = GetMedian(band->values, s->frameCount);
+            }
+        }
+        else if (s->type == STACK_MEAN)
+        {
+            for (int col = 0; col < width; col++)
+                out[col] = (double)sums[col] / s->frameCount;
+        }
+        else
+        {
+            for (int col = 0; col < width; col++)
+                out[col] = sums[col];
+        }
+    }
+}
+
+
+/**
+ * @brief      Sorts each column of a few rows with a fixed sorting network.
+ *             Each comparator swaps two whole rows' columns into order with
+ *             min and max, which is branch free, so the compiler can
+ *             vectorise it across the row.
+ *
+ * @param      rows   The rows, one after another, sorted in place.
+ * @param[in]  count  The number of rows.
+ * @param[in]  width  The number of samples in each row.
+ *
+ * @return     Returns true if the rows were sorted, false if there are too
+ *             many for a network, in which case they are left as they were.
+ */
+bool TrySortFrameRows(uint16_t *rows, int count, int width)
+{
+    // The comparators of the optimal networks of 2 to 8 inputs, as pairs of
+    // row indexes, ended by -1
+    static const signed char networks[9][40] =
+    {
+        { -1 },
+        { -1 },
+        { 0, 1, -1 },
+        { 0, 2, 0, 1, 1, 2, -1 },
+        { 0, 2, 1, 3, 0, 1, 2, 3, 1, 2, -1 },
+        { 0, 3, 1, 4, 0, 2, 1, 3, 0, 1, 2, 4, 1, 2, 3, 4, 2, 3, -1 },
+        { 0, 5, 1, 3, 2, 4, 1, 2, 3, 4, 0, 3, 2, 5, 0, 1, 2, 3, 4, 5, 1, 2,
+            3, 4, -1 },
+        { 0, 6, 2, 3, 4, 5, 0, 2, 1, 4, 3, 6, 0, 1, 2, 5, 3, 4, 1, 2, 4, 6,
+            2, 3, 4, 5, 1, 2, 3, 4, 5, 6, -1 },
+        { 0, 2, 1, 3, 4, 6, 5, 7, 0, 4, 1, 5, 2, 6, 3, 7, 0, 1, 2, 3, 4, 5,
+            6, 7, 2, 4, 3, 5, 1, 4, 3, 6, 1, 2, 3, 4, 5, 6, -1 }
+    };
+    if (count > 8)
+        return false;
+
+    for (const signed char *pair = networks[count]; *pair >= 0; pair += 2)
+    {
+        uint16_t *a = rows + (size_t)pair[0] * width;
+        uint16_t *b = rows + (size_t)pair[1] * width;
+        for (int col = 0; col < width; col++)
+        {
+            uint16_t least = a[col] < b[col] ? a[col] : b[col];
+            uint16_t most = a[col] < b[col] ? b[col] : a[col];
+            a[col] = least;
+            b[col] = most;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Finds the median of the samples of a column by insertion sort,
+ *             for stacks too deep for TrySortFrameRows. An even number of
+ *             samples gives the mean of the middle two.
+ *
+ * @param      values  The samples, which are sorted in place.
+ * @param[in]  count   The number of samples, at least 1.
+ *
+ * @return     The median.
+ */
+double GetMedian(uint16_t *values, int count)
+{
+    for (int i = 1; i < count; i++)
+    {
+        uint16_t value = values[i];
+        int j = i;
+        for (; j > 0 && values[j - 1] > value; j--)
+            values[j] = values[j - 1];
+        values[j] = value;
+    }
+
+    return (values[(count - 1) / 2] + values[count / 2]) / 2.0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Frame differencing                             //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Differences consecutive pnm frames read back to back from stdin,
+ *             e.g. to detect activity in a camera stream. Colour frames are
+ *             differenced as grey, see TryReadGreyRow. Each row is
+ *             differenced against the previous frame as soon as it is decoded,
+ *             so every frame after the first is written to stdout in the pass
+ *             which reads it, and the number of changed pixels in each is
+ *             printed to stderr. Only the previous frame is held.
+ *
+ * @param      thresholdStr  The least absolute difference of a changed pixel.
+ *                           Changed pixels are max and others 0 in the output
+ *                           masks, or, if 0, the output holds the absolute
+ *                           differences and any difference is a change.
+ *
+ * @return     Returns true when every frame was differenced, false otherwise.
+ */
+bool TryRunFrameDiff(char *thresholdStr)
+{
+    int threshold = 0;
+    int length = 0;
+    if (sscanf(thresholdStr, "%i%n", &threshold, &length) != 1
+        || thresholdStr[length] != '\0' || threshold < 0)
+    {
+        fprintf(stderr, "Error, bad threshold \"%s\". Check README for usage:\n",
+            thresholdStr);
+        return false;
+    }
+
+    PgmFile iF = { stdin, "stdin", 0, 0, 0, UNKNOWN };
+    PgmFile oF = { stdout, "stdout", 0, 0, 0, UNKNOWN };
+    ConversionArgs cArgs = { GetData, false, false };
+    PgmConverter c = { &iF, &oF, &cArgs, NULL, {} };
+    uint16_t *previous = NULL;
+    uint16_t *current = NULL;
+    double *out = NULL;
+    size_t frames = 0;
+    bool isSuccess = true;
+
+    while (isSuccess && HasNextFrame(stdin))
+    {
+        // Parse the frame's header, which may differ from the last frame's
+        int width = iF.width;
+        int height = iF.height;
+        int maxDataValue = iF.maxDataValue;
+        iF.type = UNKNOWN;
+        if (!TryReadPgmInfo(&c))
+        {
+            isSuccess = false;
+            break;
+        }
+        if (iF.type == PF)
+        {
+            fprintf(stderr, "Error, differenced frames must be pnm\n");
+            isSuccess = false;
+            break;
+        }
+
+        // A frame of a new size starts the differencing again
+        bool isFirst = frames == 0 || iF.width != width
+            || iF.height != height || iF.maxDataValue != maxDataValue;
+        if (isFirst)
+        {
+            free(previous);
+            free(current);
+            free(out);
+            previous = malloc((size_t)iF.width * iF.height * sizeof(uint16_t));
+            current = malloc(iF.width * sizeof(uint16_t));
+            out = malloc(iF.width * sizeof(double));
+            if (previous == NULL || current == NULL || out == NULL)
+            {
+                fprintf(stderr, "Error, out of memory\n");
+                isSuccess = false;
+                break;
+            }
+        }
+        else
+        {
+            oF.type = IsPlainPnm(iF.type) ? P2 : P5;
+            oF.width = iF.width;
+            oF.height = iF.height;
+            oF.maxDataValue = iF.maxDataValue;
+            WritePgmInfo(&oF);
+        }
+
+        // Difference each row as it is read, keeping it for the next frame
+        long long changed = 0;
+        for (int row = 0; row < iF.height && isSuccess; row++)
+        {
+            uint16_t *previousRow = previous + (size_t)row * iF.width;
+            if (!TryReadGreyRow(&iF, isFirst ? previousRow : current, out))
+            {
+                fprintf(stderr, "Corrupted input file\n");
+                isSuccess = false;
+            }
+            else if (!isFirst)
+            {
+                changed += DiffFrameRow(previousRow, current, iF.width,
+                    threshold, iF.maxDataValue, out);
+                WritePgmRow(&oF, out);
+            }
+        }
+        frames++;
+
+        // Send the frame on at once and report its activity
+        if (isSuccess && !isFirst)
+        {
+            fflush(stdout);
+            fprintf(stderr, "frame %zu: %lld changed\n", frames, changed);
+        }
+    }
+
+    free(previous);
+    free(current);
+    free(out);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Reads the next row of a P2 or P5 file as integer samples. P5
+ *             rows are read in a single call rather than a sample at a time.
+ *
+ * @param      iF       The input file information.
+ * @param      samples  Output for the row, iF->width samples.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadSampleRow(PgmFile *iF, uint16_t *samples)
+{
+    int width = iF->width;
+    uint16_t high = 0;
+
+    if (iF->type == P5)
+    {
+        int sampleBytes = iF->maxDataValue > 255 ? 2 : 1;
+        if (fread(samples, sampleBytes, width, iF->fStream) != (size_t)width)
+            return false;
+        WidenSamples(samples, width, iF->maxDataValue);
+    }
+    else
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int value = 0;
+            if (fscanf(iF->fStream, "%i", &value) != 1 || value < 0
+                || value > 65535)
+                return false;
+            samples[col] = value;
+        }
+    }
+
+    // If the value of data exceeds limits, it is corrupted
+    for (int col = 0; col < width; col++)
+        high = samples[col] > high ? samples[col] : high;
+    return high <= iF->maxDataValue;
+}
+
+
+/**
+ * @brief      Reads the next row of any pnm file as integer grey levels. P2
+ *             and P5 rows are read by TryReadSampleRow; other types are
+ *             decoded by TryReadPgmRow, whose grey levels are whole numbers.
+ *
+ * @param      iF       The input file information, not of a pfm.
+ * @param      samples  Output for the row, iF->width samples.
+ * @param      data     Room to decode the row, iF->width samples.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadGreyRow(PgmFile *iF, uint16_t *samples, double *data)
+{
+    if (iF->type == P2 || iF->type == P5)
+        return TryReadSampleRow(iF, samples);
+
+    if (!TryReadPgmRow(iF, data))
+        return false;
+    for (int col = 0; col < iF->width; col++)
+        samples[col] = data[col];
+    return true;
+}
+
+
+/**
+ * @brief      Widens a row of raw P5 samples, read into the front of the row,
+ *             to one integer sample each.
+ *
+ * @param      samples       The row, width samples once widened.
+ * @param[in]  width         The number of samples in the row.
+ * @param[in]  maxDataValue  The maximum value of the data, which sets whether
+ *                           samples are one byte or two.
+ */
+void WidenSamples(uint16_t *samples, int width, int maxDataValue)
+{
+    unsigned char *bytes = (unsigned char *)samples;
+    if (maxDataValue > 255)
+    {
+        // Assemble the two byte samples, most significant first, in place
+        for (int col = 0; col < width; col++)
+            samples[col] = bytes[2 * col] << 8 | bytes[2 * col + 1];
+    }
+    else
+    {
+        // Widen from the back so that no sample is overwritten before it is
+        // widened
+        for (int col = width - 1; col >= 0; col--)
+            samples[col] = bytes[col];
+    }
+}
+
+
+/**
+ * @brief      Differences a row of a frame against the same row of the
+ *             previous frame, which is then replaced by the new row. The loop
+ *             is branch free so that the compiler can vectorise it.
+ *
+ * @param      previous      The previous frame's row, overwritten by current.
+ * @param[in]  current       The frame's row.
+ * @param[in]  width         The number of samples in the row.
+ * @param[in]  threshold     The least absolute difference of a changed pixel,
+ *                           or 0 to output the differences themselves.
+ * @param[in]  maxDataValue  The value of a changed pixel in a mask.
+ * @param      out           Output for the row of the mask or differences.
+ *
+ * @return     The number of changed pixels in the row.
+ */
+long long DiffFrameRow(uint16_t *previous, const uint16_t *current, int width,
+    int threshold, int maxDataValue, double *out)
+{
+    int least = threshold > 0 ? threshold : 1;
+    long long changed = 0;
+
+    for (int col = 0; col < width; col++)
+    {
+        int difference = abs(current[col] - previous[col]);
+        int isChanged = difference >= least;
+        changed += isChanged;
+        out[col] = threshold > 0 ? isChanged * maxDataValue : difference;
+        previous[col] = current[col];
+    }
+
+    return changed;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Template matching                              //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Finds the positions at which a template best matches an image,
+ *             e.g. to locate fiducial marks in a scan, printing the column,
+ *             row and score of each to stdout, best first. Scores are the
+ *             normalized cross-correlation, from -1 to 1. The window sums of
+ *             each position's denominator come from integral images, and the
+ *             numerators are computed in tiles of positions, in parallel.
+ *             Matches are peaks of the scores, and a match overlapping a
+ *             better match is not reported.
+ *
+ * @param      templateName  The template file name.
+ * @param      inName        The image file name.
+ * @param      countStr      The most matches to report.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryRunMatch(char *templateName, char *inName, char *countStr)
+{
+    int count = 0;
+    int length = 0;
+    if (sscanf(countStr, "%i%n", &count, &length) != 1
+        || countStr[length] != '\0' || count < 1)
+    {
+        fprintf(stderr, "Error, bad match count \"%s\". Check README for usage:\n",
+            countStr);
+        return false;
+    }
+
+    PgmFile tF = { NULL, templateName, 0, 0, 0, UNKNOWN };
+    PgmFile iF = { NULL, inName, 0, 0, 0, UNKNOWN };
+    TemplateMatch m = { 0 };
+    MatchCandidate *candidates = NULL;
+    if (!TryLoadImage(&tF, &m.tmpl) || !TryLoadImage(&iF, &m.image))
+    {
+        free(m.tmpl);
+        return false;
+    }
+    if (tF.width > iF.width || tF.height > iF.height)
+    {
+        fprintf(stderr, "Error, the template is larger than the image\n");
+        free(m.tmpl);
+        free(m.image);
+        return false;
+    }
+
+    m.width = iF.width;
+    m.height = iF.height;
+    m.tWidth = tF.width;
+    m.tHeight = tF.height;
+    m.outWidth = m.width - m.tWidth + 1;
+    m.outHeight = m.height - m.tHeight + 1;
+    m.tileCols = (m.outWidth + TILE_SIZE - 1) / TILE_SIZE;
+    size_t stride = (size_t)m.width + 1;
+    m.sums = calloc(stride * (m.height + 1), sizeof(double));
+    m.squares = calloc(stride * (m.height + 1), sizeof(double));
+    m.scores = malloc((size_t)m.outWidth * m.outHeight * sizeof(float));
+    candidates = malloc((size_t)m.outWidth * m.outHeight
+        * sizeof(MatchCandidate));
+    bool isSuccess = m.sums != NULL && m.squares != NULL && m.scores != NULL
+        && candidates != NULL;
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    if (isSuccess)
+    {
+        // Subtract the template's mean, so its correlation with a window
+        // needs no window mean
+        size_t tCount = (size_t)m.tWidth * m.tHeight;
+        double mean = 0;
+        for (size_t i = 0; i < tCount; i++)
+            mean += m.tmpl[i];
+        mean /= tCount;
+        for (size_t i = 0; i < tCount; i++)
+        {
+            m.tmpl[i] -= mean;
+            m.tNorm += m.tmpl[i] * m.tmpl[i];
+        }
+
+        // Each integral image entry holds the sum of the samples above and to
+        // the left of it
+        for (int row = 0; row < m.height; row++)
+        {
+            double rowSum = 0;
+            double rowSquares = 0;
+            for (int col = 0; col < m.width; col++)
+            {
+                double value = m.image[(size_t)row * m.width + col];
+                rowSum += value;
+                rowSquares += value * value;
+                m.sums[(row + 1) * stride + col + 1]
+                    = m.sums[row * stride + col + 1] + rowSum;
+                m.squares[(row + 1) * stride + col + 1]
+                    = m.squares[row * stride + col + 1] + rowSquares;
+            }
+        }
+
+        int tileRows = (m.outHeight + TILE_SIZE - 1) / TILE_SIZE;
+        RunParallel(tileRows * m.tileCols, MatchTile, &m);
+
+        // Matches are positions scoring at least as well as their neighbours
+        size_t candidateCount = 0;
+        for (int row = 0; row < m.outHeight; row++)
+        {
+            for (int col = 0; col < m.outWidth; col++)
+            {
+                float score = m.scores[(size_t)row * m.outWidth + col];
+                bool isPeak = true;
+                for (int dr = -1; dr <= 1 && isPeak; dr++)
+                    for (int dc = -1; dc <= 1 && isPeak; dc++)
+                        isPeak = row + dr < 0 || row + dr >= m.outHeight
+                            || col + dc < 0 || col + dc >= m.outWidth
+                            || m.scores[(size_t)(row + dr) * m.outWidth
+                                + col + dc] <= score;
+                if (isPeak)
+                {
+                    MatchCandidate candidate = { row, col, score };
+                    candidates[candidateCount++] = candidate;
+                }
+            }
+        }
+
+        // Report the best peaks, skipping any overlapping a reported match
+        qsort(candidates, candidateCount, sizeof(MatchCandidate),
+            CompareCandidates);
+        int reported = 0;
+        for (size_t i = 0; i < candidateCount && reported < count; i++)
+        {
+            bool isOverlap = false;
+            for (int j = 0; j < reported && !isOverlap; j++)
+                isOverlap = abs(candidates[i].row - candidates[j].row) < m.tHeight
+                    && abs(candidates[i].col - candidates[j].col) < m.tWidth;
+            if (isOverlap)
+                continue;
+
+            // Keep the reported matches at the front of the candidates
+            candidates[reported++] = candidates[i];
+            printf("%i %i %.6f\n", candidates[i].col, candidates[i].row,
+                candidates[i].score);
+        }
+    }
+
+    free(m.image);
+    free(m.tmpl);
+    free(m.sums);
+    free(m.squares);
+    free(m.scores);
+    free(candidates);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Reads a whole pgm or pfm image as doubles.
+ *
+ * @param      f        The file information, with the file name set.
+ * @param      samples  Output for the samples, row by row, to be freed by the
+ *                      caller.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryLoadImage(PgmFile *f, double **samples)
+{
+    PgmConverter c = { f, NULL, NULL, NULL, {} };
+    f->fStream = fopen(f->fName, "rb");
+    if (f->fStream == NULL)
+    {
+        fprintf(stderr, "No such file: \"%s\"\n", f->fName);
+        return false;
+    }
+
+    bool isSuccess = TryReadPgmInfo(&c) && TryReadPgmData(&c);
+    fclose(f->fStream);
+    *samples = isSuccess
+        ? malloc((size_t)f->width * f->height * sizeof(double)) : NULL;
+    if (isSuccess && *samples == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        isSuccess = false;
+    }
+
+    for (int row = 0; row < f->height && isSuccess; row++)
+        for (int col = 0; col < f->width; col++)
+            (*samples)[(size_t)row * f->width + col] = GetSample(&c.data, row, col);
+
+    FreeRaster(&c.data);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Scores a tile of positions of a template match. The numerators
+ *             are built up one template sample at a time, each adding a run
+ *             of image samples scaled by the template sample to each row of
+ *             the tile. This is run as a parallel job, see RunParallel.
+ *
+ * @param      arg    The TemplateMatch.
+ * @param[in]  index  The index of the tile, row by row.
+ */
+void MatchTile(void *arg, int index)
+{
+    TemplateMatch *m = arg;
+    int top = index / m->tileCols * TILE_SIZE;
+    int left = index % m->tileCols * TILE_SIZE;
+    int rows = m->outHeight - top < TILE_SIZE ? m->outHeight - top : TILE_SIZE;
+    int cols = m->outWidth - left < TILE_SIZE ? m->outWidth - left : TILE_SIZE;
+    double numerators[TILE_SIZE * TILE_SIZE] = { 0 };
+
+    for (int ty = 0; ty < m->tHeight; ty++)
+    {
+        for (int row = 0; row < rows; row++)
+        {
+            const double *image = m->image
+                + (size_t)(top + row + ty) * m->width + left;
+            const double *tmpl = m->tmpl + (size_t)ty * m->tWidth;
+            double *numerator = numerators + row * TILE_SIZE;
+            for (int tx = 0; tx < m->tWidth; tx++)
+                for (int col = 0; col < cols; col++)
+                    numerator[col] += tmpl[tx] * image[col + tx];
+        }
+    }
+
+    // Divide by the deviations of the template and each window, scoring flat
+    // windows 0
+    size_t stride = (size_t)m->width + 1;
+    double count = (double)m->tWidth * m->tHeight;
+    for (int row = 0; row < rows; row++)
+    {
+        size_t upper = (size_t)(top + row) * stride + left;
+        size_t lower = upper + m->tHeight * stride;
+        for (int col = 0; col < cols; col++)
+        {
+            size_t right = col + m->tWidth;
+            double sum = m->sums[lower + right] - m->sums[lower + col]
+                - m->sums[upper + right] + m->sums[upper + col];
+            double squares = m->squares[lower + right] - m->squares[lower + col]
+                - m->squares[upper + right] + m->squares[upper + col];
+            double variance = squares - sum * sum / count;
+            double score = variance <= squares * 1e-12 || m->tNorm == 0 ? 0
+                : numerators[row * TILE_SIZE + col] / sqrt(variance * m->tNorm);
+            score = score > 1 ? 1 : score < -1 ? -1 : score;
+            m->scores[(size_t)(top + row) * m->outWidth + left + col] = score;
+        }
+    }
+}
+
+
+/**
+ * @brief      Orders match candidates by descending score, then by position,
+ *             for qsort.
+ *
+ * @param[in]  a     The first MatchCandidate.
+ * @param[in]  b     The second MatchCandidate.
+ *
+ * @return     A negative, zero or positive value as a comes before, with or
+ *             after b.
+ */
+int CompareCandidates(const void *a, const void *b)
+{
+    const MatchCandidate *x = a;
+    const MatchCandidate *y = b;
+    if (x->score != y->score)
+        return x->score < y->score ? 1 : -1;
+    if (x->row != y->row)
+        return x->row - y->row;
+    return x->col - y->col;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                            Connected components                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Labels the 8-connected components of the foreground of a binary
+ *             image, i.e. samples above 0, writing an image in which each
+ *             component's samples hold its label, from 1 in raster order, and
+ *             printing each component's area and bounding box to stdout. The
+ *             image is split into stripes of rows whose runs of foreground
+ *             are found and joined by union-find in parallel. Components
+ *             crossing the stripes' boundaries are then joined, and the runs
+ *             given their final labels, in a single pass over the runs.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryLabelComponents(PgmConverter *c)
+{
+    // Try and open the io files and parse the pgm data, reporting failure
+    if (!TryOpenStreams(c) || !TryReadPgmInfo(c) || !TryReadPgmData(c))
+    {
+        FreeRaster(&c->data);
+        if (c->iF->fStream != NULL)
+            CloseStreams(c);
+        return false;
+    }
+
+    int height = c->iF->height;
+    int stripeCount = (height + LABEL_STRIPE_ROWS - 1) / LABEL_STRIPE_ROWS;
+    LabelStripe *stripes = calloc(stripeCount, sizeof(LabelStripe));
+    LabelRun *runs = NULL;
+    int *parent = NULL;
+    int *labels = NULL;
+    long long *stats = NULL;
+    Raster image = c->data;
+    bool isSuccess = stripes != NULL;
+
+    // Find and join the runs of each stripe
+    for (int i = 0; i < stripeCount && isSuccess; i++)
+    {
+        stripes[i].image = &image;
+        stripes[i].row = i * LABEL_STRIPE_ROWS;
+        stripes[i].rowCount = height - stripes[i].row < LABEL_STRIPE_ROWS
+            ? height - stripes[i].row : LABEL_STRIPE_ROWS;
+    }
+    if (isSuccess)
+        RunParallel(stripeCount, LabelStripeRuns, stripes);
+
+    // Gather the runs, offsetting each stripe's parents to image indices
+    int runCount = 0;
+    for (int i = 0; i < stripeCount && isSuccess; i++)
+    {
+        isSuccess = !stripes[i].isFailed;
+        stripes[i].offset = runCount;
+        runCount += stripes[i].runCount;
+    }
+    if (isSuccess)
+    {
+        runs = malloc((runCount + 1) * sizeof(LabelRun));
+        parent = malloc((runCount + 1) * sizeof(int));
+        labels = malloc((runCount + 1) * sizeof(int));
+        isSuccess = runs != NULL && parent != NULL && labels != NULL;
+    }
+    for (int i = 0; i < stripeCount && isSuccess; i++)
+    {
+        LabelStripe *stripe = &stripes[i];
+        memcpy(runs + stripe->offset, stripe->runs,
+            stripe->runCount * sizeof(LabelRun));
+        for (int run = 0; run < stripe->runCount; run++)
+            parent[stripe->offset + run] = stripe->offset + stripe->parent[run];
+    }
+
+    // Join the runs either side of each boundary between stripes
+    for (int i = 1; i < stripeCount && isSuccess; i++)
+    {
+        LabelStripe *above = &stripes[i - 1];
+        LabelStripe *below = &stripes[i];
+        JoinRuns(runs, parent,
+            above->offset + above->rowStarts[above->rowCount - 1],
+            below->offset, below->offset + below->rowStarts[1]);
+    }
+
+    // Label each root in raster order. Roots are the first run of their
+    // component, so every other run's root is labelled before it.
+    int labelCount = 0;
+    for (int run = 0; run < runCount && isSuccess; run++)
+    {
+        int root = FindRoot(parent, run);
+        labels[run] = root == run ? ++labelCount : labels[root];
+    }
+
+    // Each component's area, then the left, top, right and bottom of its box
+    if (isSuccess)
+    {
+        stats = malloc(((size_t)labelCount + 1) * 5 * sizeof(long long));
+        isSuccess = stats != NULL;
+    }
+    for (int run = 0; run < runCount && isSuccess; run++)
+    {
+        long long *stat = stats + (size_t)labels[run] * 5;
+        bool isFirst = parent[run] == run;
+        stat[0] = (isFirst ? 0 : stat[0]) + runs[run].end - runs[run].start;
+        stat[1] = isFirst || runs[run].start < stat[1] ? runs[run].start : stat[1];
+        stat[2] = isFirst ? runs[run].row : stat[2];
+        stat[3] = isFirst || runs[run].end - 1 > stat[3]
+            ? runs[run].end - 1 : stat[3];
+        stat[4] = runs[run].row;
+    }
+
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // The labels replace the input, as 16 bit samples where they fit
+    FreeRaster(&c->data);
+    SetOutputType(c->iF, c->oF);
+    if (isSuccess && labelCount > 65535 && c->oF->type != PF)
+    {
+        fprintf(stderr, "Error, %i components do not fit in a pgm, "
+            "use a .pfm output\n", labelCount);
+        isSuccess = false;
+    }
+    else if (isSuccess && !TryAllocateRaster(&c->data, c->iF->width, height,
+        labelCount > 65535 ? SAMPLE_F32 : SAMPLE_U16))
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        isSuccess = false;
+    }
+    for (int run = 0; run < runCount && isSuccess; run++)
+        for (int col = runs[run].start; col < runs[run].end; col++)
+            SetSample(&c->data, runs[run].row, col, labels[run]);
+
+    // Write the label image and the statistics of each component
+    if (isSuccess)
+    {
+        c->oF->width = c->iF->width;
+        c->oF->height = height;
+        c->oF->maxDataValue = labelCount > 0 ? labelCount : 1;
+        isSuccess = TryWriteImage(c);
+
+        printf("%i components\n", labelCount);
+        for (int label = 1; label <= labelCount; label++)
+        {
+            long long *stat = stats + (size_t)label * 5;
+            printf("%i %lli %lli %lli %lli %lli\n", label, stat[0], stat[1],
+                stat[2], stat[3] - stat[1] + 1, stat[4] - stat[2] + 1);
+        }
+    }
+
+    for (int i = 0; stripes != NULL && i < stripeCount; i++)
+    {
+        free(stripes[i].runs);
+        free(stripes[i].rowStarts);
+        free(stripes[i].parent);
+    }
+    free(stripes);
+    free(runs);
+    free(parent);
+    free(labels);
+    free(stats);
+    FreeRaster(&c->data);
+    CloseStreams(c);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Finds the runs of foreground in a stripe of an image and joins
+ *             the runs of each row to the runs they touch in the row above.
+ *             This is run as a parallel job, see RunParallel.
+ *
+ * @param      arg    The array of LabelStripes being labelled.
+ * @param[in]  index  The index of the stripe to label.
+ */
+void LabelStripeRuns(void *arg, int index)
+{
+    LabelStripe *stripe = (LabelStripe *)arg + index;
+    const Raster *image = stripe->image;
+    stripe->rowStarts = malloc((stripe->rowCount + 1) * sizeof(int));
+    if (stripe->rowStarts == NULL)
+    {
+        stripe->isFailed = true;
+        return;
+    }
+
+    for (int i = 0; i < stripe->rowCount; i++)
+    {
+        int row = stripe->row + i;
+        stripe->rowStarts[i] = stripe->runCount;
+
+        for (int col = 0; col < image->width; col++)
+        {
+            if (GetSample(image, row, col) <= 0)
+                continue;
+
+            // Grow the runs as needed, keeping room for the parents
+            if (stripe->runCount == stripe->capacity)
+            {
+                stripe->capacity = stripe->capacity == 0 ? 256
+                    : stripe->capacity * 2;
+                LabelRun *runs = realloc(stripe->runs,
+                    stripe->capacity * sizeof(LabelRun));
+                stripe->runs = runs != NULL ? runs : stripe->runs;
+                if (runs == NULL)
+                {
+                    stripe->isFailed = true;
+                    return;
+                }
+            }
+
+            // Extend the run to the end of the foreground
+            LabelRun run = { row, col, col + 1 };
+            while (run.end < image->width && GetSample(image, row, run.end) > 0)
+                run.end++;
+            stripe->runs[stripe->runCount++] = run;
+            col = run.end;
+        }
+    }
+    stripe->rowStarts[stripe->rowCount] = stripe->runCount;
+
+    // Each run starts as its own component, then joins those above it
+    stripe->parent = malloc((stripe->runCount + 1) * sizeof(int));
+    if (stripe->parent == NULL)
+    {
+        stripe->isFailed = true;
+        return;
+    }
+    for (int run = 0; run < stripe->runCount; run++)
+        stripe->parent[run] = run;
+    for (int i = 1; i < stripe->rowCount; i++)
+        JoinRuns(stripe->runs, stripe->parent, stripe->rowStarts[i - 1],
+            stripe->rowStarts[i], stripe->rowStarts[i + 1]);
+}
+
+
+/**
+ * @brief      Joins the components of the runs of one row with those of the
+ *             runs of the row above which they touch, including diagonally.
+ *             Each component's root is kept at its earliest run.
+ *
+ * @param      runs      The runs, row by row from the left.
+ * @param      parent    The union-find parent of each run.
+ * @param[in]  above     The index of the first run of the row above, whose
+ *                       runs end where the row's runs start.
+ * @param[in]  below     The index of the first run of the row.
+ * @param[in]  belowEnd  The index after the last run of the row.
+ */
+void JoinRuns(const LabelRun *runs, int *parent, int above, int below,
+    int belowEnd)
+{
+    int aboveEnd = below;
+
+    // Walk both rows from the left, advancing whichever run ends first
+    while (above < aboveEnd && below < belowEnd)
+    {
+        if (runs[above].start <= runs[below].end
+            && runs[below].start <= runs[above].end)
+        {
+            int a = FindRoot(parent, above);
+            int b = FindRoot(parent, below);
+            if (a < b)
+                parent[b] = a;
+            else
+                parent[a] = b;
+        }
+
+        if (runs[above].end < runs[below].end)
+            above++;
+        else
+            below++;
+    }
+}
+
+
+/**
+ * @brief      Finds the root of a run's component, halving the path to it so
+ *             that later searches are shorter.
+ *
+ * @param      parent  The union-find parent of each run.
+ * @param[in]  run     The run.
+ *
+ * @return     The index of the root run.
+ */
+int FindRoot(int *parent, int run)
+{
+    while (parent[run] != run)
+    {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+
+    return run;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Distance transform                             //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Replaces each sample of a binary image by its exact Euclidean
+ *             distance to the nearest background sample, i.e. sample of 0,
+ *             by the separable transform of Felzenszwalb and Huttenlocher. A
+ *             pass down the columns finds each sample's distance to the
+ *             nearest background in its column, then a pass along the rows
+ *             finds the lower envelope of the parabolas those distances
+ *             describe. Each pass runs in parallel bands. Integer outputs
+ *             round the distances to 16 bit samples, pfm outputs keep them.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryDistanceTransform(PgmConverter *c)
+{
+    // Try and open the io files and parse the pgm data, reporting failure
+    if (!TryOpenStreams(c) || !TryReadPgmInfo(c) || !TryReadPgmData(c))
+    {
+        FreeRaster(&c->data);
+        if (c->iF->fStream != NULL)
+            CloseStreams(c);
+        return false;
+    }
+
+    int width = c->iF->width;
+    int height = c->iF->height;
+    size_t count = (size_t)width * height;
+    int rowBands = (height + DISTANCE_BAND_SIZE - 1) / DISTANCE_BAND_SIZE;
+    int colBands = (width + DISTANCE_BAND_SIZE - 1) / DISTANCE_BAND_SIZE;
+    Raster image = c->data;
+    DistanceMap m = { &image, width, height };
+    m.squares = malloc(count * sizeof(double));
+    m.hull = malloc((size_t)rowBands * width * sizeof(int));
+    m.bounds = malloc((size_t)rowBands * (width + 1) * sizeof(double));
+    m.row = malloc((size_t)rowBands * width * sizeof(double));
+    bool isSuccess = m.squares != NULL && m.hull != NULL && m.bounds != NULL
+        && m.row != NULL;
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // Every distance is to some background sample, so there must be one
+    bool hasBackground = false;
+    for (int row = 0; row < height && isSuccess && !hasBackground; row++)
+        for (int col = 0; col < width && !hasBackground; col++)
+            hasBackground = GetSample(&image, row, col) <= 0;
+    if (isSuccess && !hasBackground)
+    {
+        fprintf(stderr, "Error, the image has no background (0) samples\n");
+        isSuccess = false;
+    }
+
+    if (isSuccess)
+    {
+        RunParallel(colBands, DistanceColumns, &m);
+        RunParallel(rowBands, DistanceRows, &m);
+    }
+
+    // Integer outputs hold the distances rounded to 16 bit samples, with the
+    // largest distance as the max value
+    FreeRaster(&c->data);
+    SetOutputType(c->iF, c->oF);
+    bool isFloat = c->oF->type == PF;
+    if (isSuccess && !TryAllocateRaster(&c->data, width, height,
+        isFloat ? SAMPLE_F32 : SAMPLE_U16))
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        isSuccess = false;
+    }
+
+    double max = 1;
+    for (int row = 0; row < height && isSuccess; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            double distance = sqrt(m.squares[(size_t)row * width + col]);
+            distance = isFloat ? distance : floor(distance + 0.5);
+            distance = distance > 65535 && !isFloat ? 65535 : distance;
+            max = distance > max ? distance : max;
+            SetSample(&c->data, row, col, distance);
+        }
+    }
+
+    // Write the distances, encoding them as a png if required
+    if (isSuccess)
+    {
+        c->oF->width = width;
+        c->oF->height = height;
+        c->oF->maxDataValue = (int)ceil(max > 65535 ? 65535 : max);
+        isSuccess = TryWriteImage(c);
+    }
+
+    free(m.squares);
+    free(m.hull);
+    free(m.bounds);
+    free(m.row);
+    FreeRaster(&c->data);
+    CloseStreams(c);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Finds each sample's distance to the nearest background in its
+ *             column, for a band of columns, by a sweep down and a sweep up
+ *             along rows. This is run as a parallel job, see RunParallel.
+ *
+ * @param      arg    The DistanceMap.
+ * @param[in]  index  The index of the band of columns.
+ */
+void DistanceColumns(void *arg, int index)
+{
+    DistanceMap *m = arg;
+    int left = index * DISTANCE_BAND_SIZE;
+    int right = m->width - left < DISTANCE_BAND_SIZE
+        ? m->width : left + DISTANCE_BAND_SIZE;
+
+    // Down: background is 0, others are one further than the sample above
+    for (int row = 0; row < m->height; row++)
+    {
+        double *squares = m->squares + (size_t)row * m->width;
+        for (int col = left; col < right; col++)
+        {
+            double distance = row == 0 ? DISTANCE_INFINITY
+                : squares[col - m->width] + 1;
+            squares[col] = GetSample(m->image, row, col) <= 0 ? 0 : distance;
+        }
+    }
+
+    // Up: take the nearer of the background above and below, then square
+    for (int row = m->height - 2; row >= 0; row--)
+    {
+        double *squares = m->squares + (size_t)row * m->width;
+        for (int col = left; col < right; col++)
+        {
+            double below = squares[col + m->width] + 1;
+            squares[col] = below < squares[col] ? below : squares[col];
+        }
+    }
+    for (int row = 0; row < m->height; row++)
+    {
+        double *squares = m->squares + (size_t)row * m->width;
+        for (int col = left; col < right; col++)
+            squares[col] = squares[col] >= DISTANCE_INFINITY
+                ? DISTANCE_INFINITY : squares[col] * squares[col];
+    }
+}
+
+
+/**
+ * @brief      Transforms a band of rows of column distances into squared
+ *             Euclidean distances. Each sample's squared column distance is
+ *             the height of a parabola centred on it, and the lower envelope
+ *             of the row's parabolas, found in one sweep, gives the squared
+ *             distance of every sample. This is run as a parallel job, see
+ *             RunParallel.
+ *
+ * @param      arg    The DistanceMap.
+ * @param[in]  index  The index of the band of rows.
+ */
+void DistanceRows(void *arg, int index)
+{
+    DistanceMap *m = arg;
+    int width = m->width;
+    int top = index * DISTANCE_BAND_SIZE;
+    int bottom = m->height - top < DISTANCE_BAND_SIZE
+        ? m->height : top + DISTANCE_BAND_SIZE;
+    int *hull = m->hull + (size_t)index * width;
+    double *bounds = m->bounds + (size_t)index * (width + 1);
+    double *out = m->row + (size_t)index * width;
+
+    for (int row = top; row < bottom; row++)
+    {
+        double *f = m->squares + (size_t)row * width;
+
+        // Add each column's parabola to the envelope, first removing the
+        // parabolas it lies below from where they start. Intersections always
+        // lie after bounds[0], so the first parabola is never removed.
+        int k = 0;
+        hull[0] = 0;
+        bounds[0] = -DISTANCE_INFINITY;
+        bounds[1] = DISTANCE_INFINITY;
+        for (int q = 1; q < width; q++)
+        {
+            double start = 0;
+            for (;;)
+            {
+                int v = hull[k];
+                start = ((f[q] + (double)q * q) - (f[v] + (double)v * v))
+                    / (2.0 * (q - v));
+                if (start > bounds[k])
+                    break;
+                k--;
+            }
+
+            k++;
+            hull[k] = q;
+            bounds[k] = start;
+            bounds[k + 1] = DISTANCE_INFINITY;
+        }
+
+        // Read each sample's squared distance off the envelope
+        k = 0;
+        for (int q = 0; q < width; q++)
+        {
+            while (bounds[k + 1] < q)
+                k++;
+            double dx = q - hull[k];
+            out[q] = dx * dx + f[hull[k]];
+        }
+        memcpy(f, out, width * sizeof(double));
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                 Dithering                                  //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Reduces an image to a few bits per sample by dithering, e.g. for
+ *             e-ink displays. The output's max value is 2^bits - 1. Ordered
+ *             dithering compares each sample with a tiled threshold matrix,
+ *             in parallel bands of rows. Floyd-Steinberg diffuses each
+ *             sample's rounding error to its unvisited neighbours; rows are
+ *             run in parallel as a wavefront, each row kept a little behind
+ *             the row above so the error it receives is complete.
+ *
+ * @param      c        A PgmConverter detailing conversion state information.
+ * @param      mode     The method of dithering, "fs" or "bayer".
+ * @param      bitsStr  The number of bits per output sample, 1 to 8.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryDitherPgm(PgmConverter *c, char *mode, char *bitsStr)
+{
+    Ditherer d = { DITHER_FS };
+    int bits = 0;
+    int length = 0;
+    if (!strcmp(mode, "bayer"))
+        d.type = DITHER_BAYER;
+    else if (strcmp(mode, "fs"))
+    {
+        fprintf(stderr, "Error, bad dither mode \"%s\". Check README for usage:\n",
+            mode);
+        return false;
+    }
+    if (sscanf(bitsStr, "%i%n", &bits, &length) != 1 || bitsStr[length] != '\0'
+        || bits < 1 || bits > 8)
+    {
+        fprintf(stderr, "Error, bad bit depth \"%s\". Check README for usage:\n",
+            bitsStr);
+        return false;
+    }
+
+    // Try and open the io files and parse the pgm data, reporting failure
+    if (!TryOpenStreams(c) || !TryReadPgmInfo(c) || !TryReadPgmData(c))
+    {
+        FreeRaster(&c->data);
+        if (c->iF->fStream != NULL)
+            CloseStreams(c);
+        return false;
+    }
+
+    d.width = c->iF->width;
+    d.height = c->iF->height;
+    d.levels = 1 << bits;
+    d.values = malloc((size_t)d.width * d.height * sizeof(double));
+    d.progress = calloc(d.height, sizeof(int));
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.advanced, NULL);
+    bool isSuccess = d.values != NULL && d.progress != NULL
+        && TryAllocateRaster(&d.out, d.width, d.height, SAMPLE_U8);
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // Scale the samples so that each output level is a whole number
+    double scale = (d.levels - 1) / (double)c->iF->maxDataValue;
+    for (int row = 0; row < d.height && isSuccess; row++)
+        for (int col = 0; col < d.width; col++)
+            d.values[(size_t)row * d.width + col]
+                = GetSample(&c->data, row, col) * scale;
+
+    if (isSuccess && d.type == DITHER_BAYER)
+        RunParallel((d.height + TILE_SIZE - 1) / TILE_SIZE, DitherBayerRows, &d);
+    else if (isSuccess)
+        RunParallel(d.height, DitherFsRow, &d);
+
+    // The dithered image replaces the input
+    FreeRaster(&c->data);
+    if (isSuccess)
+    {
+        c->data = d.out;
+        d.out.pixels = NULL;
+        SetOutputType(c->iF, c->oF);
+        c->oF->width = d.width;
+        c->oF->height = d.height;
+        c->oF->maxDataValue = d.levels - 1;
+        isSuccess = TryWriteImage(c);
+    }
+
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.advanced);
+    free(d.values);
+    free(d.progress);
+    FreeRaster(&d.out);
+    FreeRaster(&c->data);
+    CloseStreams(c);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Dithers a band of rows by an 8x8 Bayer matrix. Each sample is
+ *             raised by its threshold, spread evenly between 0 and 1, then
+ *             truncated to a level; the thresholds of a row repeat every 8
+ *             columns. This is run as a parallel job, see RunParallel.
+ *
+ * @param      arg    The Ditherer.
+ * @param[in]  index  The index of the band of TILE_SIZE rows.
+ */
+void DitherBayerRows(void *arg, int index)
+{
+    static const unsigned char bayer[8][8] = {
+        {  0, 32,  8, 40,  2, 34, 10, 42 },
+        { 48, 16, 56, 24, 50, 18, 58, 26 },
+        { 12, 44,  4, 36, 14, 46,  6, 38 },
+        { 60, 28, 52, 20, 62, 30, 54, 22 },
+        {  3, 35, 11, 43,  1, 33,  9, 41 },
+        { 51, 19, 59, 27, 49, 17, 57, 25 },
+        { 15, 47,  7, 39, 13, 45,  5, 37 },
+        { 63, 31, 55, 23, 61, 29, 53, 21 }
+    };
+    Ditherer *d = arg;
+    int top = index * TILE_SIZE;
+    int bottom = d->height - top < TILE_SIZE ? d->height : top + TILE_SIZE;
+    int max = d->levels - 1;
+
+    for (int row = top; row < bottom; row++)
+    {
+        const double *values = d->values + (size_t)row * d->width;
+        unsigned char *out = (unsigned char *)d->out.pixels
+            + (size_t)row * d->width;
+
+        double thresholds[8];
+        for (int i = 0; i < 8; i++)
+            thresholds[i] = (bayer[row & 7][i] + 0.5) / 64;
+
+        for (int col = 0; col < d->width; col++)
+        {
+            int level = (int)(values[col] + thresholds[col & 7]);
+            out[col] = level > max ? max : level;
+        }
+    }
+}
+
+
+/**
+ * @brief      Dithers a row by Floyd-Steinberg error diffusion. Each sample is
+ *             rounded to the nearest level and its error passed on: 7/16 to
+ *             the next sample, carried in a variable, and 3/16, 5/16 and 1/16
+ *             to the samples below left, below and below right. A sample's
+ *             error is complete once the row above has passed the sample
+ *             after it, so the row waits for the row above to be a chunk
+ *             ahead before each chunk. This is run as a parallel job, see
+ *             RunParallel, which starts the rows in order.
+ *
+ * @param      arg    The Ditherer.
+ * @param[in]  row    The row to dither.
+ */
+void DitherFsRow(void *arg, int row)
+{
+    Ditherer *d = arg;
+    int width = d->width;
+    double *values = d->values + (size_t)row * width;
+    double *below = row + 1 < d->height ? values + width : NULL;
+    unsigned char *out = (unsigned char *)d->out.pixels + (size_t)row * width;
+    int max = d->levels - 1;
+    double carry = 0;
+
+    for (int start = 0; start < width; start += DITHER_CHUNK)
+    {
+        int end = width - start < DITHER_CHUNK ? width : start + DITHER_CHUNK;
+
+        // Wait until the row above has diffused its error into this chunk
+        int needed = end + 1 < width ? end + 1 : width;
+        if (row > 0)
+        {
+            pthread_mutex_lock(&d->lock);
+            while (d->progress[row - 1] < needed)
+                pthread_cond_wait(&d->advanced, &d->lock);
+            pthread_mutex_unlock(&d->lock);
+        }
+
+        for (int col = start; col < end; col++)
+        {
+            double value = values[col] + carry;
+            int level = (int)floor(value + 0.5);
+            level = level < 0 ? 0 : level > max ? max : level;
+            out[col] = level;
+
+            double error = value - level;
+            carry = error * 7 / 16;
+            if (below != NULL)
+            {
+                if (col > 0)
+                    below[col - 1] += error * 3 / 16;
+                below[col] += error * 5 / 16;
+                if (col + 1 < width)
+                    below[col + 1] += error / 16;
+            }
+        }
+
+        // Let the row below start on the columns this row has finished
+        pthread_mutex_lock(&d->lock);
+        d->progress[row] = end;
+        pthread_cond_broadcast(&d->advanced);
+        pthread_mutex_unlock(&d->lock);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                               Tile pyramids                                //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Writes an image as a deep zoom tile pyramid, in which each level
+ *             is half the size of the level above, down to a single pixel.
+ *             Each level is cut into square png tiles written to
+ *             DIR/LEVEL/COL_ROW.png, where level 0 is the single pixel and the
+ *             highest level is the full size image. Each band of a level is
+ *             reduced from the level above and its tiles encoded as one
+ *             parallel job, so smaller levels start as soon as the rows they
+ *             need exist rather than after the whole of the level above.
+ *
+ * @param      dir      The directory to write the tiles to.
+ * @param      sizeStr  The width and height of each tile.
+ * @param      inName   The input file name.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryWriteTiles(char *dir, char *sizeStr, char *inName)
+{
+    Pyramid p = { dir };
+    int length = 0;
+    if (sscanf(sizeStr, "%i%n", &p.tileSize, &length) != 1
+        || sizeStr[length] != '\0' || p.tileSize < 1 || p.tileSize > 65536)
+    {
+        fprintf(stderr, "Error, bad tile size \"%s\". Check README for usage:\n",
+            sizeStr);
+        return false;
+    }
+
+    // Try and open the input file and parse the pgm data, reporting failure
+    PgmFile iF = { NULL, inName, 0, 0, 0, UNKNOWN };
+    ConversionArgs cArgs = { GetData, false, false };
+    PgmConverter c = { &iF, NULL, &cArgs, NULL, {} };
+    iF.fStream = fopen(inName, "rb");
+    if (iF.fStream == NULL)
+    {
+        fprintf(stderr, "No such file: \"%s\"\n", inName);
+        return false;
+    }
+    bool isSuccess = TryReadPgmInfo(&c) && TryReadPgmData(&c);
+    fclose(iF.fStream);
+    if (!isSuccess)
+    {
+        FreeRaster(&c.data);
+        return false;
+    }
+
+    // Halve the largest side until it is a single pixel
+    p.levelCount = 1;
+    for (int side = iF.width > iF.height ? iF.width : iF.height; side > 1;
+        side = (side + 1) / 2)
+        p.levelCount++;
+    p.maxDataValue = iF.maxDataValue;
+    p.levels = calloc(p.levelCount, sizeof(Raster));
+    p.firstBand = malloc((p.levelCount + 1) * sizeof(int));
+    isSuccess = p.levels != NULL && p.firstBand != NULL;
+
+    // The full size level is the input, and each level below halves it
+    if (isSuccess)
+    {
+        p.levels[0] = c.data;
+        c.data.pixels = NULL;
+    }
+    for (int i = 1; i < p.levelCount && isSuccess; i++)
+        isSuccess = TryAllocateRaster(&p.levels[i],
+            (p.levels[i - 1].width + 1) / 2, (p.levels[i - 1].height + 1) / 2,
+            p.levels[0].sampleType);
+
+    // Number the bands of every level in build order
+    if (isSuccess)
+        p.firstBand[0] = 0;
+    for (int i = 0; i < p.levelCount && isSuccess; i++)
+        p.firstBand[i + 1] = p.firstBand[i]
+            + (p.levels[i].height + p.tileSize - 1) / p.tileSize;
+    p.isBandDone = isSuccess ? calloc(p.firstBand[p.levelCount], sizeof(bool))
+        : NULL;
+    isSuccess = isSuccess && p.isBandDone != NULL;
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // Make the directory of each level, failures surfacing as tiles are opened
+    char path[FILENAME_MAX];
+    mkdir(dir, 0777);
+    for (int i = 0; i < p.levelCount && isSuccess; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%i", dir, p.levelCount - 1 - i);
+        mkdir(path, 0777);
+    }
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.advanced, NULL);
+    if (isSuccess)
+    {
+        RunParallel(p.firstBand[p.levelCount], BuildPyramidBand, &p);
+        isSuccess = !p.isFailed;
+    }
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.advanced);
+
+    for (int i = 0; p.levels != NULL && i < p.levelCount; i++)
+        FreeRaster(&p.levels[i]);
+    free(p.levels);
+    free(p.firstBand);
+    free(p.isBandDone);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Builds one band of a tile pyramid: waits for the two bands of
+ *             the level above which it covers, reduces them 2:1 by averaging
+ *             each 2x2 block, and writes the band's tiles. This is run as a
+ *             parallel job, see RunParallel. Jobs are taken in index order, so
+ *             the bands waited for are always already running.
+ *
+ * @param      arg    The Pyramid being built.
+ * @param[in]  index  The index of the band, over all levels.
+ */
+void BuildPyramidBand(void *arg, int index)
+{
+    Pyramid *p = arg;
+    int level = 0;
+    while (index >= p->firstBand[level + 1])
+        level++;
+    int band = index - p->firstBand[level];
+    Raster *r = &p->levels[level];
+    int top = band * p->tileSize;
+    int bottom = top + p->tileSize < r->height ? top + p->tileSize : r->height;
+
+    if (level > 0)
+    {
+        // Wait for the bands of the level above which hold this band's rows
+        const Raster *above = &p->levels[level - 1];
+        int aboveBands = p->firstBand[level] - p->firstBand[level - 1];
+        int last = 2 * band + 1 < aboveBands ? 2 * band + 1 : 2 * band;
+        pthread_mutex_lock(&p->lock);
+        while (!p->isBandDone[p->firstBand[level - 1] + 2 * band]
+            || !p->isBandDone[p->firstBand[level - 1] + last])
+            pthread_cond_wait(&p->advanced, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+
+        // Average each block of up to 2x2 samples, rounding integer samples
+        // to the nearest value
+        bool isRounded = r->sampleType != SAMPLE_F32
+            && r->sampleType != SAMPLE_F64;
+        for (int row = top; row < bottom; row++)
+            for (int col = 0; col < r->width; col++)
+            {
+                int row2 = 2 * row + 1 < above->height ? 2 * row + 1 : 2 * row;
+                int col2 = 2 * col + 1 < above->width ? 2 * col + 1 : 2 * col;
+                double mean = (GetSample(above, 2 * row, 2 * col)
+                    + GetSample(above, 2 * row, col2)
+                    + GetSample(above, row2, 2 * col)
+                    + GetSample(above, row2, col2)) / 4;
+                SetSample(r, row, col, isRounded ? floor(mean + 0.5) : mean);
+            }
+    }
+
+    // Write the band's tiles
+    bool isWritten = true;
+    for (int col = 0; col * p->tileSize < r->width && isWritten; col++)
+        isWritten = TryWriteTile(p, level, band, col);
+
+    // Let the level below start on the rows this band holds
+    pthread_mutex_lock(&p->lock);
+    p->isBandDone[index] = true;
+    p->isFailed = p->isFailed || !isWritten;
+    pthread_cond_broadcast(&p->advanced);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+/**
+ * @brief      Writes one tile of a pyramid level as a png. Tiles on the right
+ *             and bottom edges hold only the samples which remain.
+ *
+ * @param      p      The Pyramid being built.
+ * @param[in]  level  The index of the level, 0 for the full size level.
+ * @param[in]  row    The row of tiles.
+ * @param[in]  col    The column of tiles.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryWriteTile(const Pyramid *p, int level, int row, int col)
+{
+    const Raster *r = &p->levels[level];
+    Tile tile = { 0, 0, p->tileSize, p->tileSize };
+    tile.width = r->width - col * p->tileSize < p->tileSize
+        ? r->width - col * p->tileSize : p->tileSize;
+    tile.height = r->height - row * p->tileSize < p->tileSize
+        ? r->height - row * p->tileSize : p->tileSize;
+    tile.pixels = malloc((size_t)tile.width * tile.height * sizeof(double));
+    if (tile.pixels == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    // Copy the tile's samples, which the png encoder fetches through GetData
+    for (int i = 0; i < tile.height; i++)
+        for (int j = 0; j < tile.width; j++)
+            tile.pixels[(size_t)i * tile.width + j] = GetSample(r,
+                row * p->tileSize + i, col * p->tileSize + j);
+
+    // Level numbers count up from the single pixel level
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%i/%i_%i.png", p->dir,
+        p->levelCount - 1 - level, col, row);
+    PgmFile oF = { fopen(path, "wb"), path, tile.width, tile.height,
+        p->maxDataValue, PNG };
+    // The tile is written by a parallel job, so its bands are encoded serially
+    ConversionArgs cArgs = { GetData, false, false, ORIENT_IDENTITY, 0, false,
+        true };
+    PgmConverter c = { NULL, &oF, &cArgs, NULL, {}, NULL, &tile };
+    bool isWritten = false;
+    if (oF.fStream == NULL)
+        fprintf(stderr, "Error, could not write \"%s\"\n", path);
+    else
+    {
+        isWritten = TryWritePngData(&c);
+        isWritten = !ferror(oF.fStream) && isWritten;
+        isWritten = !fclose(oF.fStream) && isWritten;
+    }
+
+    free(tile.pixels);
+    return isWritten;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Header rewriting                               //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Writes a copy of a pgm file with a new header comment or max
+ *             value. Only the header is parsed and written; the data is copied
+ *             as it is, inside the kernel where possible, so the time taken
+ *             does not depend on the size of the image.
+ *
+ * @param      c        A PgmConverter detailing conversion state information.
+ * @param      comment  The new comment, whose lines each become a comment
+ *                      line, or NULL for the usual comment.
+ * @param      maxStr   The new max value, or NULL to keep the max value. If it
+ *                      is lower, the samples are read to check that none
+ *                      exceed it.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryRewriteHeader(PgmConverter *c, char *comment, char *maxStr)
+{
+    // Try and open the io files and parse the pgm info, reporting failure
+    if (!TryOpenStreams(c) || !TryReadPgmInfo(c))
+    {
+        if (c->iF->fStream != NULL)
+            CloseStreams(c);
+        return false;
+    }
+    if (c->iF->type != P2 && c->iF->type != P5)
+    {
+        fprintf(stderr, "Error, only P2 and P5 headers can be rewritten\n");
+        CloseStreams(c);
+        return false;
+    }
+
+    // A P5 file's new max value must keep the number of bytes per sample
+    int max = c->iF->maxDataValue;
+    int length = 0;
+    if (maxStr != NULL && (sscanf(maxStr, "%i%n", &max, &length) != 1
+        || maxStr[length] != '\0' || max < 1 || max > 65535
+        || (c->iF->type == P5 && (max > 255) != (c->iF->maxDataValue > 255))))
+    {
+        fprintf(stderr, "Error, bad max value \"%s\". Check README for usage:\n",
+            maxStr);
+        CloseStreams(c);
+        return false;
+    }
+
+    // The data runs from the end of the header to the end of the file, which
+    // for P5 is exactly the samples
+    struct stat inStat;
+    off_t inStart = ftello(c->iF->fStream);
+    int sampleBytes = c->iF->maxDataValue > 255 ? 2 : 1;
+    if (fstat(fileno(c->iF->fStream), &inStat) || (c->iF->type == P5
+        && inStat.st_size - inStart
+            != (off_t)c->iF->width * c->iF->height * sampleBytes))
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        CloseStreams(c);
+        return false;
+    }
+
+    // A lower max value must still hold every sample. The data is copied by
+    // offset, so reading it to check does not move the copy's start.
+    if (max < c->iF->maxDataValue && !TryCheckMaxValue(c->iF, max))
+    {
+        CloseStreams(c);
+        return false;
+    }
+
+    // Write the new header, each line of the comment as a comment line
+    fprintf(c->oF->fStream, "%s\n", PgmTypeToStr(c->iF->type));
+    char *line = comment == NULL ? "Generated by pnmdump.exe" : comment;
+    while (line != NULL)
+    {
+        size_t lineLength = strcspn(line, "\n");
+        fprintf(c->oF->fStream, "# %.*s\n", (int)lineLength, line);
+        line = line[lineLength] == '\n' ? line + lineLength + 1 : NULL;
+    }
+    fprintf(c->oF->fStream, "%i %i\n%i\n", c->iF->width, c->iF->height, max);
+    fflush(c->oF->fStream);
+
+    // Copy the data after it
+    bool isCopied = TryCopyBytes(fileno(c->iF->fStream), inStart,
+        fileno(c->oF->fStream), ftello(c->oF->fStream), inStat.st_size - inStart);
+    if (!isCopied)
+        fprintf(stderr, "Error, could not write output file\n");
+
+    CloseStreams(c);
+    return isCopied;
+}
+
+
+/**
+ * @brief      Checks that no sample of a P2 or P5 file exceeds a max value.
+ *
+ * @param      iF    The input file information, positioned at the data.
+ * @param[in]  max   The max value to check against.
+ *
+ * @return     Returns true if every sample is at most max, false otherwise.
+ */
+bool TryCheckMaxValue(PgmFile *iF, int max)
+{
+    uint16_t *samples = malloc(iF->width * sizeof(uint16_t));
+    if (samples == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    int high = 0;
+    bool isValid = true;
+    for (int row = 0; row < iF->height && isValid; row++)
+    {
+        isValid = TryReadSampleRow(iF, samples);
+        for (int col = 0; isValid && col < iF->width; col++)
+            high = samples[col] > high ? samples[col] : high;
+    }
+    free(samples);
+
+    if (!isValid)
+        fprintf(stderr, "Corrupted input file\n");
+    else if (high > max)
+        fprintf(stderr, "Error, max value %i is below a sample of %i\n", max,
+            high);
+    return isValid && high <= max;
+}
+
+
+/**
+ * @brief      Copies a range of bytes from one file to another. The copy is
+ *             made by copy_file_range where available, which lets filesystems
+ *             that support it share the data rather than duplicate it, then by
+ *             sendfile, and otherwise through a buffer.
+ *
+ * @param[in]  inFd      The file descriptor to copy from.
+ * @param[in]  inStart   The offset to copy from.
+ * @param[in]  outFd     The file descriptor to copy to. Its position may be
+ *                       moved. If it is a pipe, outStart is ignored.
+ * @param[in]  outStart  The offset to copy to.
+ * @param[in]  length    The number of bytes to copy.
+ *
+ * @return     Returns true when every byte was copied, false otherwise.
+ */
+bool TryCopyBytes(int inFd, off_t inStart, int outFd, off_t outStart,
+    off_t length)
+{
+    off_t copied = 0;
+
+#ifdef __linux__
+    // Copy inside the kernel, between regular files
+    while (copied < length)
+    {
+        loff_t in = inStart + copied;
+        loff_t out = outStart + copied;
+        ssize_t count = copy_file_range(inFd, &in, outFd, &out,
+            length - copied, 0);
+        if (count <= 0)
+            break;
+        copied += count;
+    }
+
+#endif
+
+    // The rest is written at the output's position, so move it to the rest
+    // unless it is a pipe, which cannot have been written to yet
+    if (copied < length && lseek(outFd, outStart + copied, SEEK_SET) < 0
+        && copied > 0)
+        return false;
+
+#ifdef __linux__
+    // Else send the rest from the page cache, which also reaches pipes
+    while (copied < length)
+    {
+        off_t in = inStart + copied;
+        ssize_t count = sendfile(outFd, inFd, &in, length - copied);
+        if (count <= 0)
+            break;
+        copied += count;
+    }
+#endif
+
+    // Else read and write the rest through a buffer
+    unsigned char buffer[TRANSCODE_BUFFER_SIZE];
+    while (copied < length)
+    {
+        size_t size = length - copied < TRANSCODE_BUFFER_SIZE
+            ? (size_t)(length - copied) : TRANSCODE_BUFFER_SIZE;
+        ssize_t count = pread(inFd, buffer, size, inStart + copied);
+        if (count <= 0 || write(outFd, buffer, count) != count)
+            break;
+        copied += count;
+    }
+
+    return copied == length;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                              Frame splitting                               //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Splits a multi-frame raw pnm file into one file per frame, named
+ *             by the prefix and the frame's 0-indexed number, e.g.
+ *             frame0000.pgm. Only the headers are parsed; each frame is copied
+ *             whole, inside the kernel where possible, with frames copied in
+ *             parallel.
+ *
+ * @param      inName  The input file name.
+ * @param      prefix  The prefix of the output file names.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TrySplitFrames(char *inName, char *prefix)
+{
+    FrameSpans f = { 0 };
+    f.outName = prefix;
+    f.isSplit = true;
+
+    FILE *stream = fopen(inName, "rb");
+    if (stream == NULL)
+    {
+        fprintf(stderr, "No such file: \"%s\"\n", inName);
+        return false;
+    }
+
+    bool isSuccess = TryFindFrames(&f, stream) && TryCopyFrames(&f);
+
+    fclose(stream);
+    FreeFrameSpans(&f);
+    return isSuccess;
+}
+
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Joins the frames of one or more raw pnm files, each of which may
+ *             hold several frames, into one multi-frame file. Only the headers
+ *             are parsed. The output is sized up front so that every frame is
+ *             copied straight to its place, in parallel.
+ *
+ * @param[in]  inCount  The number of input files.
+ * @param      inNames  The input file names, in order.
+ * @param      outName  The output file name.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryConcatFrames(int inCount, char **inNames, char *outName)
+{
+    FrameSpans f = { 0 };
+    f.outName = outName;
+    FILE **streams = calloc(inCount, sizeof(FILE *));
+    bool isSuccess = streams != NULL;
+    if (!isSuccess)
+        fprintf(stderr, "Error, out of memory\n");
+
+    // Find the frames of each input in turn
+    for (int i = 0; i < inCount && isSuccess; i++)
+    {
+        streams[i] = fopen(inNames[i], "rb");
+        if (streams[i] == NULL)
+        {
+            fprintf(stderr, "No such file: \"%s\"\n", inNames[i]);
+            isSuccess = false;
+        }
+        isSuccess = isSuccess && TryFindFrames(&f, streams[i]);
+    }
+
+    isSuccess = isSuccess && TryCopyFrames(&f);
+
+    for (int i = 0; streams != NULL && i < inCount; i++)
+        if (streams[i] != NULL)
+            fclose(streams[i]);
+    free(streams);
+    FreeFrameSpans(&f);
+    return isSuccess;
+}
+
+
+/**
+ * @brief      Finds the frames of a multi-frame raw pnm file, i.e. of P4 to P7
+ *             frames, by parsing each header and skipping over the samples
+ *             after it, adding them to a set of frames.
+ *
+ * @param      f       The frames found so far.
+ * @param      stream  The file, positioned at its start.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryFindFrames(FrameSpans *f, FILE *stream)
+{
+    PgmFile iF = { stream, NULL, 0, 0, 0, UNKNOWN };
+    PgmConverter c = { &iF, NULL, NULL, NULL, {} };
+    struct stat inStat;
+    if (fstat(fileno(stream), &inStat))
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    while (HasNextFrame(stream))
+    {
+        off_t start = ftello(stream);
+        iF.type = UNKNOWN;
+        if (!TryReadPgmInfo(&c))
+            return false;
+
+        // Frames are found without reading their samples, so each must take
+        // a known number of bytes
+        if (IsPlainPnm(iF.type) || iF.type == PF)
+        {
+            fprintf(stderr, "Error, only raw pnm frames can be split or "
+                "joined\n");
+            return false;
+        }
+
+        // The frame's samples must all be in the file. Bitmap rows start on
+        // a new byte.
+        off_t end = ftello(stream) + (iF.type == P4
+            ? (off_t)(iF.width + 7) / 8 * iF.height
+            : (off_t)iF.width * iF.height * iF.depth
+                * (iF.maxDataValue > 255 ? 2 : 1));
+        if (end > inStat.st_size || fseeko(stream, end, SEEK_SET))
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            return false;
+        }
+
+        if (f->count == f->capacity)
+        {
+            f->capacity = f->capacity == 0 ? 64 : f->capacity * 2;
+            int *fds = realloc(f->fds, f->capacity * sizeof(int));
+            f->fds = fds != NULL ? fds : f->fds;
+            off_t *starts = realloc(f->starts, f->capacity * sizeof(off_t));
+            f->starts = starts != NULL ? starts : f->starts;
+            off_t *lengths = realloc(f->lengths, f->capacity * sizeof(off_t));
+            f->lengths = lengths != NULL ? lengths : f->lengths;
+            if (fds == NULL || starts == NULL || lengths == NULL)
+            {
+                fprintf(stderr, "Error, out of memory\n");
+                return false;
+            }
+        }
+        f->fds[f->count] = fileno(stream);
+        f->starts[f->count] = start;
+        f->lengths[f->count] = end - start;
+        f->count++;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Copies a set of frames in parallel, each to its own file or to
+ *             its place in a single output file.
+ *
+ * @param      f     The frames, found by TryFindFrames.
+ *
+ * @return     Returns true when every frame was copied, false otherwise.
+ */
+bool TryCopyFrames(FrameSpans *f)
+{
+    f->outStarts = malloc((f->count + 1) * sizeof(off_t));
+    f->isCopied = calloc(f->count + 1, sizeof(bool));
+    if (f->outStarts == NULL || f->isCopied == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    // Each frame follows the last in a joined output
+    f->outStarts[0] = 0;
+    for (int i = 0; i < f->count; i++)
+        f->outStarts[i + 1] = f->isSplit ? 0 : f->outStarts[i] + f->lengths[i];
+
+    // Create a joined output at its full size, for the frames to be copied
+    // into through their own streams
+    if (!f->isSplit)
+    {
+        FILE *out = fopen(f->outName, "wb");
+        bool isCreated = out != NULL
+            && !ftruncate(fileno(out), f->outStarts[f->count]);
+        if (out != NULL)
+            fclose(out);
+        if (!isCreated)
+        {
+            fprintf(stderr, "Error, could not write output file\n");
+            return false;
+        }
+    }
+
+    RunParallel(f->count, CopyFrame, f);
+
+    for (int i = 0; i < f->count; i++)
+        if (!f->isCopied[i])
+            return false;
+    return true;
+}
+
+
+/**
+ * @brief      Copies one frame to its output. This is run as a parallel job,
+ *             see RunParallel.
+ *
+ * @param      arg    The FrameSpans being copied.
+ * @param[in]  index  The index of the frame to copy.
+ */
+void CopyFrame(void *arg, int index)
+{
+    FrameSpans *f = arg;
+
+    // Open a stream of the frame's own, so that copies do not share a file
+    // position
+    char path[FILENAME_MAX];
+    if (f->isSplit)
+        snprintf(path, sizeof(path), "%s%04i.pgm", f->outName, index);
+    else
+        snprintf(path, sizeof(path), "%s", f->outName);
+    FILE *out = fopen(path, f->isSplit ? "wb" : "r+b");
+
+    f->isCopied[index] = out != NULL && TryCopyBytes(f->fds[index],
+        f->starts[index], fileno(out), f->outStarts[index], f->lengths[index]);
+    if (out != NULL && fclose(out))
+        f->isCopied[index] = false;
+    if (!f->isCopied[index])
+        fprintf(stderr, "Error, could not write \"%s\"\n", path);
+}
+
+
+/**
+ * @brief      Frees the arrays of a set of frames.
+ *
+ * @param      f     The frames.
+ */
+void FreeFrameSpans(FrameSpans *f)
+{
+    free(f->fds);
+    free(f->starts);
+    free(f->lengths);
+    free(f->outStarts);
+    free(f->isCopied);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                Linear light                                //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Sets up an input and output to be processed in linear light.
+ *             Samples are decoded from sRGB by a table lookup as each row is
+ *             read, and encoded again by a lookup as each row is written, so
+ *             every operation in between works on linear light at no extra
+ *             pass over the image. Pfm outputs keep the linear values.
+ *
+ * @param      c     A PgmConverter whose input info has just been read.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TrySetLinearTables(PgmConverter *c)
+{
+    // The tables hold one entry per 8 bit sample
+    if (c->iF->type == PF || c->iF->maxDataValue > 255)
+    {
+        fprintf(stderr, "Error, --linear needs pnm input of at most 8 "
+            "bits\n");
+        return false;
+    }
+
+    c->iF->linear = GetLinearTables(c->iF->maxDataValue);
+    c->oF->linear = c->iF->linear;
+    if (c->iF->linear == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Finds, or builds, the linear light tables for a max value. The
+ *             tables are built once and kept for the life of the program, so
+ *             that each frame of a stream reuses them.
+ *
+ * @param[in]  maxDataValue  The max value, at most 255.
+ *
+ * @return     The tables, or NULL if out of memory.
+ */
+const LinearTables *GetLinearTables(int maxDataValue)
+{
+    static LinearTables *tables[256];
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&mutex);
+    LinearTables *t = tables[maxDataValue];
+    if (t == NULL && (t = malloc(sizeof(LinearTables))) != NULL)
+    {
+        // Decode each sample value by the sRGB transfer function
+        for (int value = 0; value <= maxDataValue; value++)
+        {
+            double x = (double)value / maxDataValue;
+            double light = x <= 0.04045 ? x / 12.92
+                : pow((x + 0.055) / 1.055, 2.4);
+            t->toLinear[value] = (uint16_t)(light * 65535 + 0.5);
+        }
+
+        // Encode each linear light level by the inverse function
+        for (int level = 0; level < 65536; level++)
+        {
+            double light = level / 65535.0;
+            double x = light <= 0.0031308 ? light * 12.92
+                : 1.055 * pow(light, 1 / 2.4) - 0.055;
+            t->fromLinear[level] = (uint8_t)(x * maxDataValue + 0.5);
+        }
+        tables[maxDataValue] = t;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return t;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Reading input pgm                              //
+////////////////////////////////////////////////////////////////////////////////
+
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Reads the header information from a pnm or pfm file: the type,
+ *             width, height and max data value (or, for pfm, the scale). The
+ *             magic number is read first and chooses how the rest is laid out,
+ *             so any of P1 to P7 is accepted where the type is not fixed.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryReadPgmInfo(PgmConverter *c)
+{
+    /* Parse the input image type, width, height and max value, which are
+       separated by whitespace and may be interleaved with comment lines */
+
+    char typeStr[10];
+    char widthStr[16];
+    char heightStr[16];
+    char maxStr[32] = "1";
+    int n = 0;
+
+    // Sniff the magic number, which an unknown file fails
+    enum PgmType imageType = TryReadHeaderToken(c->iF->fStream, typeStr,
+        sizeof(typeStr)) ? StrToPgmType(typeStr) : UNKNOWN;
+    c->iF->depth = imageType == P3 || imageType == P6 ? 3 : 1;
+
+    // A pam names its fields, and a bitmap has no max value, being 1
+    bool isValid = imageType == P7 ? TryReadPamHeader(c->iF)
+        : imageType != UNKNOWN
+        && TryReadHeaderToken(c->iF->fStream, widthStr, sizeof(widthStr))
+        && TryReadHeaderToken(c->iF->fStream, heightStr, sizeof(heightStr))
+        && (imageType == P1 || imageType == P4
+        || TryReadHeaderToken(c->iF->fStream, maxStr, sizeof(maxStr)))
+        && sscanf(widthStr, "%i%n", &(c->iF->width), &n) == 1
+        && widthStr[n] == '\0'
+        && sscanf(heightStr, "%i%n", &(c->iF->height), &n) == 1
+        && heightStr[n] == '\0';
+    if (!isValid || c->iF->width <= 0 || c->iF->height <= 0)
+    {
+        // If the attempt was unsucessful report the error
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    // If the input type is unknown, set it to the parsed input type
+    if (c->iF->type == UNKNOWN)
+        c->iF->type = imageType;
+
+    // If parsed pgm type does not match the expected input type, report error
+    if(c->iF->type != imageType)
+    {
+        fprintf(stderr, "Input is not in %s format\n", PgmTypeToStr(c->iF->type));
+        return false;
+    }
+
+    // A pfm has a scale in place of the max value, whose sign gives the byte
+    // order. Its samples are kept in the same units as pgm data.
+    if (c->iF->type == PF)
+    {
+        double scale = 0;
+        if (sscanf(maxStr, "%lf%n", &scale, &n) != 1 || maxStr[n] != '\0'
+            || scale == 0)
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            return false;
+        }
+        c->iF->isLittleEndian = scale < 0;
+
+        // Assume 8 bit data until the samples have been read
+        c->iF->maxDataValue = 255;
+    }
+    else if (c->iF->type != P7
+        && (sscanf(maxStr, "%i%n", &(c->iF->maxDataValue), &n) != 1
+        || maxStr[n] != '\0'
+        || c->iF->maxDataValue <= 0 || c->iF->maxDataValue > 65535))
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    // Under --linear, decode samples to linear light as they are read
+    if (c->cArgs != NULL && c->cArgs->isLinear && !TrySetLinearTables(c))
+        return false;
+
+    return true;
+}
+
+
+/**
+ * @brief      Reads the next whitespace separated token of a pgm header,
+ *             skipping comments. The single whitespace character ending the
+ *             token is consumed, so after the final header token the stream is
+ *             positioned at the start of the data.
+ *
+ * @param      stream  The stream to read from.
+ * @param      token   Output for the null terminated token.
+ * @param[in]  size    The size of the token buffer.
+ *
+ * @return     Returns true when a token was read, false otherwise.
+ */
+bool TryReadHeaderToken(FILE *stream, char *token, size_t size)
+{
+    int ch = fgetc(stream);
+
+    // Skip whitespace, and comments which run from a '#' to the end of a line
+    while (ch == '#' || (ch != EOF && strchr(" \t\r\n\v\f", ch)))
+    {
+        if (ch == '#')
+            while (ch != EOF && ch != '\n')
+                ch = fgetc(stream);
+        ch = fgetc(stream);
+    }
+
+    // Copy the token, failing if it does not fit
+    size_t length = 0;
+    while (ch != EOF && !strchr(" \t\r\n\v\f", ch))
+    {
+        if (length + 1 >= size)
+            return false;
+        token[length++] = ch;
+        ch = fgetc(stream);
+    }
+    token[length] = '\0';
+
+    return length > 0;
+}
+
+
+/**
+ * @brief      Reads the fields of a pam header, which follow the magic number
+ *             as keyword and value pairs up to an ENDHDR line. The channels
+ *             are found from the depth, so a tuple type, which is optional,
+ *             must be the one of that depth; a black and white bitmap is read
+ *             as grey. Any other field is skipped.
+ *
+ * @param      iF    The input file, positioned after the magic number. Its
+ *                   width, height, depth and max value are set.
+ *
+ * @return     Returns true when successful, false if the header is corrupted.
+ */
+bool TryReadPamHeader(PgmFile *iF)
+{
+    char key[16];
+    char value[32];
+    char tupleType[32] = "";
+    int n = 0;
+
+    iF->depth = 0;
+    iF->maxDataValue = 0;
+    for (;;)
+    {
+        // The header ends at the ENDHDR keyword, whose line end is consumed
+        if (!TryReadHeaderToken(iF->fStream, key, sizeof(key)))
+            return false;
+        if (!strcmp(key, "ENDHDR"))
+            break;
+
+        int *field = !strcmp(key, "WIDTH") ? &iF->width
+            : !strcmp(key, "HEIGHT") ? &iF->height
+            : !strcmp(key, "DEPTH") ? &iF->depth
+            : !strcmp(key, "MAXVAL") ? &iF->maxDataValue : NULL;
+        if (!TryReadHeaderToken(iF->fStream, value, sizeof(value))
+            || (field != NULL && (sscanf(value, "%i%n", field, &n) != 1
+            || value[n] != '\0')))
+            return false;
+        if (!strcmp(key, "TUPLTYPE"))
+            strcpy(tupleType, value);
+    }
+
+    // Up to four channels are read, e.g. RGB_ALPHA
+    if (iF->depth < 1 || iF->depth > 4 || iF->maxDataValue <= 0
+        || iF->maxDataValue > 65535)
+        return false;
+
+    // A tuple type which does not match the depth corrupts the header
+    bool isBitmap = iF->maxDataValue == 1 && ((iF->depth == 1
+        && !strcmp(tupleType, "BLACKANDWHITE")) || (iF->depth == 2
+        && !strcmp(tupleType, "BLACKANDWHITE_ALPHA")));
+    return tupleType[0] == '\0' || isBitmap
+        || !strcmp(tupleType, GetTupleType(iF->depth));
+}
+
+
+/**
+ * @brief      Skips the whitespace between frames of a multi-frame input, such
+ *             as the newline ending a P2 frame, and checks for another frame.
+ *
+ * @param      stream  The stream, positioned after a frame's data.
+ *
+ * @return     Returns true if there is another frame, false at the end.
+ */
+bool HasNextFrame(FILE *stream)
+{
+    int ch = fgetc(stream);
+    while (ch != EOF && strchr(" \t\r\n\v\f", ch))
+        ch = fgetc(stream);
+
+    if (ch == EOF)
+        return false;
+    ungetc(ch, stream);
+    return true;
+}
+
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Reads the data from a pgm file and stores it into a PgmConverter's
+ *             data raster. Samples are stored as bytes when they fit, and pfm
+ *             and linear light samples are stored as floats.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryReadPgmData(PgmConverter *c)
+{
+    enum SampleType sampleType = c->iF->type == PF || c->iF->linear != NULL
+        ? SAMPLE_F32 : c->iF->maxDataValue > 255 ? SAMPLE_U16 : SAMPLE_U8;
+    double *data = malloc(c->iF->width * sizeof(double));
+    if (data == NULL
+        || !TryAllocateRaster(&c->data, c->iF->width, c->iF->height, sampleType))
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        free(data);
+        return false;
+    }
+
+    double max = 0;
+    for (int i = 0; i < c->iF->height; i++)
+    {
+        // A pfm holds its rows from the bottom up
+        int row = c->iF->type == PF ? c->iF->height - 1 - i : i;
+
+        if (!TryReadPgmRow(c->iF, data))
+        {
+            fprintf(stderr, "Corrupted input file\n");
+            free(data);
+            return false;
+        }
+
+        for (int column = 0; column < c->iF->width; column++)
+        {
+            SetSample(&c->data, row, column, data[column]);
+            max = data[column] > max ? data[column] : max;
+        }
+    }
+    free(data);
+
+    // A pfm has no fixed max value, so integer outputs get the smallest common
+    // max value which holds the data
+    if (c->iF->type == PF)
+        c->iF->maxDataValue = max > 255 ? 65535 : 255;
+
+    // Input is corrupted if the input type is binary and there is still
+    // information to read
+    if (!IsPlainPnm(c->iF->type) && fgetc(c->iF->fStream) != EOF)
+    {
+        fprintf(stderr, "Corrupted input file\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Reads the next row of data from a pnm or pfm file, as grey
+ *             levels. The row is decoded by the decoder for the file's layout.
+ *
+ * @param      iF    The input file information.
+ * @param      data  Output for the row, iF->width samples, or iF->width pixels
+ *                   of iF->depth channels if iF->isInterleaved.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadPgmRow(PgmFile *iF, double *data)
+{
+    // If the input type is pfm read floats, rejecting NaN
+    if (iF->type == PF)
+    {
+        for (int column = 0; column < iF->width; column++)
+            if (!TryReadFloat(iF, &data[column]) || data[column] != data[column])
+                return false;
+        return true;
+    }
+
+    // Decode the samples by the layout of the input type
+    bool isRead = iF->type == P4 ? TryReadBitmapRow(iF, data)
+        : IsPlainPnm(iF->type) ? TryReadPlainRow(iF, data)
+        : TryReadRawRow(iF, data);
+    if (!isRead)
+        return false;
+
+    // Decode the samples to linear light, kept in the same units and rounded
+    // to a float as rasters store it, so that streamed and in memory
+    // conversions agree
+    if (iF->linear != NULL)
+        for (int column = 0; column < iF->width; column++)
+            data[column] = (float)(iF->linear->toLinear[(int)data[column]]
+                * (iF->maxDataValue / 65535.0));
+
+    return true;
+}
+
+
+/**
+ * @brief      Reads the next row of a plain pnm, i.e. P1, P2 or P3, whose
+ *             samples are ASCII numbers. A P1 sample is a single digit, which
+ *             need not be separated from the next.
+ *
+ * @param      iF    The input file information.
+ * @param      data  Output for the row's pixels, stored by SetPixel.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadPlainRow(PgmFile *iF, double *data)
+{
+    int channels[3];
+
+    for (int column = 0; column < iF->width; column++)
+    {
+        for (int i = 0; i < iF->depth; i++)
+        {
+            // A bitmap digit is 1 for black, so it is inverted to a grey level
+            if (iF->type == P1)
+            {
+                int ch = fgetc(iF->fStream);
+                while (ch != EOF && strchr(" \t\r\n\v\f", ch))
+                    ch = fgetc(iF->fStream);
+                if (ch != '0' && ch != '1')
+                    return false;
+                channels[i] = '1' - ch;
+            }
+            // Else scan for the next integer
+            else if (fscanf(iF->fStream, "%i", &channels[i]) != 1)
+            {
+                return false;
+            }
+
+            // If the value of data exceeds limits, it is corrupted
+            if (channels[i] > iF->maxDataValue || channels[i] < 0)
+                return false;
+        }
+
+        SetPixel(iF, data, column, channels);
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Reads the next row of a raw pnm, i.e. P5, P6 or P7, whose pixels
+ *             are iF->depth interleaved channels. Samples above 255 take two
+ *             bytes, most significant first.
+ *
+ * @param      iF    The input file information.
+ * @param      data  Output for the row's pixels, stored by SetPixel.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadRawRow(PgmFile *iF, double *data)
+{
+    int channels[4];
+
+    for (int column = 0; column < iF->width; column++)
+    {
+        for (int i = 0; i < iF->depth; i++)
+        {
+            int value = fgetc(iF->fStream);
+            if (value != EOF && iF->maxDataValue > 255)
+            {
+                int low = fgetc(iF->fStream);
+                value = low == EOF ? EOF : value << 8 | low;
+            }
+
+            // If the value of data exceeds limits, it is corrupted
+            if (value == EOF || value > iF->maxDataValue)
+                return false;
+            channels[i] = value;
+        }
+
+        SetPixel(iF, data, column, channels);
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Reads the next row of a raw bitmap, P4, whose pixels are packed
+ *             eight to a byte, most significant bit first. Each row starts on
+ *             a new byte, and a set bit is black, i.e. grey level 0 of max 1.
+ *
+ * @param      iF    The input file information.
+ * @param      data  Output for the row's grey levels, iF->width samples.
+ *
+ * @return     Returns true when successful, false if the data is corrupted.
+ */
+bool TryReadBitmapRow(PgmFile *iF, double *data)
+{
+    int byte = 0;
+
+    for (int column = 0; column < iF->width; column++)
+    {
+        if (column % 8 == 0 && (byte = fgetc(iF->fStream)) == EOF)
+            return false;
+        data[column] = !(byte >> (7 - column % 8) & 1);
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Stores a decoded pixel in a row, as all of its channels if the
+ *             input is read interleaved, otherwise as its grey level.
+ *
+ * @param      iF        The input file information.
+ * @param      data      The row being decoded.
+ * @param[in]  column    The pixel's column.
+ * @param[in]  channels  The pixel's channel values, iF->depth of them.
+ */
+void SetPixel(const PgmFile *iF, double *data, int column,
+    const int *channels)
+{
+    if (!iF->isInterleaved)
+    {
+        data[column] = ToGrey(channels, iF->depth);
+        return;
+    }
+
+    for (int i = 0; i < iF->depth; i++)
+        data[(size_t)column * iF->depth + i] = channels[i];
+}
+
+
+/**
+ * @brief      Reduces a pixel's channels to a grey level. Colour is weighted
+ *             by the Rec. 601 luma coefficients and rounded; otherwise the
+ *             first channel is the grey level, and any alpha is dropped.
+ *
+ * @param[in]  channels  The pixel's channel values.
+ * @param[in]  depth     The number of channels.
+ *
+ * @return     The grey level, in the same units as the channels.
+ */
+int ToGrey(const int *channels, int depth)
+{
+    if (depth >= 3)
+        return (299 * channels[0] + 587 * channels[1] + 114 * channels[2]
+            + 500) / 1000;
+    return channels[0];
+}
+
+
+/**
+ * @brief      Reads a 32 bit float sample from a pfm file.
+ *
+ * @param      iF     The pfm file, giving the stream and byte order.
+ * @param      value  Output for the sample value.
+ *
+ * @return     Returns true when successful, false at the end of the file.
+ */
+bool TryReadFloat(PgmFile *iF, double *value)
+{
+    unsigned char bytes[4];
+    if (fread(bytes, 1, 4, iF->fStream) != 4)
+        return false;
+
+    // Assemble the bits in the file's byte order then reinterpret as a float
+    uint32_t bits = iF->isLittleEndian
+        ? (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8
+            | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24
+        : (uint32_t)bytes[3] | (uint32_t)bytes[2] << 8
+            | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[0] << 24;
+    float sample;
+    memcpy(&sample, &bits, 4);
+
+    *value = sample;
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                         Output pgm initialization                          //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Sets any output pgm information which is context sensitive.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TrySetPgmInfo(PgmConverter *c)
+{
+    SetOutputType(c->iF, c->oF);
+
+    // Set the output's width and height, swapped if a transformation requires
+    if (c->cArgs->isSwapWidthHeight)
+    {
+        c->oF->width = c->iF->height;
+        c->oF->height = c->iF->width;
+    }
+    else
+    {
+        c->oF->width = c->iF->width;
+        c->oF->height = c->iF->height;
+    }
+
+    // Set the output's max data value equal to the input
+    c->oF->maxDataValue = c->iF->maxDataValue;
+
+    // Sets scale properties if the output is to be scaled.
+    if (c->cArgs->isScale)
+    {
+        // Try and parse the scale factor from the command-line parameter
+        if (!TryParseScalar(c))
+            return false;
+
+        // Set the scaled output width and height 
+        c->oF->height *= c->sArgs->hScale;
+        c->oF->width *= c->sArgs->wScale;
+
+        // Max output size of the scaled output image is 1920x1080
+        if (c->oF->width > 1920 || c->oF->height > 1080)
+        {
+            fprintf(stderr, "Error, output too large, max 1920x1080\n");
+            return false;
+        }
+
+        // Find or build the plan of source rows and columns
+        c->sArgs->plan = GetScalePlan(c->cArgs->getData, c->iF, c->oF,
+            c->sArgs);
+        if (c->sArgs->plan == NULL)
+            return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Sets the output type from the output file name's extension, or
+ *             the input type if the extension does not choose one.
+ *
+ * @param      iF    The input file information.
+ * @param      oF    The output file information.
+ */
+void SetOutputType(PgmFile *iF, PgmFile *oF)
+{
+    // If the output file name has a .png, .pfm, .pam or .pbm extension, use
+    // that format
+    size_t nameLength = strlen(oF->fName);
+    if (nameLength > 4 && !strcmp(oF->fName + nameLength - 4, ".png"))
+        oF->type = PNG;
+    else if (nameLength > 4 && !strcmp(oF->fName + nameLength - 4, ".pfm"))
+        oF->type = PF;
+    else if (nameLength > 4 && !strcmp(oF->fName + nameLength - 4, ".pam"))
+        oF->type = P7;
+    else if (nameLength > 4 && !strcmp(oF->fName + nameLength - 4, ".pbm"))
+        oF->type = P4;
+
+    // If the output type is unknown, set it to the parsed input type, with
+    // other pnm types written as the pgm of the same encoding. A pam with
+    // alpha stays a pam, so that its alpha is kept.
+    if (oF->type == UNKNOWN && (iF->type == P1 || iF->type == P3))
+        oF->type = P2;
+    else if (oF->type == UNKNOWN && (iF->type == P4 || iF->type == P6
+        || (iF->type == P7 && GetAlphaChannel(iF->depth) < 0)))
+        oF->type = P5;
+    else if (oF->type == UNKNOWN)
+        oF->type = iF->type;
+
+    // Float data written to a .pgm file name is quantized to P5, and pam
+    // data is reduced to grey
+    if ((oF->type == PF || oF->type == P7) && nameLength > 4
+        && !strcmp(oF->fName + nameLength - 4, ".pgm"))
+        oF->type = P5;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Writing output pgm                             //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Writes the output image of a PgmConverter, as a png or a pgm or
+ *             pfm according to the output type.
+ *
+ * @param      c     A PgmConverter detailing conversion state information, with
+ *                   the output information set.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryWriteImage(PgmConverter *c)
+{
+    if (c->oF->type == PNG)
+        return TryWritePngData(c);
+
+    WritePgmInfo(c->oF);
+    return TryWritePgmData(c);
+}
+
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Writes the first four lines of information to a pgm file. A pfm
+ *             header has no comment, and a negative scale to indicate little
+ *             endian samples. A pbm header has no max value.
+ *
+ * @param      oF    A PgmFile struct detailing the pgm files' information.
+ */
+void WritePgmInfo(PgmFile *oF)
+{
+    if (oF->type == PF)
+    {
+        fprintf(oF->fStream, "Pf\n%i %i\n-1.0\n", oF->width, oF->height);
+        return;
+    }
+
+    // A pam names its fields, and its tuple type follows from its depth
+    if (oF->type == P7)
+    {
+        int depth = oF->isInterleaved ? oF->depth : 1;
+        fprintf(oF->fStream, "P7\n# Generated by pnmdump.exe\n"
+            "WIDTH %i\nHEIGHT %i\nDEPTH %i\nMAXVAL %i\nTUPLTYPE %s\n"
+            "ENDHDR\n", oF->width, oF->height, depth, oF->maxDataValue,
+            GetTupleType(depth));
+        return;
+    }
+
+    if (oF->type == P4)
+    {
+        fprintf(oF->fStream, "P4\n# Generated by pnmdump.exe\n%i %i\n",
+            oF->width, oF->height);
+        return;
+    }
+
+    fprintf(oF->fStream,
+        "%s\n"                          // [pgm type]\n
+        "# Generated by pnmdump.exe\n"  // [comment]\n
+        "%i %i\n"                       // [width] [height]\n
+        "%i\n",                         // [max data value]\n
+        PgmTypeToStr(oF->type), oF->width, oF->height, oF->maxDataValue);
+}
+
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Writes the data from a PgmConverter's data array to a file.
+ *             Integer output types truncate and clamp the data, pfm output
+ *             keeps it at full precision.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryWritePgmData(PgmConverter *c)
+{
+    double *data = malloc(c->oF->width * sizeof(double));
+    if (data == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    // Write data[row][column] to the pgm [row][column], from the bottom row
+    // up for a pfm
+    for (int i = 0; i < c->oF->height; i++)
+    {
+        int row = c->oF->type == PF ? c->oF->height - 1 - i : i;
+        for (int col = 0; col < c->oF->width; col++)
+            data[col] = c->cArgs->getData(c, row, col);
+
+        WritePgmRow(c->oF, data);
+    }
+
+    free(data);
+    return true;
+}
+
+
+/**
+ * @brief      Writes a row of data to a pgm file at the current position. A
+ *             pbm row is packed eight pixels to a byte, most significant bit
+ *             first, with a set bit for black: a value nearer 0 than the max
+ *             value.
+ *
+ * @param      oF    The output file information.
+ * @param[in]  data  The row, oF->width samples, or oF->width pixels of
+ *                   oF->depth channels if oF->isInterleaved.
+ */
+void WritePgmRow(PgmFile *oF, const double *data)
+{
+    int count = oF->isInterleaved ? oF->width * oF->depth : oF->width;
+    int bits = 0;
+
+    for (int col = 0; col < count; col++)
+    {
+        // If the output type is pfm, write the float
+        if (oF->type == PF)
+        {
+            WriteFloat(oF->fStream, data[col]);
+            continue;
+        }
+
+        int value = EncodeSample(oF, data[col]);
+
+        // If the output type is P2
+        if (oF->type == P2)
+        {
+            // Pad with spaces unless we are on the first column of a row
+            if (col == 0)
+                fprintf(oF->fStream, "%i", value);
+            // Add a new line for the final col of a row
+            else if (col == count - 1)
+                fprintf(oF->fStream, " %i\n", value);
+            else
+                fprintf(oF->fStream, " %i", value);
+        }
+        // Else if the input type is P5 or pam, writing samples above 255 as
+        // two bytes, most significant first
+        else if (oF->type == P5 || oF->type == P7)
+        {
+            if (oF->maxDataValue > 255)
+                fputc(value >> 8, oF->fStream);
+            fputc(value & 255, oF->fStream);
+        }
+        // Else if the output type is P4, writing each byte once it is full or
+        // the row ends, when it is padded with 0 bits
+        else if (oF->type == P4)
+        {
+            bits = bits << 1 | (2 * value <= oF->maxDataValue);
+            if (col % 8 == 7 || col == count - 1)
+            {
+                fputc(bits << (7 - col % 8), oF->fStream);
+                bits = 0;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief      Converts a sample to the integer value written to a pgm or png,
+ *             clamped to the max value, and encoded from linear light if the
+ *             output has linear tables.
+ *
+ * @param      oF     The output file information.
+ * @param[in]  value  The sample value.
+ *
+ * @return     The encoded sample value.
+ */
+int EncodeSample(const PgmFile *oF, double value)
+{
+    // Look up the nearest of the table's linear light levels
+    if (oF->linear != NULL)
+    {
+        double level = value * (65535.0 / oF->maxDataValue) + 0.5;
+        return oF->linear->fromLinear[level < 0 ? 0
+            : level > 65535 ? 65535 : (int)level];
+    }
+
+    int sample = (int)value;
+    return sample < 0 ? 0 : sample > oF->maxDataValue ? oF->maxDataValue
+        : sample;
+}
+
+
+/**
+ * @brief      Writes a sample to a pfm file as a little endian 32 bit float.
+ *
+ * @param      stream  The stream to write to.
+ * @param[in]  value   The sample value.
+ */
+void WriteFloat(FILE *stream, double value)
+{
+    float sample = (float)value;
+    uint32_t bits;
+    memcpy(&bits, &sample, 4);
+
+    unsigned char bytes[4] = { bits, bits >> 8, bits >> 16, bits >> 24 };
+    fwrite(bytes, 1, 4, stream);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Writing output png                             //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Writes the output image to a file as a greyscale png. The image
+ *             is split into bands of rows which are fetched, filtered and
+ *             deflated in parallel. Each band's deflate blocks end on a byte
+ *             boundary so the bands can be stitched into a single zlib stream.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryWritePngData(PgmConverter *c)
+{
+    // Samples larger than a byte require a 16 bit png
+    int bitDepth = c->oF->maxDataValue > 255 ? 16 : 8;
+    size_t rowBytes = (size_t)c->oF->width * (bitDepth / 8) + 1;
+
+    // Split the image into bands of roughly PNG_BAND_BYTES filtered bytes
+    int bandRows = (int)(PNG_BAND_BYTES / rowBytes);
+    bandRows = bandRows < 1 ? 1 : bandRows;
+    int bandCount = (c->oF->height + bandRows - 1) / bandRows;
+
+    // Encode a few bands per thread at a time so memory use stays bounded
+    int batchSize = GetThreadCount() * 2;
+    PngBand *bands = calloc(batchSize, sizeof(PngBand));
+    if (bands == NULL)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    // Write the png signature and the header chunk
+    unsigned char header[13];
+    ByteBuffer ihdr = { header, 0, sizeof(header), 0, 0, false };
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, c->oF->fStream);
+    PutUint32(&ihdr, c->oF->width);
+    PutUint32(&ihdr, c->oF->height);
+    PutByte(&ihdr, bitDepth);
+    PutByte(&ihdr, 0);  // Colour type: greyscale
+    PutByte(&ihdr, 0);  // Compression method: deflate
+    PutByte(&ihdr, 0);  // Filter method: adaptive
+    PutByte(&ihdr, 0);  // Interlace method: none
+    WritePngChunk(c->oF->fStream, "IHDR", header, sizeof(header));
+
+    uint32_t adler = 1;
+    bool isSuccess = true;
+    for (int first = 0; first < bandCount && isSuccess; first += batchSize)
+    {
+        int count = bandCount - first < batchSize ? bandCount - first : batchSize;
+
+        // Describe each band in this batch and encode them in parallel
+        for (int i = 0; i < count; i++)
+        {
+            PngBand band = { c, (first + i) * bandRows, bandRows, bitDepth,
+                first + i == bandCount - 1, 1, 0, { NULL, 0, 0, 0, 0, false } };
+            if (band.row + band.rowCount > c->oF->height)
+                band.rowCount = c->oF->height - band.row;
+            bands[i] = band;
+
+            // The first band is prefixed by the zlib stream header
+            if (first + i == 0)
+            {
+                PutByte(&bands[i].out, 0x78);
+                PutByte(&bands[i].out, 0x01);
+            }
+        }
+        if (c->cArgs->isSerial)
+            for (int i = 0; i < count; i++)
+                EncodePngBand(bands, i);
+        else
+            RunParallel(count, EncodePngBand, bands);
+
+        // Write each band's blocks as an IDAT chunk, in order
+        for (int i = 0; i < count; i++)
+        {
+            adler = (first + i == 0) ? bands[i].adler
+                : Adler32Combine(adler, bands[i].adler, bands[i].length);
+
+            // The final band is followed by the checksum of the whole stream
+            if (bands[i].isLast)
+                PutUint32(&bands[i].out, adler);
+
+            if (bands[i].out.isFailed)
+                isSuccess = false;
+            else
+                WritePngChunk(c->oF->fStream, "IDAT",
+                    bands[i].out.bytes, bands[i].out.length);
+
+            free(bands[i].out.bytes);
+        }
+    }
+    free(bands);
+
+    if (!isSuccess)
+    {
+        fprintf(stderr, "Error, out of memory\n");
+        return false;
+    }
+
+    WritePngChunk(c->oF->fStream, "IEND", NULL, 0);
+    return true;
+}
+
+
+/**
+ * @brief      Fetches, filters and deflates one band of a png image. This is
+ *             run as a parallel job, see RunParallel.
+ *
+ * @param      arg    The array of PngBands being encoded.
+ * @param[in]  index  The index of the band to encode.
+ */
+void EncodePngBand(void *arg, int index)
+{
+    PngBand *band = (PngBand *)arg + index;
+    PgmConverter *c = band->c;
+    int bpp = band->bitDepth / 8;
+    int rowBytes = c->oF->width * bpp;
+    int fullScale = band->bitDepth == 16 ? 65535 : 255;
+
+    // Raw rows, including the row above the band which filters refer to, and
+    // a row for trying each filter on
+    unsigned char *raw = malloc((size_t)rowBytes * (band->rowCount + 1));
+    unsigned char *filtered = malloc((size_t)(rowBytes + 1) * band->rowCount);
+    unsigned char *candidate = malloc(rowBytes);
+    if (raw == NULL || filtered == NULL || candidate == NULL)
+    {
+        band->out.isFailed = true;
+        free(raw);
+        free(filtered);
+        free(candidate);
+        return;
+    }
+
+    // Fetch each row, rescaling samples to the full range of the bit depth
+    memset(raw, 0, rowBytes);
+    for (int i = (band->row == 0 ? 1 : 0); i <= band->rowCount; i++)
+    {
+        unsigned char *pixel = raw + (size_t)i * rowBytes;
+        for (int col = 0; col < c->oF->width; col++)
+        {
+            int data = EncodeSample(c->oF,
+                c->cArgs->getData(c, band->row + i - 1, col));
+            if (c->oF->maxDataValue != fullScale && c->oF->maxDataValue > 0)
+                data = (data * fullScale + c->oF->maxDataValue / 2)
+                    / c->oF->maxDataValue;
+
+            // Png samples are stored most significant byte first
+            if (bpp == 2)
+                *pixel++ = data >> 8;
+            *pixel++ = data & 0xFF;
+        }
+    }
+
+    // Filter each row against the row above it
+    for (int i = 0; i < band->rowCount; i++)
+    {
+        FilterPngRow(filtered + (size_t)i * (rowBytes + 1),
+            raw + (size_t)(i + 1) * rowBytes, raw + (size_t)i * rowBytes,
+            candidate, rowBytes, bpp);
+    }
+
+    band->length = (size_t)(rowBytes + 1) * band->rowCount;
+    band->adler = Adler32(1, filtered, band->length);
+    DeflateFixed(&band->out, filtered, band->length, band->isLast);
+
+    free(raw);
+    free(filtered);
+    free(candidate);
+}
+
+
+/**
+ * @brief      Filters a row of png data, choosing the filter type which gives
+ *             the smallest sum of absolute differences.
+ *
+ * @param      out        Output for the filter type byte then filtered row.
+ * @param[in]  row        The raw row to filter.
+ * @param[in]  prior      The raw row above, all zeros for the first row.
+ * @param      candidate  Scratch space for a filtered row, rowBytes long.
+ * @param[in]  rowBytes   The number of bytes in a raw row.
+ * @param[in]  bpp        The number of bytes per pixel.
+ */
+void FilterPngRow(unsigned char *out, const unsigned char *row,
+    const unsigned char *prior, unsigned char *candidate, int rowBytes,
+    int bpp)
+{
+    long bestScore = -1;
+
+    // Try each filter type: none, sub, up, average and paeth
+    for (int type = 0; type < 5; type++)
+    {
+        for (int i = 0; i < rowBytes; i++)
+        {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prior[i];
+            int cc = i >= bpp ? prior[i - bpp] : 0;
+
+            switch (type)
+            {
+                case 0:
+                    candidate[i] = row[i];
+                    break;
+                case 1:
+                    candidate[i] = row[i] - a;
+                    break;
+                case 2:
+                    candidate[i] = row[i] - b;
+                    break;
+                case 3:
+                    candidate[i] = row[i] - ((a + b) >> 1);
+                    break;
+                default:
+                {
+                    // Predict from whichever neighbour is closest to a+b-c
+                    int pa = abs(b - cc);
+                    int pb = abs(a - cc);
+                    int pc = abs(a + b - 2 * cc);
+                    int predictor = (pa <= pb && pa <= pc) ? a
+                        : (pb <= pc) ? b : cc;
+                    candidate[i] = row[i] - predictor;
+                    break;
+                }
+            }
+        }
+
+        // Score the filtered row by treating each byte as signed
+        long score = 0;
+        for (int i = 0; i < rowBytes; i++)
+            score += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+
+        if (bestScore < 0 || score < bestScore)
+        {
+            bestScore = score;
+            out[0] = type;
+            memcpy(out + 1, candidate, rowBytes);
+        }
+    }
+}
+
+
+/**
+ * @brief      Compresses data as deflate blocks using LZ77 hash chains and the
+ *             fixed huffman codes. Unless this is the final block the output
+ *             is byte aligned with an empty stored block, so that independently
+ *             compressed blocks can be concatenated.
+ *             Reference: https://tools.ietf.org/html/rfc1951
+ *
+ * @param      out      The buffer to append the compressed blocks to.
+ * @param[in]  in       The data to compress.
+ * @param[in]  length   The number of bytes of data.
+ * @param[in]  isFinal  True if this is the last block of the stream.
+ */
+void DeflateFixed(ByteBuffer *out, const unsigned char *in, int length,
+    bool isFinal)
+{
+    static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15,
+        17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195,
+        227, 258 };
+    static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+        2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const int distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49,
+        65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+        6145, 8193, 12289, 16385, 24577 };
+    static const int distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5,
+        5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    int *head = malloc(DEFLATE_HASH_SIZE * sizeof(int));
+    int *prev = malloc(DEFLATE_WINDOW * sizeof(int));
+    if (head == NULL || prev == NULL)
+    {
+        out->isFailed = true;
+        free(head);
+        free(prev);
+        return;
+    }
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++)
+        head[i] = -1;
+
+    // Block header: BFINAL, then BTYPE = 01 for the fixed huffman codes
+    PutBits(out, (isFinal ? 1 : 0) | (1 << 1), 3);
+
+    int pos = 0;
+    while (pos < length)
+    {
+        int bestLength = 0;
+        int bestDist = 0;
+
+        // Search the hash chain for the longest match within the window
+        if (pos + 2 < length)
+        {
+            int hash = ((in[pos] << 10) ^ (in[pos + 1] << 5) ^ in[pos + 2])
+                & (DEFLATE_HASH_SIZE - 1);
+            int maxLength = length - pos < DEFLATE_MAX_MATCH
+                ? length - pos : DEFLATE_MAX_MATCH;
+            int candidate = head[hash];
+
+            for (int chain = 0; candidate >= 0 && chain < DEFLATE_MAX_CHAIN
+                && pos - candidate <= DEFLATE_WINDOW; chain++)
+            {
+                int matchLength = 0;
+                while (matchLength < maxLength
+                    && in[candidate + matchLength] == in[pos + matchLength])
+                    matchLength++;
+
+                if (matchLength > bestLength)
+                {
+                    bestLength = matchLength;
+                    bestDist = pos - candidate;
+                    if (matchLength == maxLength)
+                        break;
+                }
+
+                // Stale links can point forwards; they end the chain
+                int next = prev[candidate & (DEFLATE_WINDOW - 1)];
+                if (next >= candidate)
+                    break;
+                candidate = next;
+            }
+        }
+
+        int advance = 1;
+        if (bestLength >= 3)
+        {
+            // Emit the length symbol 257-285 and its extra bits
+            int l = 28;
+            while (lengthBase[l] > bestLength)
+                l--;
+            int symbol = 257 + l;
+            if (symbol < 280)
+                PutHuffman(out, symbol - 256, 7);
+            else
+                PutHuffman(out, 0xC0 + symbol - 280, 8);
+            PutBits(out, bestLength - lengthBase[l], lengthExtra[l]);
+
+            // Emit the five bit distance code and its extra bits
+            int d = 29;
+            while (distBase[d] > bestDist)
+                d--;
+            PutHuffman(out, d, 5);
+            PutBits(out, bestDist - distBase[d], distExtra[d]);
+
+            advance = bestLength;
+        }
+        else if (in[pos] < 144)
+        {
+            PutHuffman(out, 0x30 + in[pos], 8);
+        }
+        else
+        {
+            PutHuffman(out, 0x190 + in[pos] - 144, 9);
+        }
+
+        // Insert every position covered into the hash chains
+        for (int end = pos + advance; pos < end; pos++)
+        {
+            if (pos + 2 < length)
+            {
+                int hash = ((in[pos] << 10) ^ (in[pos + 1] << 5) ^ in[pos + 2])
+                    & (DEFLATE_HASH_SIZE - 1);
+                prev[pos & (DEFLATE_WINDOW - 1)] = head[hash];
+                head[hash] = pos;
+            }
+        }
+    }
+
+    // End of block symbol
+    PutHuffman(out, 0, 7);
+
+    // Byte align with an empty stored block, or pad the final block
+    if (!isFinal)
+    {
+        PutBits(out, 0, 3);
+        FlushBits(out);
+        PutByte(out, 0x00);
+        PutByte(out, 0x00);
+        PutByte(out, 0xFF);
+        PutByte(out, 0xFF);
+    }
+    else
+    {
+        FlushBits(out);
+    }
+
+    free(head);
+    free(prev);
+}
+
+
+/**
+ * @brief      Writes a png chunk: its length, type, data and crc.
+ *
+ * @param      stream  The stream to write the chunk to.
+ * @param[in]  type    The four character chunk type.
+ * @param[in]  data    The chunk data.
+ * @param[in]  length  The number of bytes of chunk data.
+ */
+void WritePngChunk(FILE *stream, const char *type,
+    const unsigned char *data, size_t length)
+{
+    unsigned char prefix[8];
+    ByteBuffer b = { prefix, 0, sizeof(prefix), 0, 0, false };
+    PutUint32(&b, (uint32_t)length);
+    memcpy(prefix + 4, type, 4);
+
+    // The crc covers the chunk type and data but not the length
+    uint32_t crc = Crc32(0, prefix + 4, 4);
+    crc = Crc32(crc, data, length);
+
+    fwrite(prefix, 1, 8, stream);
+    if (length > 0)
+        fwrite(data, 1, length, stream);
+
+    b.length = 0;
+    PutUint32(&b, crc);
+    fwrite(prefix, 1, 4, stream);
+}
+
+
+/**
+ * @brief      Updates a crc32 checksum, as used by png chunks.
+ *
+ * @param[in]  crc     The crc of the preceding data, 0 to start.
+ * @param[in]  data    The data to add to the checksum.
+ * @param[in]  length  The number of bytes of data.
+ *
+ * @return     The updated crc.
+ */
+uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t length)
+{
+    static uint32_t table[256];
+    static bool isTableSet = false;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    // Build the lookup table the first time round, under a lock as tiles
+    // are written by parallel jobs
+    pthread_mutex_lock(&lock);
+    if (!isTableSet)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t value = n;
+            for (int k = 0; k < 8; k++)
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            table[n] = value;
+        }
+        isTableSet = true;
+    }
+    pthread_mutex_unlock(&lock);
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+/**
+ * @brief      Updates an adler32 checksum, as used by zlib streams.
+ *
+ * @param[in]  adler   The adler32 of the preceding data, 1 to start.
+ * @param[in]  data    The data to add to the checksum.
+ * @param[in]  length  The number of bytes of data.
+ *
+ * @return     The updated checksum.
+ */
+uint32_t Adler32(uint32_t adler, const unsigned char *data, size_t length)
+{
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+
+    // Sums can run for 5552 bytes before the modulo is needed
+    while (length > 0)
+    {
+        size_t block = length < 5552 ? length : 5552;
+        length -= block;
+        while (block--)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+
+/**
+ * @brief      Combines the adler32 checksums of two consecutive pieces of data
+ *             into the checksum of their concatenation.
+ *
+ * @param[in]  adler1   The checksum of the first piece.
+ * @param[in]  adler2   The checksum of the second piece.
+ * @param[in]  length2  The number of bytes in the second piece.
+ *
+ * @return     The combined checksum.
+ */
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2)
+{
+    uint32_t rem = length2 % 65521;
+    uint32_t a = adler1 & 0xFFFF;
+    uint32_t b = (rem * a) % 65521;
+
+    a += (adler2 & 0xFFFF) + 65521 - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+    a %= 65521;
+    b %= 65521;
+
+    return (b << 16) | a;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                               Data retrieval                               //
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief      Returns the original pixel data for a given row and column.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ * @param[in]  row   The 0-indexed row where the pixel is being written to.
+ * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ *
+ * @return     The integer value of the pixel to be written at [row, col].
+ */
+double GetData(PgmConverter *c, int row, int col)
+{
+    return GetInputSample(c, row, col);
+}
+
+
+/**
+ * @brief      Returns an input sample, from the data raster, a tile, or the
+ *             rows pulled through a chain node. Positions outside the image are
+ *             clamped to the nearest edge.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ * @param[in]  row   The 0-indexed input row.
+ * @param[in]  col   The 0-indexed input column.
+ *
+ * @return     The value of the input sample at [row, col].
+ */
+double GetInputSample(PgmConverter *c, int row, int col)
+{
+    if (c->tile != NULL)
+        return GetTileSample(c->tile, row, col);
+    if (c->source == NULL)
+        return GetSample(&c->data, row, col);
+
+    col = col < 0 ? 0 : col >= c->iF->width ? c->iF->width - 1 : col;
+    return GetUpstreamRow(c->source, row)[col];
+}
+
+
+/**
+ * @brief      Returns the pixel data for a given row and column. The output row
+ *             and column has been scaled by a factor, and so the data
+ *             corresponding to the output row and column divided by this factor
+ *             is returned.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ * @param[in]  row   The 0-indexed row where the pixel is being written to.
+ * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ *
+ * @return     The integer value of the pixel to be written at [row, col].
+ */
+double GetScaledNnData(PgmConverter *c, int row, int col)
+{
+    const ScalePlan *p = c->sArgs->plan;
+    return GetInputSample(c, p->rows.index[row], p->cols.index[col]);
+}
+
+
+/**
+ * @brief      Returns the pixel data for a given row and column. The output
+ *             dimensions have been scaled up, generating new rows and columns
+ *             inbetween the original. The data for these new rows and columns
+ *             is generated using linear or bilinear interpolation. If data is
+ *             not available for interpolation (i.e. at picture borders) then it
+ *             is extrapolated from the existing data. This code is pretty messy
+ *             and DRP could be enforced but I'm super out of time.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ * @param[in]  row   The 0-indexed row where the pixel is being written to.
+ * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ *
+ * @return     The integer value of the pixel to be written at [row, col].
+ */
+double GetScaledUpBlData(PgmConverter *c, int row, int col)
+{
+    /**
+     * When scaling up, subpixels in new rows/columns (subrows/columns) are
+     * generated using interpolation. For example, x2 scaling:
+     * 
+     *                0 1 2 3             0         1         2       3
+     *   0 1        0 a ? b ?        0    a      (a+b)/2      b       b
+     * 0 a b   =>   1 ? ? ? ?   =>   1 (a+x)/2 (a+b+x+y)/4 (b+y)/2 (b+y)/2
+     * 1 x y        2 x ? y ?        2    x      (x+y)/2      y       y
+     *              3 ? ? ? ?        3    x      (x+y)/2      y       y
+     * 
+     *                                 subcolumn         subcolumn
+     *                           0        1        2        3    .. 
+     *   0 1..              0    a     subpixel    b     subpixel..
+     * 0 a b..   =>  subrow 1 subpixel subpixel subpixel subpixel..
+     * 1 x y..              2    x     subpixel    y     subpixel..
+     * : : :         subrow 3 subpixel subpixel subpixel subpixel..
+     *                      :    :        :        :        :
+    */
+
+    // Look up the source position of the row and column in the plan
+    const ScalePlan *p = c->sArgs->plan;
+    int srcRow = p->rows.index[row];
+    int srcCol = p->cols.index[col];
+    double rowFraction = p->rows.fraction[row];
+    double colFraction = p->cols.fraction[col];
+
+    // If at top left corner, extrapolate row and column data
+    if (row < (int)(c->sArgs->hScale / 2)
+        && col < (int)(c->sArgs->wScale / 2))
+    {
+        return BilinearInterpolate(
+            rowFraction,
+            colFraction,
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow + 1, srcCol + 1),
+                c->iF->maxDataValue),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow + 1, srcCol),
+                c->iF->maxDataValue),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow, srcCol + 1),
+                c->iF->maxDataValue),
+            GetInputSample(c, srcRow, srcCol));
+    }
+    // If at top right corner, extrapolate row and column data
+    else if (row < (int)(c->sArgs->hScale / 2)
+        && col > c->oF->width - (int)((c->sArgs->wScale + 1) / 2))
+    {
+        return BilinearInterpolate(
+            rowFraction,
+            colFraction,
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow + 1, srcCol),
+                c->iF->maxDataValue),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow + 1, srcCol - 1),
+                c->iF->maxDataValue),
+            GetInputSample(c, srcRow, srcCol),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow, srcCol - 1),
+                c->iF->maxDataValue));
+    }
+    // If at bottom left corner, extrapolate row and column data
+    else if (row > c->oF->height - (int)((c->sArgs->hScale + 1) / 2)
+        && col < (int)(c->sArgs->wScale / 2))
+    {
+        return BilinearInterpolate(
+            rowFraction,
+            colFraction,
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow, srcCol + 1),
+                c->iF->maxDataValue),
+            GetInputSample(c, srcRow, srcCol),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow - 1, srcCol + 1),
+                c->iF->maxDataValue),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow - 1, srcCol),
+                c->iF->maxDataValue));
+    }
+    // If at bottom right corner, extrapolate row and column data
+    else if (row > c->oF->height - (int)((c->sArgs->hScale + 1) / 2)
+        && col > c->oF->width - (int)((c->sArgs->wScale + 1) / 2))
+    {
+        return BilinearInterpolate(
+            rowFraction,
+            colFraction,
+            GetInputSample(c, srcRow, srcCol),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow, srcCol - 1),
+                c->iF->maxDataValue),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow - 1, srcCol),
+                c->iF->maxDataValue),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow - 1, srcCol + 1),
+                c->iF->maxDataValue));
+    }
+    // If at the top picture edge, extrapolate the row data for interpolation
+    else if (row < (int)(c->sArgs->hScale / 2))
+    {
+        return LinearInterpolate(
+            rowFraction,
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow + 1, srcCol),
+                c->iF->maxDataValue),
+            GetInputSample(c, srcRow, srcCol));
+    }
+    // If at the bottom picture edge, extrapolate the row data for interpolation
+    else if (row > c->oF->height - (int)((c->sArgs->hScale + 1) / 2))
+    {
+        return LinearInterpolate(
+            rowFraction,
+            GetInputSample(c, srcRow, srcCol),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow - 1, srcCol),
+                c->iF->maxDataValue));
+    }
+    // If at the left picture edge, extrapolate the column data for interpolation
+    else if (col < (int)(c->sArgs->wScale / 2))
+    {
+        return LinearInterpolate(
+            colFraction,
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow, srcCol + 1),
+                c->iF->maxDataValue),
+            GetInputSample(c, srcRow, srcCol));
+    }
+    // If at the right picture edge, extrapolate the column data for interpolation
+    else if (col > c->oF->width - (int)((c->sArgs->wScale + 1) / 2))
+    {
+        return LinearInterpolate(
+            colFraction,
+            GetInputSample(c, srcRow, srcCol),
+            ExtrapolateLinear(
+                GetInputSample(c, srcRow, srcCol),
+                GetInputSample(c, srcRow, srcCol - 1),
+                c->iF->maxDataValue));
+    }
+    // Otherwise we're on a subrowcolumn => Bilinearly interpolate
+    else
+    {
+        int innerRow = p->rows.innerIndex[row];
+        int innerCol = p->cols.innerIndex[col];
+
+        return BilinearInterpolate(
+            p->cols.innerFraction[col],
+            p->rows.innerFraction[row],
+            GetInputSample(c, innerRow, innerCol),
+            GetInputSample(c, innerRow + 1, innerCol),
+            GetInputSample(c, innerRow, innerCol + 1),
+            GetInputSample(c, innerRow + 1, innerCol + 1));
+    }
+}
+
+
+/**
+ * @brief      Returns the pixel data for a given row and column. The output
+ *             dimensions have been scaled down, meaning output rows and columns
+ *             are generated from combined input rows and columns. The data is
+ *             calculated from the average value of the original pixels.
+ *
+ * @param      c     A PgmConverter detailing conversion state information.
+ * @param[in]  row   The 0-indexed row where the pixel is being written to.
+ * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ *
+ * @return     The integer value of the pixel to be written at [row, col].
+ */
+double GetScaledDownBoxData(PgmConverter *c, int row, int col)
+{
+    /**
+     * For example, scaling a 4x4 down by a factor of 2:
+     * 
+     *   0 1 2 3        
+     * 0 a b c d               0           1     
+     * 1 e f g h   =>   0 (a+b+e+f)/4 (c+d+g+h)/4
+     * 2 i j k l        1 (i+j+m+n)/4 (k+l+o+p)/4
+     * 3 m n o p
+    */
+
+    const ScalePlan *p = c->sArgs->plan;
+    double data = 0;
+    int count = 0;
+
+    // For each row and column to be combined into one
+    for (int rs = 0; rs < p->rows.coverage; rs++)
+    {
+        for (int cs = 0; cs < p->cols.coverage; cs++)
+        {
+            // Sum the pixel data for each pixel in the original set.
+            data += GetInputSample(c, p->rows.index[row] + rs, p->cols.index[col] + cs);
+            count++;
+        }
+
+    }
+
+    // Return the average pixel value, which integer outputs truncate
+    return data / count;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                               Geometry plans                               //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Returns the plan for a scaling operation, building it the first
+ *             time the operation is seen. Plans are cached, so repeated
+ *             conversions of same sized images share one. Once the cache is
+ *             full the least recently used plan is replaced, and rebuilt if it
+ *             is needed again.
+ *
+ * @param[in]  getData  The data retrieval function the plan is for.
+ * @param[in]  iF       The input dimensions.
+ * @param[in]  oF       The scaled output dimensions.
+ * @param[in]  sArgs    The scale factors.
+ *
+ * @return     The plan, or NULL if out of memory.
+ */
+const ScalePlan *GetScalePlan(double (*getData)(PgmConverter *c, int row, int col),
+    const PgmFile *iF, const PgmFile *oF, const ScaleArgs *sArgs)
+{
+    static ScalePlan *plans[PLAN_CACHE_SIZE];
+    static uint64_t lastUses[PLAN_CACHE_SIZE];
+    static uint64_t useCount = 0;
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    ScalePlan key = { getData, iF->width, iF->height, oF->width, oF->height,
+        sArgs->hScale, sArgs->wScale };
+
+    // Hash the key, FNV-1a over its fields
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t fields[7] = { (uint64_t)(uintptr_t)getData, (uint64_t)key.inWidth,
+        (uint64_t)key.inHeight, (uint64_t)key.outWidth, (uint64_t)key.outHeight };
+    memcpy(&fields[5], &key.hScale, sizeof(double));
+    memcpy(&fields[6], &key.wScale, sizeof(double));
+    for (int i = 0; i < 7; i++)
+        hash = (hash ^ fields[i]) * 1099511628211ULL;
+
+    // Probe from the hashed slot for the plan, or the empty slot to build it
+    // in, noting the least recently used slot in case every slot is taken.
+    // Slots are never emptied, so a full cache is probed in whole.
+    pthread_mutex_lock(&mutex);
+    int found = -1;
+    int oldest = -1;
+    for (int i = 0; i < PLAN_CACHE_SIZE && found < 0; i++)
+    {
+        int index = (hash + i) % PLAN_CACHE_SIZE;
+        ScalePlan *slot = plans[index];
+        if (slot == NULL
+            || (slot->getData == key.getData
+            && slot->inWidth == key.inWidth
+            && slot->inHeight == key.inHeight
+            && slot->outWidth == key.outWidth
+            && slot->outHeight == key.outHeight
+            && slot->hScale == key.hScale && slot->wScale == key.wScale))
+            found = index;
+        else if (oldest < 0 || lastUses[index] < lastUses[oldest])
+            oldest = index;
+    }
+
+    // Replace the least recently used plan if the cache is full
+    if (found < 0)
+    {
+        found = oldest;
+        FreeScalePlan(plans[found]);
+        plans[found] = NULL;
+    }
+
+    if (plans[found] == NULL)
+        plans[found] = TryBuildScalePlan(&key);
+    lastUses[found] = ++useCount;
+    ScalePlan *plan = plans[found];
+    pthread_mutex_unlock(&mutex);
+
+    if (plan == NULL)
+        fprintf(stderr, "Error, out of memory\n");
+    return plan;
+}
+
+
+/**
+ * @brief      Builds a scaling plan, tabulating the source position of every
+ *             output row and column.
+ *
+ * @param[in]  key   The plan's operation, dimensions and scale factors.
+ *
+ * @return     The plan, or NULL if out of memory.
+ */
+ScalePlan *TryBuildScalePlan(const ScalePlan *key)
+{
+    ScalePlan *plan = malloc(sizeof(ScalePlan));
+    if (plan == NULL)
+        return NULL;
+
+    *plan = *key;
+    if (!TryBuildScaleAxis(&plan->rows, key->outHeight, key->hScale)
+        || !TryBuildScaleAxis(&plan->cols, key->outWidth, key->wScale))
+    {
+        FreeScalePlan(plan);
+        return NULL;
+    }
+
+    return plan;
+}
+
+
+/**
+ * @brief      Frees a scaling plan and its tables.
+ *
+ * @param      plan  The plan to free, or NULL.
+ */
+void FreeScalePlan(ScalePlan *plan)
+{
+    if (plan == NULL)
+        return;
+
+    FreeScaleAxis(&plan->rows);
+    FreeScaleAxis(&plan->cols);
+    free(plan);
+}
+
+
+/**
+ * @brief      Tabulates the source positions of the rows or columns of a
+ *             scaled image, as the data retrieval functions compute them.
+ *
+ * @param      axis    The axis to fill.
+ * @param[in]  length  The number of output rows or columns.
+ * @param[in]  scale   The scale factor along the axis.
+ *
+ * @return     Returns true when successful, false if out of memory.
+ */
+bool TryBuildScaleAxis(ScaleAxis *axis, int length, double scale)
+{
+    axis->index = malloc(length * sizeof(int));
+    axis->fraction = malloc(length * sizeof(double));
+    axis->innerIndex = malloc(length * sizeof(int));
+    axis->innerFraction = malloc(length * sizeof(double));
+    if (axis->index == NULL || axis->fraction == NULL
+        || axis->innerIndex == NULL || axis->innerFraction == NULL)
+        return false;
+
+    // Box scaling covers this many source samples per output sample
+    axis->coverage = 0;
+    while (axis->coverage < 1 / scale)
+        axis->coverage++;
+
+    // Bilinear interpolation between edges is offset by half a source sample
+    for (int i = 0; i < length; i++)
+    {
+        int inner = i - (int)(scale / 2);
+        axis->index[i] = (int)(i / scale);
+        axis->fraction[i] = (i / scale) - (int)(i / scale);
+        axis->innerIndex[i] = (int)(inner / scale);
+        axis->innerFraction[i] = (inner / scale) - (int)(inner / scale);
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief      Frees the tables of a scaling plan axis.
+ *
+ * @param      axis  The axis.
+ */
+void FreeScaleAxis(ScaleAxis *axis)
+{
+    free(axis->index);
+    free(axis->fraction);
+    free(axis->innerIndex);
+    free(axis->innerFraction);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                              Data processing                               //
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief      Extrapolates the pixel value for a row or column out of bounds of
+ *             the original data set.
+ *
+ * @param[in]  x1    The border pixel value.
+ * @param[in]  x2    The pixel value one position deeper into the image.
+ * @param[in]  max   The maximum pixel value.
+ *
+ * @return     The extrpolated pixel value, within the range [0, max]
+ */
+double ExtrapolateLinear(double x1, double x2, double max)
+{
+    double x0 = x1 - (x2 - x1);
+    return x0 > max ? max : x0 < 0 ? 0 : x0;
+}
+
+
+/**
+ * @brief      Linearly interpolates the various parameters. It is assumed
+ *             that the interval [x1, x2]  has been scaled such that x1 = 0, and
+ *             x2 = 1.
+ *             Reference: https://en.wikipedia.org/wiki/Linear_interpolation
+ *
+ * @param[in]  x     The value of x for which to estimate f(x).
+ * @param[in]  fx1   The value of f(x) at x = x1 = 0.
+ * @param[in]  fx2   The value of f(x) at x = x2.
+ *
+ * @return     Returns the rounded down estimation of f(x) at x.
+ */
+double LinearInterpolate(double x, double fx1, double fx2)
+{
+    return ((fx1 * (1 - x)) + (fx2 * (x)));
+}
+
+
+/**
+ * @brief      Bilinearly interpolates the various parameters. It is assumed
+ *             that the interval [x1, x2]  has been scaled such that x1 = 0, and
+ *             x2 = 1.
+ *             Reference: https://en.wikipedia.org/wiki/Bilinear_interpolation
+ *
+ * @param[in]  x      The value of x for which to estimate f(x,y).
+ * @param[in]  y      The value of y for which to estimate f(x,y).
+ * @param[in]  dx     The change of x over the itnerval [x1, x2]. This function
+ *                    assumes that x1 = 0 and x2 has been scaled appropriately.
+ * @param[in]  dy     The change of y over the itnerval [y1, y2]. This function
+ *                    assumes that y1 = 0 and y2 has been scaled appropriately.
+ * @param[in]  fxy11  The value of f(x,y) at x = x1 and y = y1.
+ * @param[in]  fxy12  The value of f(x,y) at x = x1 and y = y2.
+ * @param[in]  fxy21  The value of f(x,y) at x = x2 and y = y1.
+ * @param[in]  fxy22  The value of f(x,y) at x = x2 and y = y2.
+ *
+ * @return     Returns the rounded down estimation of f(x,y) at x,y.
+ */
+double BilinearInterpolate(double x, double y, 
+    double fxy11, double fxy12, double fxy21, double fxy22)
+{
+    return LinearInterpolate(y,
+        LinearInterpolate(x, fxy11, fxy21),
+        LinearInterpolate(x, fxy12, fxy22));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Raster management                              //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Allocates the pixels of a raster.
+ *
+ * @param      r           The raster to allocate.
+ * @param[in]  width       The number of columns.
+ * @param[in]  height      The number of rows.
+ * @param[in]  sampleType  How each sample is stored.
+ *
+ * @return     Returns true when successful, false otherwise.
+ */
+bool TryAllocateRaster(Raster *r, int width, int height,
+    enum SampleType sampleType)
+{
+    r->width = width;
+    r->height = height;
+    r->sampleType = sampleType;
+    r->pixels = calloc((size_t)width * height, GetSampleSize(sampleType));
+
+    return r->pixels != NULL;
+}
+
+
+/**
+ * @brief      Frees the pixels of a raster.
+ *
+ * @param      r     The raster to free.
+ */
+void FreeRaster(Raster *r)
+{
+    free(r->pixels);
+    r->pixels = NULL;
+}
+
+
+/**
+ * @brief      Returns a sample of a raster. Positions outside the raster are
+ *             clamped to its edge.
+ *
+ * @param[in]  r     The raster to read.
+ * @param[in]  row   The 0-indexed row of the sample.
+ * @param[in]  col   The 0-indexed column of the sample.
+ *
+ * @return     The sample value.
+ */
+double GetSample(const Raster *r, int row, int col)
+{
+    row = row < 0 ? 0 : row >= r->height ? r->height - 1 : row;
+    col = col < 0 ? 0 : col >= r->width ? r->width - 1 : col;
+    size_t i = (size_t)row * r->width + col;
+
+    switch (r->sampleType)
+    {
+        case SAMPLE_U8:
+            return ((unsigned char *)r->pixels)[i];
+        case SAMPLE_U16:
+            return ((uint16_t *)r->pixels)[i];
+        case SAMPLE_F64:
+            return ((double *)r->pixels)[i];
+        default:
+            return ((float *)r->pixels)[i];
+    }
+}
+
+
+/**
+ * @brief      Sets a sample of a raster.
+ *
+ * @param      r      The raster to write.
+ * @param[in]  row    The 0-indexed row of the sample.
+ * @param[in]  col    The 0-indexed column of the sample.
+ * @param[in]  value  The sample value, which must fit the sample type.
+ */
+void SetSample(Raster *r, int row, int col, double value)
+{
+    size_t i = (size_t)row * r->width + col;
+
+    switch (r->sampleType)
+    {
+        case SAMPLE_U8:
+            ((unsigned char *)r->pixels)[i] = (unsigned char)value;
+            break;
+        case SAMPLE_U16:
+            ((uint16_t *)r->pixels)[i] = (uint16_t)value;
+            break;
+        case SAMPLE_F64:
+            ((double *)r->pixels)[i] = value;
+            break;
+        default:
+            ((float *)r->pixels)[i] = (float)value;
+            break;
+    }
+}
+
+
+/**
+ * @brief      Returns the number of bytes used to store a sample.
+ *
+ * @param[in]  sampleType  The sample type.
+ *
+ * @return     The sample size in bytes.
+ */
+size_t GetSampleSize(enum SampleType sampleType)
+{
+    static const size_t sampleSize[] = { 1, 2, 4, 8 };
+    return sampleSize[sampleType];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Raster transforms                              //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Changes the orientation of a raster in place. Rotations by 90 and
+ *             270 degrees are a transpose followed by a flip.
+ *
+ * @param      r            The raster to reorient.
+ * @param[in]  orientation  The orientation change to apply.
+ *
+ * @return     Returns true when successful, false if out of memory.
+ */
+bool TryOrientRaster(Raster *r, enum Orientation orientation)
+{
+    switch (orientation)
+    {
+        case ORIENT_TRANSPOSE:
+            return TryTransposeRaster(r);
+        case ORIENT_ROTATE90:
+            if (!TryTransposeRaster(r))
+                return false;
+            FlipRasterHorizontal(r);
+            return true;
+        case ORIENT_ROTATE180:
+            RotateRaster180(r);
+            return true;
+        case ORIENT_ROTATE270:
+            if (!TryTransposeRaster(r))
+                return false;
+            FlipRasterVertical(r);
+            return true;
+        case ORIENT_FLIP_H:
+            FlipRasterHorizontal(r);
+            return true;
+        case ORIENT_FLIP_V:
+            FlipRasterVertical(r);
+            return true;
+        case ORIENT_ANTI_TRANSPOSE:
+            if (!TryTransposeRaster(r))
+                return false;
+            RotateRaster180(r);
+            return true;
+        default:
+            return true;
+    }
+}
+
+
+/**
+ * @brief      Finds the single orientation change equal to applying one change
+ *             and then another.
+ *
+ * @param[in]  first   The change applied first.
+ * @param[in]  second  The change applied second.
+ *
+ * @return     The combined orientation change.
+ */
+enum Orientation ComposeOrientations(enum Orientation first,
+    enum Orientation second)
+{
+    // Each change as the matrix { a, b, c, d } which moves a pixel at (x, y)
+    // from the centre, y down, to (a x + b y, c x + d y)
+    static const int matrices[8][4] = {
+        [ORIENT_IDENTITY] = { 1, 0, 0, 1 },
+        [ORIENT_TRANSPOSE] = { 0, 1, 1, 0 },
+        [ORIENT_ROTATE90] = { 0, -1, 1, 0 },
+        [ORIENT_ROTATE180] = { -1, 0, 0, -1 },
+        [ORIENT_ROTATE270] = { 0, 1, -1, 0 },
+        [ORIENT_FLIP_H] = { -1, 0, 0, 1 },
+        [ORIENT_FLIP_V] = { 1, 0, 0, -1 },
+        [ORIENT_ANTI_TRANSPOSE] = { 0, -1, -1, 0 }
+    };
+    const int *m1 = matrices[first];
+    const int *m2 = matrices[second];
+    int product[4] = {
+        m2[0] * m1[0] + m2[1] * m1[2], m2[0] * m1[1] + m2[1] * m1[3],
+        m2[2] * m1[0] + m2[3] * m1[2], m2[2] * m1[1] + m2[3] * m1[3]
+    };
+
+    // The group is closed, so the product is one of the eight
+    for (int i = ORIENT_IDENTITY; i <= ORIENT_ANTI_TRANSPOSE; i++)
+        if (!memcmp(product, matrices[i], sizeof(product)))
+            return i;
+    return ORIENT_IDENTITY;
+}
+
+
+/**
+ * @brief      Transposes a raster in place, reflecting it in the line y=-x.
+ *             Square rasters are transposed by swapping blocks either side of
+ *             the diagonal. Other rasters are transposed by following the
+ *             cycles of the index permutation, which needs one bit per pixel
+ *             to mark the samples that have been moved.
+ *
+ * @param      r     The raster to transpose.
+ *
+ * @return     Returns true when successful, false if out of memory.
+ */
+bool TryTransposeRaster(Raster *r)
+{
+    size_t size = GetSampleSize(r->sampleType);
+    unsigned char *pixels = r->pixels;
+
+    if (r->width == r->height)
+    {
+        // Swap each block above the diagonal with its mirror below it, so
+        // that both blocks stay in cache while they are swapped
+        int n = r->width;
+        for (int blockRow = 0; blockRow < n; blockRow += TRANSPOSE_BLOCK)
+        {
+            for (int blockCol = blockRow; blockCol < n; blockCol += TRANSPOSE_BLOCK)
+            {
+                int rowEnd = blockRow + TRANSPOSE_BLOCK < n
+                    ? blockRow + TRANSPOSE_BLOCK : n;
+                int colEnd = blockCol + TRANSPOSE_BLOCK < n
+                    ? blockCol + TRANSPOSE_BLOCK : n;
+
+                for (int row = blockRow; row < rowEnd; row++)
+                {
+                    // Diagonal blocks only swap the half above the diagonal
+                    int col = blockCol == blockRow ? row + 1 : blockCol;
+                    for (; col < colEnd; col++)
+                        SwapBytes(pixels + ((size_t)row * n + col) * size,
+                            pixels + ((size_t)col * n + row) * size, size);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // The sample at index i = row * width + col moves to col * height + row,
+    // i.e. to (i * height) mod (count - 1), with the last sample fixed
+    size_t count = (size_t)r->width * r->height;
+    unsigned char *isMoved = calloc(count / 8 + 1, 1);
+    if (isMoved == NULL)
+        return false;
+
+    unsigned char carried[8];
+    unsigned char displaced[8];
+    for (size_t start = 1; start + 1 < count; start++)
+    {
+        if (isMoved[start / 8] & (1 << (start % 8)))
+            continue;
+
+        // Carry the start sample around its cycle, dropping it into each
+        // destination and picking up the sample it displaces
+        memcpy(carried, pixels + start * size, size);
+        size_t i = start;
+        do
+        {
+            i = (size_t)(((uint64_t)i * r->height) % (count - 1));
+            memcpy(displaced, pixels + i * size, size);
+            memcpy(pixels + i * size, carried, size);
+            memcpy(carried, displaced, size);
+            isMoved[i / 8] |= 1 << (i % 8);
+        }
+        while (i != start);
+    }
+    free(isMoved);
+
+    int width = r->width;
+    r->width = r->height;
+    r->height = width;
+    return true;
+}
+
+
+/**
+ * @brief      Flips a raster horizontally in place, reversing each row.
+ *
+ * @param      r     The raster to flip.
+ */
+void FlipRasterHorizontal(Raster *r)
+{
+    size_t size = GetSampleSize(r->sampleType);
+    size_t rowBytes = (size_t)r->width * size;
+
+    for (int row = 0; row < r->height; row++)
+        ReverseSamples((unsigned char *)r->pixels + row * rowBytes, r->width, size);
+}
+
+
+/**
+ * @brief      Flips a raster vertically in place, swapping rows top to bottom.
+ *
+ * @param      r     The raster to flip.
+ */
+void FlipRasterVertical(Raster *r)
+{
+    size_t rowBytes = (size_t)r->width * GetSampleSize(r->sampleType);
+    unsigned char *pixels = r->pixels;
+
+    for (int row = 0; row < r->height / 2; row++)
+        SwapBytes(pixels + row * rowBytes,
+            pixels + (r->height - 1 - (size_t)row) * rowBytes, rowBytes);
+}
+
+
+/**
+ * @brief      Rotates a raster 180 degrees in place. As the rows are stored
+ *             contiguously this is a reversal of the whole sample array.
+ *
+ * @param      r     The raster to rotate.
+ */
+void RotateRaster180(Raster *r)
+{
+    ReverseSamples(r->pixels, (size_t)r->width * r->height,
+        GetSampleSize(r->sampleType));
+}
+
+
+/**
+ * @brief      Reverses the order of an array of samples in place. Byte samples
+ *             are reversed eight at a time by swapping byte reversed words from
+ *             either end of the array.
+ *
+ * @param      samples  The samples to reverse.
+ * @param[in]  count    The number of samples.
+ * @param[in]  size     The size of each sample in bytes.
+ */
+void ReverseSamples(void *samples, size_t count, size_t size)
+{
+    unsigned char *left = samples;
+    unsigned char *right = left + count * size;
+
+    if (size == 1)
+    {
+        // Swap whole words while at least two words remain between the ends
+        while (right - left >= 16)
+        {
+            uint64_t a;
+            uint64_t b;
+            right -= 8;
+            memcpy(&a, left, 8);
+            memcpy(&b, right, 8);
+            a = ReverseWordBytes(a);
+            b = ReverseWordBytes(b);
+            memcpy(left, &b, 8);
+            memcpy(right, &a, 8);
+            left += 8;
+        }
+    }
+
+    // Reverse whatever remains one sample at a time
+    while (right - left >= (ptrdiff_t)(2 * size))
+    {
+        right -= size;
+        SwapBytes(left, right, size);
+        left += size;
+    }
 }
 
 
 /**
- * @brief      Returns the pixel data for a given row and column. The data
- *             returned is for if the array were rotated 90 degrees clockwise.
+ * @brief      Reverses the order of the bytes of a 64 bit word.
  *
- * @param      c     A PgmConverter detailing conversion state information.
- * @param[in]  row   The 0-indexed row where the pixel is being written to.
- * @param[in]  col   The 0-indexed column where the pixel is being written to.
+ * @param[in]  word  The word to reverse.
  *
- * @return     The integer value of the pixel to be written at [row, col].
+ * @return     The byte reversed word.
  */
-int GetRotated90Data(PgmConverter *c, int row, int col)
+uint64_t ReverseWordBytes(uint64_t word)
 {
-    return c->data[(c->oF->width - 1) - col][row];
+#if defined(__GNUC__)
+    return __builtin_bswap64(word);
+#else
+    word = ((word & 0x00FF00FF00FF00FFull) << 8) | ((word >> 8) & 0x00FF00FF00FF00FFull);
+    word = ((word & 0x0000FFFF0000FFFFull) << 16) | ((word >> 16) & 0x0000FFFF0000FFFFull);
+    return (word << 32) | (word >> 32);
+#endif
 }
 
 
 /**
- * @brief      Returns the pixel data for a given row and column. The output row
- *             and column has been scaled by a factor, and so the data
- *             corresponding to the output row and column divided by this factor
- *             is returned.
+ * @brief      Swaps two non-overlapping runs of bytes, a chunk at a time
+ *             through a small stack buffer.
  *
- * @param      c     A PgmConverter detailing conversion state information.
- * @param[in]  row   The 0-indexed row where the pixel is being written to.
- * @param[in]  col   The 0-indexed column where the pixel is being written to.
- *
- * @return     The integer value of the pixel to be written at [row, col].
+ * @param      a       The first run of bytes.
+ * @param      b       The second run of bytes.
+ * @param[in]  length  The number of bytes in each run.
  */
-int GetScaledNnData(PgmConverter *c, int row, int col)
+void SwapBytes(unsigned char *a, unsigned char *b, size_t length)
 {
-    return c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)];
+    unsigned char chunk[256];
+
+    while (length > 0)
+    {
+        size_t n = length < sizeof(chunk) ? length : sizeof(chunk);
+        memcpy(chunk, a, n);
+        memcpy(a, b, n);
+        memcpy(b, chunk, n);
+        a += n;
+        b += n;
+        length -= n;
+    }
 }
 
 
-/**
- * @brief      Returns the pixel data for a given row and column. The output
- *             dimensions have been scaled up, generating new rows and columns
- *             inbetween the original. The data for these new rows and columns
- *             is generated using linear or bilinear interpolation. If data is
- *             not available for interpolation (i.e. at picture borders) then it
- *             is extrapolated from the existing data. This code is pretty messy
- *             and DRP could be enforced but I'm super out of time.
+////////////////////////////////////////////////////////////////////////////////
+//                             Stream management                              //
+////////////////////////////////////////////////////////////////////////////////
+
+/*-------------------------------------------------------------------------*//**
+ * @brief      Attempts to open input and output streams of a PgmConverter.
  *
  * @param      c     A PgmConverter detailing conversion state information.
- * @param[in]  row   The 0-indexed row where the pixel is being written to.
- * @param[in]  col   The 0-indexed column where the pixel is being written to.
  *
- * @return     The integer value of the pixel to be written at [row, col].
+ * @return     Returns true when successful, false otherwise.
  */
-int GetScaledUpBlData(PgmConverter *c, int row, int col)
+bool TryOpenStreams(PgmConverter *c)
 {
-    /**
-     * When scaling up, subpixels in new rows/columns (subrows/columns) are
-     * generated using interpolation. For example, x2 scaling:
-     * 
-     *                0 1 2 3             0         1         2       3
-     *   0 1        0 a ? b ?        0    a      (a+b)/2      b       b
-     * 0 a b   =>   1 ? ? ? ?   =>   1 (a+x)/2 (a+b+x+y)/4 (b+y)/2 (b+y)/2
-     * 1 x y        2 x ? y ?        2    x      (x+y)/2      y       y
-     *              3 ? ? ? ?        3    x      (x+y)/2      y       y
-     * 
-     *                                 subcolumn         subcolumn
-     *                           0        1        2        3    .. 
-     *   0 1..              0    a     subpixel    b     subpixel..
-     * 0 a b..   =>  subrow 1 subpixel subpixel subpixel subpixel..
-     * 1 x y..              2    x     subpixel    y     subpixel..
-     * : : :         subrow 3 subpixel subpixel subpixel subpixel..
-     *                      :    :        :        :        :
-    */
-
-    // If at top left corner, extrapolate row and column data
-    if (row < (int)(c->sArgs->hScale / 2)
-        && col < (int)(c->sArgs->wScale / 2))
-    {
-        return (int)BilinearInterpolate(
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale) + 1]),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale)]),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) + 1]),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)]);
-    }
-    // If at top right corner, extrapolate row and column data
-    else if (row < (int)(c->sArgs->hScale / 2)
-        && col > c->oF->width - (int)((c->sArgs->wScale + 1) / 2))
-    {
-        return (int)BilinearInterpolate(
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale)]),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale) - 1]),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) - 1]));
-    }
-    // If at bottom left corner, extrapolate row and column data
-    else if (row > c->oF->height - (int)((c->sArgs->hScale + 1) / 2)
-        && col < (int)(c->sArgs->wScale / 2))
-    {
-        return (int)BilinearInterpolate(
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) + 1]),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) - 1][(int)(col / c->sArgs->wScale) + 1]),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) - 1][(int)(col / c->sArgs->wScale)]));
-    }
-    // If at bottom right corner, extrapolate row and column data
-    else if (row > c->oF->height - (int)((c->sArgs->hScale + 1) / 2)
-        && col > c->oF->width - (int)((c->sArgs->wScale + 1) / 2))
-    {
-        return (int)BilinearInterpolate(
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) - 1]),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) - 1][(int)(col / c->sArgs->wScale)]),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) - 1][(int)(col / c->sArgs->wScale) + 1]));
-    }
-    // If at the top picture edge, extrapolate the row data for interpolation
-    else if (row < (int)(c->sArgs->hScale / 2))
-    {
-        return (int)LinearInterpolate(
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale)]),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)]);
-    }
-    // If at the bottom picture edge, extrapolate the row data for interpolation
-    else if (row > c->oF->height - (int)((c->sArgs->hScale + 1) / 2))
-    {
-        return (int)LinearInterpolate(
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale) - 1][(int)(col / c->sArgs->wScale)]));
-    }
-    // If at the left picture edge, extrapolate the column data for interpolation
-    else if (col < (int)(c->sArgs->wScale / 2))
+    // If we were unsuccessful in opening the stream report the failure
+    c->iF->fStream = fopen(c->iF->fName, "rb");
+    if (c->iF->fStream == NULL)
     {
-        return (int)LinearInterpolate(
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) + 1]),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)]);
+        fprintf(stderr, "No such file: \"%s\"\n", c->iF->fName);
+        return false;
     }
-    // If at the right picture edge, extrapolate the column data for interpolation
-    else if (col > c->oF->width - (int)((c->sArgs->wScale + 1) / 2))
+
+    c->oF->fStream = fopen(c->oF->fName, "wb");
+    if (c->oF->fStream == NULL)
     {
-        return (int)LinearInterpolate(
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-            ExtrapolateLinear(
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-                c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) - 1]));
+        fprintf(stderr, "Error, could not write \"%s\"\n", c->oF->fName);
+        fclose(c->iF->fStream);
+        c->iF->fStream = NULL;
+        return false;
     }
-    // Otherwise we're on a subrowcolumn => Bilinearly interpolate
-    else
-    {
-        row -= (int)(c->sArgs->hScale / 2);
-        col -= (int)(c->sArgs->wScale / 2);
 
-        return (int)BilinearInterpolate(
-            (col / c->sArgs->wScale) - (int)(col / c->sArgs->wScale),
-            (row / c->sArgs->hScale) - (int)(row / c->sArgs->hScale),
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale)],
-            c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale)],
-            c->data[(int)(row / c->sArgs->hScale)][(int)(col / c->sArgs->wScale) + 1],
-            c->data[(int)(row / c->sArgs->hScale) + 1][(int)(col / c->sArgs->wScale) + 1]);
-    }
+    return true;
 }
 
 
-/**
- * @brief      Returns the pixel data for a given row and column. The output
- *             dimensions have been scaled down, meaning output rows and columns
- *             are generated from combined input rows and columns. The data is
- *             calculated from the average value of the original pixels.
+/*-------------------------------------------------------------------------*//**
+ * @brief      Closes the streams of a PgmConverter struct.
  *
  * @param      c     A PgmConverter detailing conversion state information.
- * @param[in]  row   The 0-indexed row where the pixel is being written to.
- * @param[in]  col   The 0-indexed column where the pixel is being written to.
- *
- * @return     The integer value of the pixel to be written at [row, col].
  */
-int GetScaledDownBoxData(PgmConverter *c, int row, int col)
+void CloseStreams(PgmConverter *c)
 {
-    /**
-     * For example, scaling a 4x4 down by a factor of 2:
-     * 
-     *   0 1 2 3        
-     * 0 a b c d               0           1     
-     * 1 e f g h   =>   0 (a+b+e+f)/4 (c+d+g+h)/4
-     * 2 i j k l        1 (i+j+m+n)/4 (k+l+o+p)/4
-     * 3 m n o p
-    */
+    if (c->iF->fStream != NULL)
+        fclose(c->iF->fStream);
+    if (c->oF->fStream != NULL)
+        fclose(c->oF->fStream);
+}
 
-    int data = 0;
-    int count = 0;
 
-    // For each row and column to be combined into one
-    for (int rs = 0; rs < 1 / c->sArgs->hScale; rs++)
+////////////////////////////////////////////////////////////////////////////////
+//                                Byte buffers                                //
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief      Appends a byte to a buffer, growing it if required. On failure
+ *             the buffer is marked as failed and further writes are dropped.
+ *
+ * @param      b     The buffer to append to.
+ * @param[in]  byte  The byte to append.
+ */
+void PutByte(ByteBuffer *b, unsigned char byte)
+{
+    if (b->isFailed)
+        return;
+
+    if (b->length == b->capacity)
     {
-        for (int cs = 0; cs < 1 / c->sArgs->wScale; cs++)
+        size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+        unsigned char *bytes = realloc(b->bytes, capacity);
+        if (bytes == NULL)
         {
-            // Sum the pixel data for each pixel in the original set.
-            data += c->data[(int)(row / c->sArgs->hScale + rs)][(int)(col / c->sArgs->wScale + cs)];
-            count++;
+            b->isFailed = true;
+            return;
         }
-
+        b->bytes = bytes;
+        b->capacity = capacity;
     }
 
-    // // return the average pixel value 
-    return data / count;
+    b->bytes[b->length++] = byte;
 }
 
 
-////////////////////////////////////////////////////////////////////////////////
-//                              Data processing                               //
-////////////////////////////////////////////////////////////////////////////////
-
 /**
- * @brief      Extrapolates the pixel value for a row or column out of bounds of
- *             the original data set.
- *
- * @param[in]  x1    The border pixel value.
- * @param[in]  x2    The pixel value one position deeper into the image.
+ * @brief      Appends bits to a buffer, least significant bit first.
  *
- * @return     The extrpolated pixel value, within the range [0, 255]
+ * @param      b      The buffer to append to.
+ * @param[in]  value  The bits to append.
+ * @param[in]  count  The number of bits of value to append, at most 16.
  */
-int ExtrapolateLinear(int x1, int x2)
+void PutBits(ByteBuffer *b, uint32_t value, int count)
 {
-    int x0 = x1 - (x2 - x1);
-    return x0 > 255 ? 255 : x0 < 0 ? 0 : x0;
+    b->bitBuf |= value << b->bitCount;
+    b->bitCount += count;
+
+    while (b->bitCount >= 8)
+    {
+        PutByte(b, b->bitBuf & 0xFF);
+        b->bitBuf >>= 8;
+        b->bitCount -= 8;
+    }
 }
 
 
 /**
- * @brief      Linearly interpolates the various parameters. It is assumed
- *             that the interval [x1, x2]  has been scaled such that x1 = 0, and
- *             x2 = 1.
- *             Reference: https://en.wikipedia.org/wiki/Linear_interpolation
- *
- * @param[in]  x     The value of x for which to estimate f(x).
- * @param[in]  fx1   The value of f(x) at x = x1 = 0.
- * @param[in]  fx2   The value of f(x) at x = x2.
+ * @brief      Appends a huffman code to a buffer. Huffman codes are packed
+ *             most significant bit first, so the code is reversed.
  *
- * @return     Returns the rounded down estimation of f(x) at x.
+ * @param      b       The buffer to append to.
+ * @param[in]  code    The huffman code.
+ * @param[in]  length  The number of bits in the code.
  */
-double LinearInterpolate(double x, double fx1, double fx2)
+void PutHuffman(ByteBuffer *b, uint32_t code, int length)
 {
-    return ((fx1 * (1 - x)) + (fx2 * (x)));
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++)
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+
+    PutBits(b, reversed, length);
 }
 
 
 /**
- * @brief      Bilinearly interpolates the various parameters. It is assumed
- *             that the interval [x1, x2]  has been scaled such that x1 = 0, and
- *             x2 = 1.
- *             Reference: https://en.wikipedia.org/wiki/Bilinear_interpolation
+ * @brief      Pads any pending bits with zeros up to a byte boundary.
  *
- * @param[in]  x      The value of x for which to estimate f(x,y).
- * @param[in]  y      The value of y for which to estimate f(x,y).
- * @param[in]  dx     The change of x over the itnerval [x1, x2]. This function
- *                    assumes that x1 = 0 and x2 has been scaled appropriately.
- * @param[in]  dy     The change of y over the itnerval [y1, y2]. This function
- *                    assumes that y1 = 0 and y2 has been scaled appropriately.
- * @param[in]  fxy11  The value of f(x,y) at x = x1 and y = y1.
- * @param[in]  fxy12  The value of f(x,y) at x = x1 and y = y2.
- * @param[in]  fxy21  The value of f(x,y) at x = x2 and y = y1.
- * @param[in]  fxy22  The value of f(x,y) at x = x2 and y = y2.
+ * @param      b     The buffer to flush.
+ */
+void FlushBits(ByteBuffer *b)
+{
+    if (b->bitCount > 0)
+        PutBits(b, 0, 8 - b->bitCount);
+}
+
+
+/**
+ * @brief      Appends a 32 bit value to a buffer, most significant byte first.
  *
- * @return     Returns the rounded down estimation of f(x,y) at x,y.
+ * @param      b      The buffer to append to.
+ * @param[in]  value  The value to append.
  */
-double BilinearInterpolate(double x, double y, 
-    double fxy11, double fxy12, double fxy21, double fxy22)
+void PutUint32(ByteBuffer *b, uint32_t value)
 {
-    return LinearInterpolate(y,
-        LinearInterpolate(x, fxy11, fxy21),
-        LinearInterpolate(x, fxy12, fxy22));
+    PutByte(b, value >> 24);
+    PutByte(b, value >> 16);
+    PutByte(b, value >> 8);
+    PutByte(b, value);
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
-//                             Stream management                              //
+//                             Parallel execution                             //
 ////////////////////////////////////////////////////////////////////////////////
 
-/*-------------------------------------------------------------------------*//**
- * @brief      Attempts to open input and output streams of a PgmConverter.
+/**
+ * @brief      Holds the state shared by the worker threads of RunParallel.
  *
- * @param      c     A PgmConverter detailing conversion state information.
+ * @field      job    The job to run for each index.
+ * @field      arg    The argument passed to each job.
+ * @field      count  The number of job indices.
+ * @field      next   The next job index to be claimed.
+ * @field      lock   Guards next.
+ */
+typedef struct
+{
+    void (*job)(void *arg, int index);
+    void *arg;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} ParallelJobs;
+
+
+/**
+ * @brief      Returns the number of threads to use for parallel work.
  *
- * @return     Returns true when successful, false otherwise.
+ * @return     The number of online processors, at least 1.
  */
-bool TryOpenStreams(PgmConverter *c)
+int GetThreadCount(void)
 {
-    // If we were unsuccessful in opening the stream report the failure
-    c->iF->fStream = fopen(c->iF->fName, "rb");
-    if (c->iF->fStream == NULL)
-    {
-        fprintf(stderr, "No such file: \"%s\"\n", c->iF->fName);
-        return false;
-    }
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : count > 64 ? 64 : (int)count;
+}
 
-    c->oF->fStream = fopen(c->oF->fName, "wb");
 
-    return true;
+/**
+ * @brief      Claims and runs jobs until none remain. This is the body of each
+ *             worker thread of RunParallel.
+ *
+ * @param      arg   The shared ParallelJobs.
+ *
+ * @return     Always NULL.
+ */
+static void *RunParallelWorker(void *arg)
+{
+    ParallelJobs *jobs = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&jobs->lock);
+        int index = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+
+        if (index >= jobs->count)
+            return NULL;
+        jobs->job(jobs->arg, index);
+    }
 }
 
 
 /*-------------------------------------------------------------------------*//**
- * @brief      Closes the streams of a PgmConverter struct.
+ * @brief      Runs job(arg, index) for each index in [0, count), spread across
+ *             a thread per processor, and waits for them all to finish. If
+ *             threads cannot be created the remaining jobs run on the caller.
  *
- * @param      c     A PgmConverter detailing conversion state information.
+ * @param[in]  count  The number of jobs.
+ * @param[in]  job    The job to run.
+ * @param      arg    The argument passed to each job.
  */
-void CloseStreams(PgmConverter *c)
+void RunParallel(int count, void (*job)(void *arg, int index), void *arg)
 {
-    fclose(c->iF->fStream);
-    fclose(c->oF->fStream);
+    ParallelJobs jobs = { job, arg, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    pthread_t threads[64];
+    int threadCount = GetThreadCount();
+    threadCount = threadCount > count ? count : threadCount;
+
+    // The calling thread is one of the workers, so start one fewer thread
+    int started = 0;
+    while (started < threadCount - 1
+        && !pthread_create(&threads[started], NULL, RunParallelWorker, &jobs))
+        started++;
+
+    RunParallelWorker(&jobs);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
 }
 
 
@@ -1173,10 +8911,24 @@ char* PgmTypeToStr(enum PgmType type)
     // Compare the PgmType and return the matching string
     switch(type)
     {
+        case P1:
+            return "P1";
         case P2:
             return "P2";
+        case P3:
+            return "P3";
+        case P4:
+            return "P4";
         case P5:
             return "P5";
+        case P6:
+            return "P6";
+        case P7:
+            return "P7";
+        case PF:
+            return "Pf";
+        case PNG:
+            return "PNG";
         default:
             return NULL;
     }
@@ -1193,10 +8945,54 @@ char* PgmTypeToStr(enum PgmType type)
 enum PgmType StrToPgmType(char* string)
 {
     // Compare the strings and return the matching PgmType
-    if (!strcmp(string, "P2"))
+    if (!strcmp(string, "P1"))
+        return P1;
+    else if (!strcmp(string, "P2"))
         return P2;
+    else if (!strcmp(string, "P3"))
+        return P3;
+    else if (!strcmp(string, "P4"))
+        return P4;
     else if (!strcmp(string, "P5"))
         return P5;
+    else if (!strcmp(string, "P6"))
+        return P6;
+    else if (!strcmp(string, "P7"))
+        return P7;
+    else if (!strcmp(string, "Pf"))
+        return PF;
     else
         return UNKNOWN;
 }
+
+
+/**
+ * @brief      Checks whether a PgmType is a plain pnm, whose samples are ASCII
+ *             numbers and which may end in any amount of whitespace.
+ *
+ * @param[in]  type  The PgmType to check.
+ *
+ * @return     True for P1, P2 and P3, false otherwise.
+ */
+bool IsPlainPnm(enum PgmType type)
+{
+    return type == P1 || type == P2 || type == P3;
+}
+
+
+/**
+ * @brief      Converts an operation name to the orientation change it names.
+ *
+ * @param      str   The operation name, e.g. "rotate90".
+ *
+ * @return     The orientation change, or ORIENT_IDENTITY if no match.
+ */
+enum Orientation StrToOrientation(const char *str)
+{
+    static const char *names[] = { "", "rotate", "rotate90", "rotate180",
+        "rotate270", "flipH", "flipV" };
+    for (int i = ORIENT_TRANSPOSE; i <= ORIENT_FLIP_V; i++)
+        if (!strcmp(str, names[i]))
+            return i;
+    return ORIENT_IDENTITY;
+}
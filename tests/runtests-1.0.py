@@ -0,0 +1,236 @@
+#!/usr/bin/env python
+"""Golden file regression tests for pnmdump.exe.
+
+Usage: python tests/runtests-1.0.py pnmdump.exe
+
+Each test runs the exe on inputs in tests/ from a fresh directory, then
+compares everything it wrote, byte for byte, with tests/expected/[NAME]/.
+Output written to stdout is compared as a file named stdout. A test which
+is expected to fail is instead checked for its exit status and for what it
+wrote to stderr, which is compared as a file named stderr.
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+EXPECTED_DIR = os.path.join(TESTS_DIR, "expected")
+
+# Each test is (name, arguments, stdin file or None), followed by the exit
+# status if it is expected to fail. A stdin file is piped in, as a camera
+# pipeline would send frames. Arguments naming a file in tests/ are
+# given with an @ before its name; any other path is written in the test's
+# own directory.
+TESTS = [
+    ("rotate_square", ["--rotate", "@square.pgm", "out.pgm"], None),
+    ("rotate_oblong", ["--rotate", "@oblong.pgm", "out.pgm"], None),
+    ("rotate_wide", ["--rotate", "@frames_wide.pgm", "out.pgm"], None),
+    ("rotate90_square", ["--rotate90", "@square.pgm", "out.pgm"], None),
+    ("rotate90_oblong", ["--rotate90", "@oblong.pgm", "out.pgm"], None),
+    ("rotate90_wide", ["--rotate90", "@frames_wide.pgm", "out.pgm"], None),
+    ("rotate180_square", ["--rotate180", "@square.pgm", "out.pgm"], None),
+    ("rotate180_oblong", ["--rotate180", "@oblong.pgm", "out.pgm"], None),
+    ("rotate270_square", ["--rotate270", "@square.pgm", "out.pgm"], None),
+    ("rotate270_oblong", ["--rotate270", "@oblong.pgm", "out.pgm"], None),
+    ("flipH_square", ["--flipH", "@square.pgm", "out.pgm"], None),
+    ("flipH_oblong", ["--flipH", "@oblong.pgm", "out.pgm"], None),
+    ("flipV_square", ["--flipV", "@square.pgm", "out.pgm"], None),
+    ("flipV_oblong", ["--flipV", "@oblong.pgm", "out.pgm"], None),
+    ("memlimit_rotate_square", ["--mem-limit", "200", "--rotate", "@square.pgm",
+        "out.pgm"], None),
+    ("memlimit_rotate_oblong", ["--mem-limit", "30", "--rotate", "@oblong.pgm",
+        "out.pgm"], None),
+    ("memlimit_rotate90_square", ["--mem-limit", "200", "--rotate90", "@square.pgm",
+        "out.pgm"], None),
+    ("memlimit_rotate90_oblong", ["--mem-limit", "30", "--rotate90", "@oblong.pgm",
+        "out.pgm"], None),
+    ("memlimit_rotate270_square", ["--mem-limit", "200", "--rotate270", "@square.pgm",
+        "out.pgm"], None),
+    ("memlimit_rotate270_oblong", ["--mem-limit", "30", "--rotate270", "@oblong.pgm",
+        "out.pgm"], None),
+    ("memlimit_wide", ["--mem-limit", "30", "--rotate90", "@frames_wide.pgm",
+        "out.pgm"], None, 1),
+    ("chain_orient", ["--chain", "rotate90,invert,flipV", "@field.pgm",
+        "out.pgm"], None),
+    ("chain_blur", ["--chain", "blur,invert", "@field.pgm", "out.pgm"], None),
+    ("chain_threshold", ["--chain", "blur,threshold:128", "@field.pgm",
+        "out.pgm"], None),
+    ("chain_scale", ["--chain", "scaleNn:2,rotate180", "@field.pgm",
+        "out.pgm"], None),
+    ("remap", ["--remap", "@field.map", "@field.pgm", "out.pgm"], None),
+    ("warp", ["--warp", "2,0,-40,0,0.5,10,0,0,1", "@field.pgm", "out.pgm"],
+        None),
+    ("chain_blur_pulled", ["--mem-limit", "1000", "--chain", "blur,invert",
+        "@field.pgm", "out.pgm"], None),
+    ("chain_scale_pulled", ["--mem-limit", "1000", "--chain",
+        "scaleNn:2,rotate180", "@field.pgm", "out.pgm"], None),
+    ("remap_pulled", ["--mem-limit", "1000", "--remap", "@field.map",
+        "@field.pgm", "out.pgm"], None),
+    ("remap_long", ["--remap", "m" * 5000, "@field.pgm", "out.pgm"], None, 1),
+    ("warp_pulled", ["--mem-limit", "1000", "--warp", "2,0,-40,0,0.5,10,0,0,1",
+        "@field.pgm", "out.pgm"], None),
+    ("warp_long", ["--warp", "2,0,-40,0,0.5,10,0,0,1" + "0" * 1024,
+        "@field.pgm", "out.pgm"], None, 1),
+    ("stream_sizes", ["--stream", "scaleNn:2,invert"], "stream_sizes.pgm"),
+    ("stream_piped", ["--stream", "invert"], "stream_piped.pgm"),
+    ("stream_piped_pulled", ["--mem-limit", "20", "--stream", "invert"],
+        "stream_piped.pgm"),
+    ("downscale", ["--scaleBl", "1/2", "@field.pgm", "out.pgm"], None),
+    ("downscale_linear", ["--linear", "--scaleBl", "1/2", "@field.pgm",
+        "out.pgm"], None),
+    ("chain_linear", ["--linear", "--chain", "scaleBl:1/2", "@field.pgm",
+        "out.pgm"], None),
+    ("linear_wide", ["--linear", "--scaleBl", "1/2", "@frames_wide.pgm",
+        "out.pgm"], None, 1),
+    ("stack_mean", ["--stack", "mean", "@frames_a.pgm", "@frames_b.pgm",
+        "out.pgm"], None),
+    ("stack_median", ["--stack", "median", "@frames_a.pgm", "@frames_b.pgm",
+        "out.pgm"], None),
+    ("stack_max", ["--stack", "max", "@frames_a.pgm", "@frames_b.pgm",
+        "out.pgm"], None),
+    ("stack_min", ["--stack", "min", "@frames_a.pgm", "out.pgm"], None),
+    ("stack_p2_median", ["--stack", "median", "@frames_p2.pgm", "out.pgm"],
+        None),
+    ("stack_wide_mean", ["--stack", "mean", "@frames_p2.pgm",
+        "@frames_wide.pgm", "out.pgm"], None),
+    ("stack_deep_median", ["--stack", "median", "@frames_p2.pgm",
+        "@frames_p2.pgm", "@frames_wide.pgm", "@frames_wide.pgm", "out.pgm"],
+        None),
+    ("framediff_0", ["--framediff", "0"], "frames_a.pgm"),
+    ("framediff_30", ["--framediff", "30"], "frames_a.pgm"),
+    ("match", ["--match", "@mark.pgm", "@scene.pgm", "3"], None),
+    ("label_components", ["--label-components", "@blobs.pgm", "labels.pgm"],
+        None),
+    ("distance", ["--distance", "@mask.pgm", "out.pgm"], None),
+    ("distance_pfm", ["--distance", "@mask.pgm", "out.pfm"], None),
+    ("dither_fs", ["--dither", "fs", "1", "@gradient.pgm", "out.pgm"], None),
+    ("dither_bayer", ["--dither", "bayer", "2", "@gradient.pgm", "out.pgm"],
+        None),
+    ("dither_pbm", ["--dither", "fs", "1", "@gradient.pgm", "out.pbm"], None),
+    ("png_bands", ["--scaleNn", "30", "@gradient.pgm", "out.png"], None),
+    ("png_wide", ["--scaleNn", "80", "@frames_wide.pgm", "out.png"], None),
+    ("tiles", ["--tiles", "pyramid", "16", "@gradient.pgm"], None),
+    ("split", ["--split", "@frames_a.pgm", "f"], None),
+    ("concat", ["--concat", "@frames_b.pgm", "@frames_a.pgm", "out.pgm"], None),
+    ("set_comment_p5", ["--set-comment", "first line\nsecond line",
+        "@gradient.pgm", "out.pgm"], None),
+    ("set_comment_p2", ["--set-comment", "one line", "@plain.pgm", "out.pgm"],
+        None),
+    ("transcode_p2_to_p5", ["--P2toP5", "@plain.pgm", "out.pgm"], None),
+    ("transcode_p5_to_p2", ["--P5toP2", "@commented.pgm", "out.pgm"], None),
+    ("transcode_long", ["--P2toP5", "@long_plain.pgm", "out.pgm"], None),
+    ("passthrough", ["--scaleNn", "1", "@field.pgm", "out.pgm"], None),
+    ("passthrough_wide", ["--scaleNn", "1", "@deep.pgm", "out.pgm"], None),
+    ("passthrough_chain", ["--chain", "rotate90,rotate270", "@field.pgm",
+        "out.pgm"], None),
+    ("passthrough_chain_wide", ["--chain", "rotate90,rotate270",
+        "@deep.pgm", "out.pgm"], None),
+    ("passthrough_truncated", ["--scaleNn", "1", "@truncated.pgm",
+        "out.pgm"], None, 1),
+    ("raster_p2", ["--scaleNn", "1", "@plain.pgm", "out.pgm"], None),
+    ("raster_p5", ["--scaleNn", "1", "@commented.pgm", "out.pgm"], None),
+    ("raster_long", ["--scaleNn", "1", "@long_plain.pgm", "out.pgm"], None),
+    ("pfm_write", ["--P2toP5", "@gradient.pgm", "out.pfm"], None),
+    ("pfm_read", ["--P2toP5", "@gradient.pfm", "out.pgm"], None),
+    ("wide_to_p2", ["--P5toP2", "@frames_wide.pgm", "out.pgm"], None),
+    ("wide_to_p5", ["--P2toP5", "@wide_plain.pgm", "out.pgm"], None),
+    ("p1_to_p2", ["--P5toP2", "@bits_plain.pbm", "out.pgm"], None),
+    ("p4_to_p5", ["--P2toP5", "@bits.pbm", "out.pgm"], None),
+    ("p3_to_p2", ["--P5toP2", "@colour_plain.ppm", "out.pgm"], None),
+    ("p7_to_p5", ["--P2toP5", "@colour.pam", "out.pgm"], None),
+    ("pam_grey_alpha", ["--scaleNn", "1", "@grey_alpha.pam", "out.pam"],
+        None),
+    ("pam_colour_alpha", ["--scaleNn", "1", "@colour_alpha.pam", "out.pam"],
+        None),
+    ("pam_grey_alpha_down", ["--scaleBl", "1/2", "@grey_alpha.pam",
+        "out.pam"], None),
+    ("pam_colour_alpha_down", ["--scaleBl", "1/2", "@colour_alpha.pam",
+        "out.pam"], None),
+    ("pam_mismatched", ["--scaleNn", "1", "@mismatched.pam", "out.pam"],
+        None, 1),
+    ("stack_p6", ["--stack", "max", "@colour.ppm", "out.pgm"], None),
+    ("framediff_p6", ["--framediff", "0"], "colour.ppm"),
+    ("stream_p6", ["--stream", "invert"], "colour.ppm"),
+    ("split_p6", ["--split", "@colour.ppm", "f"], None),
+    ("retag_lower", ["--retag", "99", "@plain.pgm", "out.pgm"], None),
+    ("retag_raise", ["--retag", "1000", "@plain.pgm", "out.pgm"], None),
+    ("retag_below", ["--retag", "98", "@plain.pgm", "out.pgm"], None, 1),
+    ("retag_bytes", ["--retag", "256", "@gradient.pgm", "out.pgm"], None, 1),
+    ("retag_unwritable", ["--retag", "99", "@plain.pgm", "missing/out.pgm"],
+        None, 1),
+]
+
+
+def read_tree(root):
+    """Returns the files under root as a dict of relative path to bytes."""
+    files = {}
+    for dir_path, _, names in os.walk(root):
+        for name in names:
+            path = os.path.join(dir_path, name)
+            with open(path, "rb") as f:
+                files[os.path.relpath(path, root)] = f.read()
+    return files
+
+
+def run_test(exe, name, args, stdin_name, status=0):
+    """Runs one test, returning a list of its failures."""
+    work_dir = tempfile.mkdtemp(prefix="pnmdump_")
+    try:
+        args = [os.path.join(TESTS_DIR, a[1:]) if a.startswith("@") else a
+            for a in args]
+        stdin = None
+        if stdin_name:
+            with open(os.path.join(TESTS_DIR, stdin_name), "rb") as f:
+                stdin = f.read()
+        result = subprocess.run([exe] + args, cwd=work_dir, input=stdin,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        if result.returncode != status:
+            return ["exit status %d: %s" % (result.returncode,
+                result.stderr.decode(errors="replace").strip())]
+
+        # A failure is checked by its message alone
+        expected = read_tree(os.path.join(EXPECTED_DIR, name))
+        if status != 0:
+            actual = {"stderr": result.stderr}
+        else:
+            actual = read_tree(work_dir)
+            if result.stdout:
+                actual["stdout"] = result.stdout
+
+        failures = []
+        for path in sorted(set(actual) | set(expected)):
+            if path not in actual:
+                failures.append("%s was not written" % path)
+            elif path not in expected:
+                failures.append("%s was not expected" % path)
+            elif actual[path] != expected[path]:
+                failures.append("%s differs" % path)
+        return failures
+    finally:
+        shutil.rmtree(work_dir)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("Usage: python tests/runtests-1.0.py pnmdump.exe\n")
+        return 2
+    exe = os.path.abspath(sys.argv[1])
+
+    failed = 0
+    for test in TESTS:
+        name = test[0]
+        failures = run_test(exe, *test)
+        print("%s %s" % ("FAIL" if failures else "PASS", name))
+        for failure in failures:
+            print("    " + failure)
+        failed += 1 if failures else 0
+
+    print("%d of %d tests passed" % (len(TESTS) - failed, len(TESTS)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())